@@ -0,0 +1,781 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "AstCache.h"
+#include "Parser.h"
+#include "Engine.h"
+#include "Snapshot.h"
+
+// Benchmark suite: microbenchmarks of every compiler phase on a synthetic
+// workload, the runtime of the sample programs in programs/ under the JIT
+// and the time to a session's first evaluation with prelude.ks. Each benchmark sets up its input on every repetition and times only
+// the work it is named after; the JSON it writes is stable (same benchmarks,
+// same keys, same order) so runs can be compared by a script.
+//
+// With --baseline it is also the perf gate of ctest: it fails when a
+// benchmark regressed against baselines.json by more than its tolerance, and
+// --history keeps every gate run.
+
+static llvm::cl::opt<unsigned> repetitions("repetitions", llvm::cl::desc("Timed repetitions of every benchmark"),
+                                           llvm::cl::init(5));
+static llvm::cl::opt<unsigned> warmup("warmup", llvm::cl::desc("Untimed repetitions before the timed ones"),
+                                      llvm::cl::init(1));
+static llvm::cl::opt<unsigned> numFunctions("functions", llvm::cl::desc("Functions in the synthetic compile workload"),
+                                            llvm::cl::init(200));
+static llvm::cl::opt<std::string> filter("filter", llvm::cl::desc("Only run benchmarks whose name matches this regex"),
+                                         llvm::cl::init("."));
+static llvm::cl::opt<std::string> programsDir("programs", llvm::cl::desc("Directory of the sample programs"),
+                                              llvm::cl::init(KAL_BENCH_PROGRAMS));
+static llvm::cl::opt<std::string> preludePath("prelude", llvm::cl::desc("Prelude of the startup benchmarks"),
+                                              llvm::cl::init(KAL_BENCH_PRELUDE));
+static llvm::cl::opt<std::string> outputPath("o", llvm::cl::desc("Write the JSON results here instead of stdout"),
+                                             llvm::cl::value_desc("filename"), llvm::cl::init("-"));
+static llvm::cl::opt<std::string> baselinePath("baseline", llvm::cl::desc("Fail if a benchmark regressed against this baseline"),
+                                               llvm::cl::value_desc("filename"));
+static llvm::cl::opt<double> defaultTolerance("tolerance", llvm::cl::desc("Tolerance of baseline entries that set none"),
+                                              llvm::cl::init(0.25));
+static llvm::cl::opt<std::string> historyPath("history", llvm::cl::desc("Append the results to this JSON lines file"),
+                                              llvm::cl::value_desc("filename"));
+static llvm::cl::opt<std::string> writeBaselinePath("write-baseline", llvm::cl::desc("Write the results as a baseline"),
+                                                    llvm::cl::value_desc("filename"));
+
+using Clock = std::chrono::steady_clock;
+
+/// Benchmark - `run` performs one repetition and returns the nanoseconds of
+/// its measured part; `items` units of work (tokens, functions, ...) are done
+/// per repetition. Benchmarks that measure memory also store the resident
+/// memory each item took in `rssKbPerItem`.
+struct Benchmark {
+    std::string name;
+    std::string unit;
+    uint64_t items;
+    std::function<double()> run;
+    std::shared_ptr<double> rssKbPerItem{};
+};
+
+static double elapsedNs(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static long residentKb() {
+    long pages = 0, resident = 0;
+    std::ifstream statm{"/proc/self/statm"};
+    statm >> pages >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/// workload - a program of `functions` definitions that exercises every kind
+/// of expression codegen has: locals, loops, branches and calls.
+static std::string workload(unsigned functions) {
+    std::string src{};
+    for (unsigned i = 0; i < functions; ++i) {
+        auto n = std::to_string(i);
+        auto callee = i ? "f" + std::to_string(i - 1) + "(a, y)" : std::string{"x"};
+        src += "def f" + n + "(x y)\n"
+               "  var a = x * 0.5, b = y + " + n + " in\n"
+               "    (for k = 0, k < 4 in a = a + b * k - 1) +\n"
+               "    (if a < b then " + callee + " else a * b - " + n + ");\n";
+    }
+    return src;
+}
+
+/// expression - one long expression for parseExpression.
+static std::string expression(unsigned terms) {
+    std::string src{"0"};
+    for (unsigned i = 0; i < terms; ++i) {
+        src += " + (a" + std::to_string(i % 16) + " - 1.5) * b < c(" + std::to_string(i) + ", d)";
+    }
+    return src;
+}
+
+static uint64_t countTokens(const std::string &src) {
+    std::istringstream input{src};
+    resetLexer(&input);
+    uint64_t tokens = 0;
+    while (getTok() != tokEof) {
+        ++tokens;
+    }
+    resetLexer(nullptr);
+    return tokens;
+}
+
+/// TemporaryFile - the input file of a benchmark, written by its first
+/// repetition (so a filtered out benchmark costs nothing) and removed with
+/// the benchmark.
+struct TemporaryFile {
+    std::string path;
+
+    ~TemporaryFile() {
+        if (!path.empty()) {
+            llvm::sys::fs::remove(path);
+        }
+    }
+};
+
+/// Session - a context and debug info to parse and codegen into, without
+/// debug info so the benchmarks measure codegen proper.
+struct Session {
+    std::shared_ptr<LLVMContext> llvmContext = std::make_shared<LLVMContext>();
+    std::shared_ptr<ast::DebugInfo> ksDebugInfo = std::make_shared<ast::DebugInfo>(llvmContext);
+
+    explicit Session(bool jit = false, bool jitLink = false) {
+        if (jitLink) {
+            llvmContext->useJitLink();
+        }
+        if (jit) {
+            llvmContext->initializeJit();
+        }
+        ksDebugInfo->initializeCompileUnit("<bench>", ".", ast::DebugLevel::None);
+    }
+
+    ~Session() {
+        // prototypes hold on to the context, drop them so it can be released.
+        llvmContext->getSymbols().clear();
+    }
+
+    /// parse - the definitions of `src`; its externs are declared right away.
+    std::vector<std::unique_ptr<ast::FunctionAST>> parse(const std::string &src) {
+        std::istringstream input{src};
+        resetLexer(&input);
+        getNextToken();
+        std::vector<std::unique_ptr<ast::FunctionAST>> definitions{};
+        while (curTok == tokDef || curTok == tokExtern) {
+            if (curTok == tokDef) {
+                definitions.push_back(parseDefinition(llvmContext, ksDebugInfo));
+            } else if (auto proto = parseExtern(llvmContext, ksDebugInfo)) {
+                auto name = proto->getName();
+                llvmContext->getSymbols().exchange(name, std::move(proto));
+            }
+            if (curTok == ';') {
+                getNextToken();
+            }
+        }
+        resetLexer(nullptr);
+        return definitions;
+    }
+};
+
+/// ParsedWorkload - definitions shared by the repetitions of the ast.*
+/// benchmarks.
+struct ParsedWorkload {
+    std::unique_ptr<Session> session;
+    std::vector<std::unique_ptr<ast::FunctionAST>> definitions{};
+};
+
+/// NodeCounter - the cheapest pass there is, to time the dispatch itself.
+struct NodeCounter: ast::ExprVisitor<NodeCounter, uint64_t> {
+    uint64_t visitNumber(const ast::NumberExprAST &) {
+        return 1;
+    }
+
+    uint64_t visitVariable(const ast::VariableExprAST &) {
+        return 1;
+    }
+
+    uint64_t visitUnary(const ast::UnaryExprAST &e) {
+        return 1 + visit(e.getOperand());
+    }
+
+    uint64_t visitBinary(const ast::BinaryExprAST &e) {
+        return 1 + visit(e.getLHS()) + visit(e.getRHS());
+    }
+
+    uint64_t visitCall(const ast::CallexprAST &e) {
+        uint64_t count = 1;
+        for (const auto &arg: e.getArgs()) {
+            count += visit(*arg);
+        }
+        return count;
+    }
+
+    uint64_t visitIf(const ast::IfExprAST &e) {
+        return 1 + visit(e.getCond()) + visit(e.getThen()) + visit(e.getElse());
+    }
+
+    uint64_t visitFor(const ast::ForExprAST &e) {
+        return 1 + visit(e.getStart()) + visit(e.getEnd()) + (e.getStep() ? visit(*e.getStep()) : 0) +
+               visit(e.getBody());
+    }
+
+    uint64_t visitWhile(const ast::WhileExprAST &e) {
+        return 1 + visit(e.getEnd()) + visit(e.getBody());
+    }
+
+    uint64_t visitVar(const ast::VarExprAST &e) {
+        uint64_t count = 1;
+        for (const auto &namedVar: e.getVarNames()) {
+            count += namedVar.second ? visit(*namedVar.second) : 0;
+        }
+        return count + visit(e.getBody());
+    }
+};
+
+/// benchmarkSink - where benchmarks leave results the optimizer must not
+/// drop.
+static volatile uint64_t benchmarkSink;
+
+static std::vector<Benchmark> compilerBenchmarks() {
+    auto src = workload(numFunctions);
+    // the lexer is fast enough to need more input for stable times.
+    auto lexSrc = workload(numFunctions * 10);
+    auto expr = expression(numFunctions * 4);
+    auto functions = uint64_t(numFunctions);
+    std::vector<Benchmark> benchmarks{};
+
+    benchmarks.push_back({"lex.getTok", "tokens", countTokens(lexSrc), [lexSrc] {
+        std::istringstream input{lexSrc};
+        resetLexer(&input);
+        auto start = Clock::now();
+        while (getTok() != tokEof) {
+        }
+        auto ns = elapsedNs(start);
+        resetLexer(nullptr);
+        return ns;
+    }});
+
+    benchmarks.push_back({"parse.parseExpression", "tokens", countTokens(expr), [expr] {
+        Session session{};
+        std::istringstream input{expr};
+        resetLexer(&input);
+        auto start = Clock::now();
+        getNextToken();
+        auto ast = parseExpression(session.llvmContext, session.ksDebugInfo);
+        auto ns = elapsedNs(start);
+        resetLexer(nullptr);
+        if (!ast) {
+            std::cerr << "parse.parseExpression: parse failed" << std::endl;
+            std::exit(1);
+        }
+        return ns;
+    }});
+
+    // parse.definitions parses the whole workload, parse.astcache builds the
+    // same definitions from its AstCache (--ast-cache) instead.
+    benchmarks.push_back({"parse.definitions", "functions", functions, [src] {
+        Session session{};
+        auto start = Clock::now();
+        auto definitions = session.parse(src);
+        return elapsedNs(start);
+    }});
+
+    auto cacheFile = std::make_shared<TemporaryFile>();
+    benchmarks.push_back({"parse.astcache", "functions", functions, [src, cacheFile] {
+        auto &cachePath = cacheFile->path;
+        if (cachePath.empty()) {
+            Session session{};
+            AstCacheWriter writer{};
+            for (auto &fnAst: session.parse(src)) {
+                writer.addDefinition(*fnAst);
+            }
+            llvm::SmallString<128> path{};
+            if (auto ec = llvm::sys::fs::createTemporaryFile("kal_bench", "kast", path)) {
+                std::cerr << "parse.astcache: " << ec.message() << std::endl;
+                std::exit(1);
+            }
+            cachePath = path.str().str();
+            if (auto err = writer.write(cachePath, AstCache::hashSource(src), src.size())) {
+                std::cerr << "parse.astcache: " << llvm::toString(std::move(err)) << std::endl;
+                std::exit(1);
+            }
+        }
+        Session session{};
+        auto start = Clock::now();
+        auto cache = AstCache::load(cachePath, AstCache::hashSource(src), src.size());
+        if (!cache) {
+            std::cerr << "parse.astcache: " << llvm::toString(cache.takeError()) << std::endl;
+            std::exit(1);
+        }
+        std::vector<std::unique_ptr<ast::FunctionAST>> definitions{};
+        for (size_t i = 0; i < (*cache)->getNumItems(); ++i) {
+            definitions.push_back((*cache)->buildDefinition(i, session.llvmContext, session.ksDebugInfo));
+        }
+        return elapsedNs(start);
+    }});
+
+    // ast.* time a pass over the definitions of a larger workload, parsed
+    // once by the first repetition: ast.visit only dispatches, the others are
+    // the passes over expressions the compiler runs.
+    auto parsed = std::make_shared<ParsedWorkload>();
+    auto traversal = [parsed](std::function<uint64_t(const ast::FunctionAST&)> pass) {
+        return [parsed, pass] {
+            if (!parsed->session) {
+                parsed->session = std::make_unique<Session>();
+                parsed->definitions = parsed->session->parse(workload(numFunctions * 10));
+            }
+            uint64_t result = 0;
+            auto start = Clock::now();
+            for (const auto &fnAst: parsed->definitions) {
+                result += pass(*fnAst);
+            }
+            auto ns = elapsedNs(start);
+            benchmarkSink = result;
+            return ns;
+        };
+    };
+    auto astFunctions = functions * 10;
+    benchmarks.push_back({"ast.visit", "functions", astFunctions, traversal([](const ast::FunctionAST &fnAst) {
+        return NodeCounter{}.visit(fnAst.getBody());
+    })});
+    benchmarks.push_back({"ast.hash", "functions", astFunctions, traversal([](const ast::FunctionAST &fnAst) {
+        return uint64_t(fnAst.getBody().hash());
+    })});
+    benchmarks.push_back({"ast.callees", "functions", astFunctions, traversal([](const ast::FunctionAST &fnAst) {
+        std::set<std::string> callees{};
+        fnAst.getBody().collectCallees(callees);
+        return uint64_t(callees.size());
+    })});
+    benchmarks.push_back({"ast.dump", "functions", astFunctions, traversal([](const ast::FunctionAST &fnAst) {
+        llvm::raw_null_ostream out{};
+        fnAst.getBody().dump(out, 0);
+        return out.tell();
+    })});
+    benchmarks.push_back({"ast.serialize", "functions", astFunctions, traversal([](const ast::FunctionAST &fnAst) {
+        AstCacheWriter writer{};
+        writer.addDefinition(fnAst);
+        return uint64_t(1);
+    })});
+
+    benchmarks.push_back({"codegen.FunctionAST", "functions", functions, [src] {
+        Session session{};
+        auto definitions = session.parse(src);
+        auto start = Clock::now();
+        for (auto &fnAst: definitions) {
+            fnAst->codegen();
+        }
+        return elapsedNs(start);
+    }});
+
+    benchmarks.push_back({"emit.object", "functions", functions, [src] {
+        Session session{};
+        for (auto &fnAst: session.parse(src)) {
+            fnAst->codegen();
+        }
+        llvm::SmallString<128> path{};
+        if (auto ec = llvm::sys::fs::createTemporaryFile("kal_bench", "o", path)) {
+            std::cerr << "emit.object: " << ec.message() << std::endl;
+            std::exit(1);
+        }
+        auto start = Clock::now();
+        auto ok = LLVMContext::emitObjectFile(*session.llvmContext->getModule(), path.str().str());
+        auto ns = elapsedNs(start);
+        llvm::sys::fs::remove(path);
+        if (!ok) {
+            std::exit(1);
+        }
+        return ns;
+    }});
+
+    // jit.add hands every definition to the JIT as codegenDefinition does;
+    // the code is only compiled and linked by the first lookup
+    // (jit.materialize), later lookups are answered by the JIT's symbol cache
+    // (jit.lookup).
+    // The jitlink.* benchmarks link with JITLink instead of RuntimeDyld.
+    // Materializing also measures how much resident memory a module takes;
+    // freed heap is reused across repetitions, so this is mostly the memory
+    // the linker maps for the code.
+    auto jitBenchmark = [src](int stage, bool jitLink, std::shared_ptr<double> rssKbPerItem) {
+        return [src, stage, jitLink, rssKbPerItem] {
+            Session session{true, jitLink};
+            auto rssBefore = residentKb();
+            std::vector<std::string> names{};
+            double ns = 0;
+            for (auto &fnAst: session.parse(src)) {
+                auto key = fnAst->definitionKey();
+                auto *fnIR = fnAst->codegen();
+                if (!fnIR) {
+                    continue;
+                }
+                names.push_back(fnIR->getName().str());
+                auto start = Clock::now();
+                auto err = session.llvmContext->handleDefinition(names.back(), std::move(key));
+                ns += elapsedNs(start);
+                if (err) {
+                    std::cerr << "jit.add: " << llvm::toString(std::move(err)) << std::endl;
+                    std::exit(1);
+                }
+            }
+            for (int round = 1; round <= stage; ++round) {
+                auto start = Clock::now();
+                for (const auto &name: names) {
+                    auto symbol = session.llvmContext->getJit()->lookup(name);
+                    if (!symbol) {
+                        std::cerr << "jit lookup: " << llvm::toString(symbol.takeError()) << std::endl;
+                        std::exit(1);
+                    }
+                }
+                if (round == stage) {
+                    ns = elapsedNs(start);
+                }
+            }
+            if (rssKbPerItem) {
+                *rssKbPerItem = double(residentKb() - rssBefore) / std::max<size_t>(names.size(), 1);
+            }
+            return ns;
+        };
+    };
+    for (auto jitLink: {false, true}) {
+        std::string prefix = jitLink ? "jitlink." : "jit.";
+        auto memory = std::make_shared<double>(0);
+        benchmarks.push_back({prefix + "add", "functions", functions, jitBenchmark(0, jitLink, nullptr)});
+        benchmarks.push_back({prefix + "materialize", "functions", functions, jitBenchmark(1, jitLink, memory), memory});
+        benchmarks.push_back({prefix + "lookup", "functions", functions, jitBenchmark(2, jitLink, nullptr)});
+    }
+    return benchmarks;
+}
+
+/// runtimeBenchmarks - run() of every program in programs/, compiled by the
+/// JIT once and called once per repetition.
+static std::vector<Benchmark> runtimeBenchmarks() {
+    std::vector<std::string> paths{};
+    std::error_code ec;
+    for (llvm::sys::fs::directory_iterator it{programsDir, ec}, end; it != end && !ec; it.increment(ec)) {
+        if (llvm::sys::path::extension(it->path()) == ".ks") {
+            paths.push_back(it->path());
+        }
+    }
+    if (ec) {
+        std::cerr << "Could not read " << programsDir << ": " << ec.message() << std::endl;
+        std::exit(1);
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<Benchmark> benchmarks{};
+    for (const auto &path: paths) {
+        auto name = "run." + llvm::sys::path::stem(path).str();
+        // compiled by the first repetition, so filtered out programs cost
+        // nothing.
+        std::shared_ptr<kal::Engine> engine{};
+        benchmarks.push_back({name, "calls", 1, [path, name, engine]() mutable {
+            if (!engine) {
+                auto buffer = llvm::MemoryBuffer::getFile(path);
+                engine = std::make_shared<kal::Engine>();
+                if (!buffer || !engine->compile((*buffer)->getBuffer().str())) {
+                    std::cerr << name << ": could not compile " << path << std::endl;
+                    std::exit(1);
+                }
+            }
+            auto *run = engine->lookup<double()>("run");
+            if (!run) {
+                std::cerr << name << ": " << path << " defines no run()" << std::endl;
+                std::exit(1);
+            }
+            auto start = Clock::now();
+            run();
+            return elapsedNs(start);
+        }});
+    }
+    return benchmarks;
+}
+
+/// startupBenchmarks - a new session up to the result of its first
+/// evaluation, which calls into the prelude: with the prelude compiled from
+/// source, and loaded from a snapshot written once up front.
+static std::vector<Benchmark> startupBenchmarks() {
+    // exercises the loops of the prelude, including their n = 0 case.
+    static const std::string firstExpr = "norm2(3, 4) + fib(10) + 3 ^ 4 + 2 ^ 0 + poly(2, 1, 2, 3) + sum(4) + sum(0)";
+    static constexpr double firstValue = 25 + 55 + 81 + 1 + 11 + 10 + 0;
+    auto buffer = llvm::MemoryBuffer::getFile(preludePath);
+    if (!buffer) {
+        std::cerr << "Could not read " << preludePath << ": " << buffer.getError().message() << std::endl;
+        std::exit(1);
+    }
+    auto src = (*buffer)->getBuffer().str();
+    auto firstEvaluation = [](kal::Engine &engine, const char *name) {
+        auto value = engine.evaluate(firstExpr);
+        if (!value) {
+            std::cerr << name << ": could not evaluate " << firstExpr << std::endl;
+            std::exit(1);
+        }
+        if (*value != firstValue) {
+            std::cerr << name << ": " << firstExpr << " is " << *value << ", expected " << firstValue << std::endl;
+            std::exit(1);
+        }
+    };
+
+    std::vector<Benchmark> benchmarks{};
+    benchmarks.push_back({"startup.source", "calls", 1, [src, firstEvaluation] {
+        auto start = Clock::now();
+        kal::Engine engine{};
+        if (!engine.compile(src)) {
+            std::cerr << "startup.source: could not compile " << preludePath << std::endl;
+            std::exit(1);
+        }
+        firstEvaluation(engine, "startup.source");
+        return elapsedNs(start);
+    }});
+
+    auto snapshotFile = std::make_shared<TemporaryFile>();
+    benchmarks.push_back({"startup.snapshot", "calls", 1, [src, firstEvaluation, snapshotFile] {
+        auto &snapshotPath = snapshotFile->path;
+        if (snapshotPath.empty()) {
+            Session session{};
+            for (auto &fnAst: session.parse(src)) {
+                fnAst->codegen();
+            }
+            llvm::SmallString<128> path{};
+            if (auto ec = llvm::sys::fs::createTemporaryFile("kal_bench", "kss", path)) {
+                std::cerr << "startup.snapshot: " << ec.message() << std::endl;
+                std::exit(1);
+            }
+            snapshotPath = path.str().str();
+            auto &module = *session.llvmContext->getModule();
+            if (auto err = PreludeSnapshot::write(module, session.llvmContext->getSymbols(), snapshotPath,
+                                                  PreludeSnapshot::definedFunctions(module))) {
+                std::cerr << "startup.snapshot: " << llvm::toString(std::move(err)) << std::endl;
+                std::exit(1);
+            }
+        }
+        auto start = Clock::now();
+        kal::Engine engine{};
+        auto snapshot = kal::Engine::loadSnapshot(snapshotPath);
+        if (!snapshot || !engine.loadPrelude(snapshot)) {
+            std::exit(1);
+        }
+        firstEvaluation(engine, "startup.snapshot");
+        return elapsedNs(start);
+    }});
+    return benchmarks;
+}
+
+/// Result - the statistics of one benchmark over the repetitions.
+struct Result {
+    std::string name;
+    std::string unit;
+    uint64_t items;
+    double minMs, medianMs, meanMs, maxMs;
+    // median over the repetitions, negative when not measured.
+    double rssKbPerItem = -1;
+
+    double itemsPerSecond() const {
+        return medianMs > 0 ? items * 1e3 / medianMs : 0.0;
+    }
+
+    /// gatedMetric - what the perf gate compares: the throughput of the
+    /// compiler benchmarks, the runtime of the programs.
+    const char* gatedMetric() const {
+        return unit == "calls" ? "median_ms" : "items_per_second";
+    }
+
+    double metric(llvm::StringRef key) const {
+        return key == "median_ms" ? medianMs : itemsPerSecond();
+    }
+
+    llvm::json::Value toJson() const {
+        llvm::json::Object object{{"name", name}, {"unit", unit}, {"items", int64_t(items)},
+                                  {"min_ms", minMs}, {"median_ms", medianMs}, {"mean_ms", meanMs},
+                                  {"max_ms", maxMs}, {"items_per_second", itemsPerSecond()}};
+        if (rssKbPerItem >= 0) {
+            object["rss_kb_per_item"] = rssKbPerItem;
+        }
+        return object;
+    }
+};
+
+static Result measure(const Benchmark &benchmark) {
+    for (unsigned i = 0; i < warmup; ++i) {
+        benchmark.run();
+    }
+    std::vector<double> samples{}, memory{};
+    for (unsigned i = 0; i < std::max(1u, unsigned(repetitions)); ++i) {
+        samples.push_back(benchmark.run() / 1e6);
+        if (benchmark.rssKbPerItem) {
+            memory.push_back(*benchmark.rssKbPerItem);
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    auto mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    Result result{benchmark.name, benchmark.unit, benchmark.items, samples.front(), samples[samples.size() / 2],
+                  mean, samples.back()};
+    if (!memory.empty()) {
+        std::sort(memory.begin(), memory.end());
+        result.rssKbPerItem = memory[memory.size() / 2];
+    }
+    return result;
+}
+
+static llvm::Expected<llvm::json::Value> loadJson(const std::string &path) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        return llvm::createStringError(buffer.getError(), "could not read %s: %s", path.c_str(),
+                                       buffer.getError().message().c_str());
+    }
+    auto value = llvm::json::parse((*buffer)->getBuffer());
+    if (!value) {
+        return value.takeError();
+    }
+    auto *object = value->getAsObject();
+    if (!object || object->getString("format") != llvm::StringRef{"kaleidoscope-bench-baseline"}) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s is not a kal_bench baseline", path.c_str());
+    }
+    return value;
+}
+
+/// checkBaseline - compare every result with its baseline entry, which
+/// gates one metric: a throughput (items_per_second) may not drop, a runtime
+/// (median_ms) may not grow, by more than the entry's tolerance (a fraction).
+/// Benchmarks without an entry are reported but never fail.
+static bool checkBaseline(const std::vector<Result> &results, const llvm::json::Object &baseline) {
+    const auto *entries = baseline.getObject("benchmarks");
+    auto passed = true;
+    std::cerr << "Comparing with " << baselinePath << ":" << std::endl;
+    for (const auto &result: results) {
+        const auto *entry = entries ? entries->getObject(result.name) : nullptr;
+        if (!entry) {
+            std::cerr << llvm::formatv("  {0,-24} no baseline\n", result.name).str();
+            continue;
+        }
+        auto key = entry->getString("metric").getValueOr(result.gatedMetric());
+        auto expected = entry->getNumber("value").getValueOr(0);
+        auto tolerance = entry->getNumber("tolerance").getValueOr(defaultTolerance);
+        auto actual = result.metric(key);
+        auto higherIsBetter = key != "median_ms";
+        auto change = expected > 0 ? actual / expected - 1 : 0.0;
+        auto regressed = higherIsBetter ? change < -tolerance : change > tolerance;
+        passed = passed && !regressed;
+        std::cerr << llvm::formatv("  {0,-24} {1,-17} {2,14:f2} baseline {3,14:f2} {4,8:f1}% (tolerance {5:f0}%){6}\n",
+                                   result.name, key, actual, expected, change * 100, tolerance * 100,
+                                   regressed ? "  REGRESSION" : "").str();
+    }
+    return passed;
+}
+
+/// appendHistory - one line of JSON per run, so that a history file can be
+/// appended to by every gate run and read back line by line.
+static bool appendHistory(const std::vector<Result> &results, bool passed) {
+    std::error_code ec;
+    llvm::raw_fd_ostream out{historyPath, ec, llvm::sys::fs::OF_Append | llvm::sys::fs::OF_Text};
+    if (ec) {
+        std::cerr << "Could not open " << historyPath << ": " << ec.message() << std::endl;
+        return false;
+    }
+    llvm::json::Array benchmarks{};
+    for (const auto &result: results) {
+        benchmarks.push_back(result.toJson());
+    }
+    out << llvm::json::Value(llvm::json::Object{{"time", int64_t(std::time(nullptr))},
+                                                {"functions", int64_t(numFunctions)},
+                                                {"repetitions", int64_t(repetitions)},
+                                                {"baseline", baselinePath},
+                                                {"passed", passed},
+                                                {"benchmarks", std::move(benchmarks)}})
+        << "\n";
+    return true;
+}
+
+/// writeBaseline - this run as the new baseline, keeping the tolerances of
+/// the old one.
+static bool writeBaseline(const std::vector<Result> &results, const llvm::json::Object *old) {
+    const auto *oldEntries = old ? old->getObject("benchmarks") : nullptr;
+    llvm::json::Object entries{};
+    for (const auto &result: results) {
+        const auto *oldEntry = oldEntries ? oldEntries->getObject(result.name) : nullptr;
+        auto tolerance = oldEntry ? oldEntry->getNumber("tolerance").getValueOr(defaultTolerance) : defaultTolerance;
+        // whole numbers from 100 up, there is no point in more digits.
+        auto value = result.metric(result.gatedMetric());
+        entries[result.name] = llvm::json::Object{{"metric", result.gatedMetric()},
+                                                  {"value", value < 100 ? llvm::json::Value(value)
+                                                                        : llvm::json::Value(std::llround(value))},
+                                                  {"tolerance", tolerance}};
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream out{writeBaselinePath, ec, llvm::sys::fs::OF_Text};
+    if (ec) {
+        std::cerr << "Could not open " << writeBaselinePath << ": " << ec.message() << std::endl;
+        return false;
+    }
+    out << llvm::formatv("{0:2}", llvm::json::Value(llvm::json::Object{
+        {"format", "kaleidoscope-bench-baseline"},
+        {"version", 1},
+        {"functions", int64_t(numFunctions)},
+        {"benchmarks", std::move(entries)}})) << "\n";
+    return true;
+}
+
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope benchmark suite\n");
+
+    llvm::Regex pattern{filter};
+    std::string error{};
+    if (!pattern.isValid(error)) {
+        std::cerr << "Invalid --filter: " << error << std::endl;
+        return 1;
+    }
+
+    llvm::Optional<llvm::json::Value> baseline{};
+    if (!baselinePath.empty()) {
+        auto loaded = loadJson(baselinePath);
+        if (!loaded) {
+            std::cerr << llvm::toString(loaded.takeError()) << std::endl;
+            return 1;
+        }
+        baseline = std::move(*loaded);
+        auto functions = baseline->getAsObject()->getInteger("functions");
+        if (functions && *functions != numFunctions) {
+            std::cerr << baselinePath << " was measured with --functions=" << *functions << std::endl;
+            return 1;
+        }
+    }
+
+    auto benchmarks = compilerBenchmarks();
+    auto runtime = runtimeBenchmarks();
+    benchmarks.insert(benchmarks.end(), runtime.begin(), runtime.end());
+    auto startup = startupBenchmarks();
+    benchmarks.insert(benchmarks.end(), startup.begin(), startup.end());
+
+    std::vector<Result> results{};
+    for (const auto &benchmark: benchmarks) {
+        if (pattern.match(benchmark.name)) {
+            std::cerr << benchmark.name << "..." << std::endl;
+            results.push_back(measure(benchmark));
+        }
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream out{outputPath, ec, llvm::sys::fs::OF_Text};
+    if (ec) {
+        std::cerr << "Could not open " << outputPath << ": " << ec.message() << std::endl;
+        return 1;
+    }
+    llvm::json::OStream json{out, 2};
+    json.object([&] {
+        json.attribute("format", "kaleidoscope-bench");
+        json.attribute("version", 1);
+        json.attribute("repetitions", int64_t(repetitions));
+        json.attribute("functions", int64_t(numFunctions));
+        json.attributeArray("benchmarks", [&] {
+            for (const auto &result: results) {
+                json.value(result.toJson());
+            }
+        });
+    });
+    out << "\n";
+    out.flush();
+
+    auto passed = !baseline || checkBaseline(results, *baseline->getAsObject());
+    if (!historyPath.empty() && !appendHistory(results, passed)) {
+        return 1;
+    }
+    if (!writeBaselinePath.empty() && !writeBaseline(results, baseline ? baseline->getAsObject() : nullptr)) {
+        return 1;
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "llvm/Support/CommandLine.h"
+
+// Generates valid Kaleidoscope programs of any size for scale testing. The
+// same options and seed always give the same program, on every platform.
+// Functions only call functions defined before them, so the call graph is a
+// DAG and every function can be compiled (and run) on its own.
+
+static llvm::cl::opt<uint64_t> seed("seed", llvm::cl::desc("Random seed"), llvm::cl::init(1));
+static llvm::cl::opt<unsigned> numFunctions("functions", llvm::cl::desc("Functions to define"), llvm::cl::init(100));
+static llvm::cl::opt<unsigned> depth("depth", llvm::cl::desc("Depth of the expression trees in function bodies"),
+                                     llvm::cl::init(4));
+static llvm::cl::opt<unsigned> fanout("fanout", llvm::cl::desc("Calls every function makes to earlier ones"),
+                                      llvm::cl::init(2));
+static llvm::cl::opt<unsigned> loopNesting("loops", llvm::cl::desc("Nesting of the for loops in every function"),
+                                           llvm::cl::init(1));
+static llvm::cl::opt<unsigned> varScopes("vars", llvm::cl::desc("Nested var scopes in every function"),
+                                         llvm::cl::init(2));
+static llvm::cl::opt<unsigned> binaryOperators("operators", llvm::cl::desc("User-defined binary operators (at most 7)"),
+                                               llvm::cl::init(3));
+static llvm::cl::opt<unsigned> unaryOperators("unary-operators", llvm::cl::desc("User-defined unary operators (at most 2)"),
+                                              llvm::cl::init(1));
+
+static const std::string binaryOperatorChars = "|&^%@$>";
+static const std::string unaryOperatorChars = "!~";
+
+/// Generator - splitmix64, so that a seed means the same program everywhere
+/// (the distributions of <random> are implementation defined).
+class Generator {
+    uint64_t state;
+    std::string out{};
+    std::vector<unsigned> arities{};
+    std::vector<std::string> scope{};
+    // operators may not use operators, they are not all defined yet.
+    bool builtinOperators = true;
+
+    uint64_t next() {
+        auto z = (state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+    unsigned pick(unsigned n) {
+        return unsigned(next() % n);
+    }
+
+    std::string number() {
+        return std::to_string(pick(100)) + (pick(2) ? ".5" : "");
+    }
+
+    std::string call(unsigned callee, unsigned argDepth) {
+        auto text = "f" + std::to_string(callee) + "(";
+        for (unsigned a = 0; a < arities[callee]; ++a) {
+            text += (a ? ", " : "") + expr(argDepth);
+        }
+        return text + ")";
+    }
+
+    std::string expr(unsigned d) {
+        if (d == 0) {
+            return scope.empty() || pick(3) == 0 ? number() : scope[pick(scope.size())];
+        }
+        switch (pick(6)) {
+            case 0:
+                return "(if " + expr(d - 1) + " < " + expr(d - 1) + " then " + expr(d - 1) + " else " + expr(d - 1) + ")";
+            case 1:
+                if (unaryOperators && !builtinOperators) {
+                    return std::string(1, unaryOperatorChars[pick(unaryOperators)]) + "(" + expr(d - 1) + ")";
+                }
+                [[fallthrough]];
+            case 2:
+                if (binaryOperators && !builtinOperators) {
+                    return "(" + expr(d - 1) + " " + binaryOperatorChars[pick(binaryOperators)] + " " + expr(d - 1) + ")";
+                }
+                [[fallthrough]];
+            default:
+                return "(" + expr(d - 1) + " " + "+-*<"[pick(4)] + " " + expr(d - 1) + ")";
+        }
+    }
+
+    /// loops - `levels` nested for loops around an assignment to a variable
+    /// in scope (never to a loop variable, the loops must terminate).
+    std::string loops(unsigned levels, unsigned level = 0) {
+        if (level == levels) {
+            return scope[pick(scope.size() - levels)] + " = " + expr(depth);
+        }
+        auto var = "i" + std::to_string(level);
+        scope.push_back(var);
+        auto body = loops(levels, level + 1);
+        scope.pop_back();
+        return "(for " + var + " = 0, " + var + " < " + std::to_string(2 + pick(8)) + " in " + body + ")";
+    }
+
+    void defineOperators() {
+        // ':' sequences expressions, like in the tutorial.
+        out += "def binary : 1 (x y) y;\n";
+        for (unsigned i = 0; i < binaryOperators; ++i) {
+            scope = {"a", "b"};
+            out += "def binary " + std::string(1, binaryOperatorChars[i]) + " " + std::to_string(3 + pick(58)) +
+                   " (a b) " + expr(2) + ";\n";
+        }
+        for (unsigned i = 0; i < unaryOperators; ++i) {
+            scope = {"v"};
+            out += "def unary " + std::string(1, unaryOperatorChars[i]) + " (v) " + expr(2) + ";\n";
+        }
+        out += "\n";
+        builtinOperators = false;
+    }
+
+    void defineFunction(unsigned index) {
+        auto arity = 1 + pick(3);
+        scope.clear();
+        std::string params{};
+        for (unsigned a = 0; a < arity; ++a) {
+            scope.push_back("x" + std::to_string(a));
+            params += (a ? " " : "") + scope.back();
+        }
+
+        out += "def f" + std::to_string(index) + "(" + params + ")\n";
+        for (unsigned v = 0; v < varScopes; ++v) {
+            auto name = "v" + std::to_string(v);
+            out += std::string(2 + 2 * v, ' ') + "var " + name + " = " + expr(depth / 2) + " in\n";
+            scope.push_back(name);
+        }
+        std::string body = expr(depth);
+        if (loopNesting) {
+            body = loops(loopNesting) + " : " + body;
+        }
+        for (unsigned c = 0; c < fanout && index; ++c) {
+            body += " + " + call(pick(index), depth / 2);
+        }
+        out += std::string(2 + 2 * varScopes, ' ') + body + ";\n\n";
+        arities.push_back(arity);
+    }
+public:
+    explicit Generator(uint64_t seed): state(seed) {}
+
+    std::string generate() {
+        defineOperators();
+        for (unsigned i = 0; i < numFunctions; ++i) {
+            defineFunction(i);
+        }
+        return out;
+    }
+};
+
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope workload generator\n");
+    if (binaryOperators > binaryOperatorChars.size() || unaryOperators > unaryOperatorChars.size()) {
+        std::cerr << "at most " << binaryOperatorChars.size() << " binary and " << unaryOperatorChars.size()
+                  << " unary operators" << std::endl;
+        return 1;
+    }
+
+    std::cout << "# kal_gen --seed=" << seed << " --functions=" << numFunctions << " --depth=" << depth
+              << " --fanout=" << fanout << " --loops=" << loopNesting << " --vars=" << varScopes
+              << " --operators=" << binaryOperators << " --unary-operators=" << unaryOperators << "\n\n"
+              << Generator{seed}.generate();
+    return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Compares PGO and plain builds of the sample programs in programs/.
+#
+# Every program defines run(). It is first run under the JIT with
+# --instrument to record its counters, then compiled twice with --lto, once
+# plain and once with --profile-use, linked against harness.c and timed.
+#
+# usage: bench/pgo.sh <build dir> [repetitions]
+set -eu
+
+build=${1:?usage: $0 <build dir> [repetitions]}
+repetitions=${2:-5}
+kal=$build/src/kal_llvm
+programs=$(dirname "$0")/programs
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cc -O2 -c "$programs/harness.c" -o "$work/harness.o"
+
+printf "%-10s %12s %12s %8s\n" program "plain ms" "pgo ms" speedup
+for source in "$programs"/*.ks; do
+    name=$(basename "$source" .ks)
+    # --lto writes foo.bc next to foo.ks, keep that out of the tree.
+    cp "$source" "$work/$name.ks"
+
+    { cat "$work/$name.ks"; echo "run();"; } |
+        "$kal" --jit -g0 --instrument --instrument-output="$work/$name.json" >/dev/null 2>&1
+
+    "$kal" "$work/$name.ks" -g0 --lto --export=run -o "$work/$name.plain.o" >/dev/null
+    "$kal" "$work/$name.ks" -g0 --lto --export=run --profile-use="$work/$name.json" -o "$work/$name.pgo.o" >/dev/null
+    cc "$work/harness.o" "$work/$name.plain.o" -lm -o "$work/$name.plain"
+    cc "$work/harness.o" "$work/$name.pgo.o" -lm -o "$work/$name.pgo"
+
+    read -r plain plainResult < <("$work/$name.plain" "$repetitions")
+    read -r pgo pgoResult < <("$work/$name.pgo" "$repetitions")
+    if [ "$plainResult" != "$pgoResult" ]; then
+        echo "$name: results differ ($plainResult vs $pgoResult)" >&2
+        exit 1
+    fi
+    printf "%-10s %12s %12s %7.2fx\n" "$name" "$plain" "$pgo" "$(awk "BEGIN { print $plain / $pgo }")"
+done
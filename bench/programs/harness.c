@@ -0,0 +1,34 @@
+/* Runs the run() of a sample program compiled with kal_llvm and prints the
+ * best wall time over the repetitions (ms) and the result. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+extern double run(void);
+
+double putchard(double x) {
+    fputc((char)x, stderr);
+    return 0;
+}
+
+double printd(double x) {
+    fprintf(stderr, "%f\n", x);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int repetitions = argc > 1 ? atoi(argv[1]) : 5;
+    double best = 0, result = 0;
+    for (int i = 0; i < repetitions; ++i) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result = run();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (i == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    printf("%.3f %g\n", best, result);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/bash
+# Compile time and memory against program size, on programs from kal_gen.
+#
+# Every size is generated with the same seed and compiled once, either as a
+# file (one module, written to an object file) or through the JIT (a module
+# per definition, added but never compiled as nothing is called). Prints a
+# CSV with the phase times of --time-report-json, the time per function
+# (flat if compilation scales linearly) and the peak heap and RSS of
+# --mem-report. With gnuplot installed, also plots it to scaling.png.
+#
+# usage: bench/scaling.sh <build dir> [file|jit] [functions...]
+# KAL_GEN_ARGS passes further options to kal_gen (e.g. "--depth=6 --fanout=4").
+set -eu
+
+build=${1:?usage: $0 <build dir> [file|jit] [functions...]}
+mode=${2:-file}
+shift $(( $# < 2 ? $# : 2 ))
+sizes=${*:-125 250 500 1000 2000}
+kal=$build/src/kal_llvm
+gen=$build/bench/kal_gen
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# phase - wall_ms of a phase in a --time-report-json file.
+phase() {
+    awk -v phase="\"$1\":" '$1 == phase { found = 1 } found && $1 == "\"wall_ms\":" { printf "%.3f\n", $2; exit }' "$2"
+}
+
+csv=$work/scaling.csv
+echo "functions,bytes,tokens,total_ms,lex_ms,parse_ms,codegen_ms,verify_ms,emit_ms,us_per_function,peak_heap_kb,peak_rss_kb" | tee "$csv"
+for n in $sizes; do
+    # shellcheck disable=SC2086
+    "$gen" --seed=1 --functions="$n" ${KAL_GEN_ARGS:-} > "$work/gen.ks"
+    if [ "$mode" = jit ]; then
+        "$kal" --jit -g0 --time-report-json="$work/time.json" --mem-report < "$work/gen.ks" >/dev/null 2>"$work/mem.txt"
+    else
+        "$kal" "$work/gen.ks" -g0 -o "$work/gen.o" --time-report-json="$work/time.json" --mem-report >/dev/null 2>"$work/mem.txt"
+    fi
+
+    tokens=$(awk '$1 == "\"tokens\":" { sub(",", "", $2); print $2; exit }' "$work/time.json")
+    read -r heap rss < <(sed -n 's/.*peak heap: \([0-9.]*\) KB, peak RSS: \([0-9]*\) KB.*/\1 \2/p' "$work/mem.txt")
+    times=()
+    for p in lex parse codegen verify emit; do
+        times+=("$(phase "$p" "$work/time.json")")
+    done
+    total=$(printf "%s\n" "${times[@]}" | awk '{ s += $1 } END { printf "%.3f", s }')
+    perFunction=$(awk "BEGIN { printf \"%.1f\", $total * 1000 / $n }")
+    echo "$n,$(wc -c < "$work/gen.ks"),$tokens,$total,$(IFS=,; echo "${times[*]}"),$perFunction,$heap,$rss" | tee -a "$csv"
+done
+
+if command -v gnuplot >/dev/null; then
+    gnuplot <<EOF
+set terminal png size 1000,500
+set output "scaling.png"
+set datafile separator ","
+set key autotitle columnhead left top
+set multiplot layout 1,2 title "kal_llvm ($mode) scaling, $(basename "$gen") ${KAL_GEN_ARGS:-}"
+set xlabel "functions"
+set ylabel "ms"
+plot for [c=5:9] "$csv" using 1:c with linespoints, "$csv" using 1:4 with linespoints lw 2
+set ylabel "KB"
+plot "$csv" using 1:11 with linespoints, "$csv" using 1:12 with linespoints
+unset multiplot
+EOF
+    echo "plotted scaling.png" >&2
+fi
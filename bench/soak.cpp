@@ -0,0 +1,75 @@
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "llvm/Support/CommandLine.h"
+#include "Engine.h"
+
+// Soak test for long running sessions: evaluates a top-level expression over
+// and over while periodically redefining a function that another definition
+// calls, and samples resident memory along the way. Anonymous expressions and
+// replaced definitions are released, so RSS should stay flat after warm-up.
+
+static llvm::cl::opt<unsigned long> iterations("iterations", llvm::cl::desc("Top-level expressions to evaluate"),
+                                               llvm::cl::init(1000000));
+static llvm::cl::opt<unsigned long> redefineEvery("redefine-every", llvm::cl::desc("Redefine foo every N evaluations"),
+                                                  llvm::cl::init(1000));
+static llvm::cl::opt<unsigned long> reportEvery("report-every", llvm::cl::desc("Sample RSS every N evaluations"),
+                                                llvm::cl::init(10000));
+static llvm::cl::opt<unsigned long> maxGrowthKb("max-growth-kb", llvm::cl::desc("Fail if RSS grows more than this after warm-up (0 only reports)"),
+                                                llvm::cl::init(0));
+
+static long residentKb() {
+    long pages = 0, resident = 0;
+    std::ifstream statm{"/proc/self/statm"};
+    statm >> pages >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static std::string defineFoo(unsigned long k) {
+    return "def foo(x) x + " + std::to_string(k) + ";";
+}
+
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT soak test\n");
+
+    kal::Engine engine{};
+    unsigned long k = 0;
+    if (!engine.compile(defineFoo(k) + " def bar(x) foo(x) * 2;")) {
+        std::cerr << "setup failed" << std::endl;
+        return 1;
+    }
+
+    long baselineKb = 0;
+    long peakKb = 0;
+    for (unsigned long i = 1; i <= iterations; ++i) {
+        auto x = double(i % 1000);
+        auto value = engine.evaluate("bar(" + std::to_string(i % 1000) + ")");
+        if (!value || *value != (x + k) * 2) {
+            std::cerr << "wrong result at iteration " << i << std::endl;
+            return 1;
+        }
+
+        if (redefineEvery && i % redefineEvery == 0 && !engine.compile(defineFoo(++k))) {
+            std::cerr << "redefinition failed at iteration " << i << std::endl;
+            return 1;
+        }
+
+        if (reportEvery && i % reportEvery == 0) {
+            auto rssKb = residentKb();
+            if (!baselineKb) {
+                baselineKb = rssKb;
+            }
+            peakKb = std::max(peakKb, rssKb);
+            std::cout << "iteration " << i << " rss_kb " << rssKb << std::endl;
+        }
+    }
+
+    auto growthKb = peakKb - baselineKb;
+    std::cout << "baseline_kb " << baselineKb << " peak_kb " << peakKb << " growth_kb " << growthKb << std::endl;
+    if (maxGrowthKb && growthKb > long(maxGrowthKb)) {
+        std::cerr << "RSS grew by " << growthKb << " KiB, limit " << maxGrowthKb << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -7,268 +7,299 @@ static llvm::Value* logErrorV(const char *str) {
     return nullptr;
 }
 
-llvm::Value* ast::NumberExprAST::codegen() {
-    ksDebugInfo->emitLocation(this);
-    return llvm::ConstantFP::get(*llvmContext->getContext(), llvm::APFloat{val});
-}
-
-llvm::Value* ast::VariableExprAST::codegen() {
-    auto v = namedValues[name];
-    if (!v) {
-        return logErrorV("Unknown variable name");
+/// Codegen - emits the IR of a function body into the function the builder
+/// is in.
+class Codegen: public ast::ExprVisitor<Codegen, llvm::Value*> {
+    const std::shared_ptr<LLVMContext> &llvmContext;
+    const std::shared_ptr<ast::DebugInfo> &ksDebugInfo;
+public:
+    Codegen(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo):
+        llvmContext(llvmContext), ksDebugInfo(ksDebugInfo) {}
+
+    llvm::Value* visitNumber(const ast::NumberExprAST &e) {
+        ksDebugInfo->emitLocation(&e);
+        return llvm::ConstantFP::get(*llvmContext->getContext(), llvm::APFloat{e.getValue()});
     }
-    ksDebugInfo->emitLocation(this);
-    return llvmContext->getBuilder()->CreateLoad(v->getAllocatedType(), v, name.c_str());
-}
-
-llvm::Value* ast::VarExprAST::codegen() {
-    std::vector<llvm::AllocaInst*> oldBindings;
 
-    auto theFunction = llvmContext->getBuilder()->GetInsertBlock()->getParent();
-    for (unsigned i = 0, e = varNames.size(); i != e; ++i) {
-        const std::string &varName = varNames[i].first;
-        auto init = varNames[i].second.get();
+    llvm::Value* visitVariable(const ast::VariableExprAST &e) {
+        auto v = ast::namedValues[e.getName()];
+        if (!v) {
+            return logErrorV("Unknown variable name");
+        }
+        ksDebugInfo->emitLocation(&e);
+        return llvmContext->getBuilder()->CreateLoad(v->getAllocatedType(), v, e.getName().c_str());
+    }
 
-        llvm::Value *initVal;
-        if (init) {
-            initVal = init->codegen();
-            if (!initVal) {
-                return nullptr;
+    llvm::Value* visitVar(const ast::VarExprAST &e) {
+        std::vector<llvm::AllocaInst*> oldBindings;
+
+        const auto &varNames = e.getVarNames();
+        auto theFunction = llvmContext->getBuilder()->GetInsertBlock()->getParent();
+        for (unsigned i = 0, n = varNames.size(); i != n; ++i) {
+            const std::string &varName = varNames[i].first;
+            auto init = varNames[i].second.get();
+
+            llvm::Value *initVal;
+            if (init) {
+                initVal = visit(*init);
+                if (!initVal) {
+                    return nullptr;
+                }
+            } else {
+                initVal = llvm::ConstantFP::get(*llvmContext->getContext(), llvm::APFloat(0.0));
             }
-        } else {
-            initVal = llvm::ConstantFP::get(*llvmContext->getContext(), llvm::APFloat(0.0));
-        }
 
-        auto alloca = llvmContext->createEntryBlockAlloca(theFunction, varName);
-        llvmContext->getBuilder()->CreateStore(initVal, alloca);
+            auto alloca = llvmContext->createEntryBlockAlloca(theFunction, varName);
+            llvmContext->getBuilder()->CreateStore(initVal, alloca);
 
-        oldBindings.push_back(namedValues[varName]);
+            oldBindings.push_back(ast::namedValues[varName]);
 
-        namedValues[varName] = alloca;
-    }
-    ksDebugInfo->emitLocation(this);
+            ast::namedValues[varName] = alloca;
+        }
+        ksDebugInfo->emitLocation(&e);
 
-    auto bodyVal = body->codegen();
-    if (!bodyVal) {
-        return nullptr;
-    }
+        auto bodyVal = visit(e.getBody());
+        if (!bodyVal) {
+            return nullptr;
+        }
 
-    for (unsigned i = 0, e = varNames.size(); i != e; ++i) {
-        namedValues[varNames[i].first] = oldBindings[i];
+        for (unsigned i = 0, n = varNames.size(); i != n; ++i) {
+            ast::namedValues[varNames[i].first] = oldBindings[i];
+        }
+        return bodyVal;
     }
-    return bodyVal;
-}
 
-llvm::Value* ast::UnaryExprAST::codegen() {
-    auto operandV = operand->codegen();
-    if (!operandV) {
-        return nullptr;
-    }
+    llvm::Value* visitUnary(const ast::UnaryExprAST &e) {
+        auto operandV = visit(e.getOperand());
+        if (!operandV) {
+            return nullptr;
+        }
 
-    auto f = getFunction(llvmContext, std::string{"unary"} + op);
-    if (!f) {
-        return logErrorV("Unknown unary operator");
+        auto f = ast::getFunction(llvmContext, std::string{"unary"} + e.getOp());
+        if (!f) {
+            return logErrorV("Unknown unary operator");
+        }
+        ksDebugInfo->emitLocation(&e);
+        return llvmContext->getBuilder()->CreateCall(f, operandV, "unop");
     }
-    ksDebugInfo->emitLocation(this);
-    return llvmContext->getBuilder()->CreateCall(f, operandV, "unop");
-}
 
-llvm::Value* ast::BinaryExprAST::codegen() {
-    ksDebugInfo->emitLocation(this);
-    if (op == '=') {
-        auto lhse = static_cast<ast::VariableExprAST*>(lhs.get());
+    llvm::Value* visitBinary(const ast::BinaryExprAST &e) {
+        ksDebugInfo->emitLocation(&e);
+        auto op = e.getOp();
+        if (op == '=') {
+            auto lhse = llvm::dyn_cast<ast::VariableExprAST>(&e.getLHS());
+            if (!lhse) {
+                return logErrorV("destination of '=' must be a variable");
+            }
+            auto val = visit(e.getRHS());
+            if (!val) {
+                return nullptr;
+            }
 
-        if (!lhse) {
-            return logErrorV("destination of '=' must be a variable");
+            auto variable = ast::namedValues[lhse->getName()];
+            if (!variable) {
+                return logErrorV("Unknown variable name");
+            }
+
+            llvmContext->getBuilder()->CreateStore(val, variable);
+            return val;
         }
-        auto val = rhs->codegen();
-        if (!val) {
+        auto l = visit(e.getLHS());
+        auto r = visit(e.getRHS());
+
+        if (!l || !r) {
             return nullptr;
         }
 
-        auto variable = namedValues[lhse->getName()];
-        if (!variable) {
-            return logErrorV("Unknown variable name");
+        switch (op) {
+            case '+':
+                return llvmContext->getBuilder()->CreateFAdd(l, r, "addtmp");
+            case '-':
+                return llvmContext->getBuilder()->CreateFSub(l, r, "subtmp");
+            case '*':
+                return llvmContext->getBuilder()->CreateFMul(l, r, "multmp");
+            case '<':
+                l = llvmContext->getBuilder()->CreateFCmpULT(l, r, "cmptmp");
+                return llvmContext->getBuilder()->CreateUIToFP(l, llvm::Type::getDoubleTy(*llvmContext->getContext()), "booltmp");
+            default:
+                break;
         }
 
-        llvmContext->getBuilder()->CreateStore(val, variable);
-        return val;
-    }
-    auto l = lhs->codegen();
-    auto r = rhs->codegen();
-
-    if (!l || !r) {
-        return nullptr;
-    }
+        using namespace std::string_literals;
+        auto f = ast::getFunction(llvmContext, "binary"s + op);
+        if (!f) {
+            return logErrorV("Unknown binary operator");
+        }
 
-    switch (op) {
-        case '+':
-            return llvmContext->getBuilder()->CreateFAdd(l, r, "addtmp");
-        case '-':
-            return llvmContext->getBuilder()->CreateFSub(l, r, "subtmp");
-        case '*':
-            return llvmContext->getBuilder()->CreateFMul(l, r, "multmp");
-        case '<':
-            l = llvmContext->getBuilder()->CreateFCmpULT(l, r, "cmptmp");
-            return llvmContext->getBuilder()->CreateUIToFP(l, llvm::Type::getDoubleTy(*llvmContext->getContext()), "booltmp");
-        default:
-            break;
+        llvm::Value *ops[2] = {l, r};
+        return llvmContext->getBuilder()->CreateCall(f, ops, "binop");
     }
 
-    using namespace std::string_literals;
-    auto f = getFunction(llvmContext, "binary"s + op);
-    assert(f && "binary operator not found!");
+    llvm::Value* visitCall(const ast::CallexprAST &e) {
+        ksDebugInfo->emitLocation(&e);
+        auto calleeF = ast::getFunction(llvmContext, e.getCallee());
+        if (!calleeF) {
+            return logErrorV("Unknown function referenced");
+        }
 
-    llvm::Value *ops[2] = {l, r};
-    return llvmContext->getBuilder()->CreateCall(f, ops, "binop");
-}
+        const auto &args = e.getArgs();
+        if (calleeF->arg_size() != args.size()) {
+            return logErrorV("Incorrect # arguments passed");
+        }
 
-llvm::Value* ast::CallexprAST::codegen() {
-    ksDebugInfo->emitLocation(this);
-    auto calleeF = ast::getFunction(llvmContext, callee);
-    if (!calleeF) {
-        return logErrorV("Unknown function referenced");
-    }
+        std::vector<llvm::Value*> argsV{};
+        for (const auto &arg: args) {
+            argsV.push_back(visit(*arg));
+            if (!argsV.back()) {
+                return nullptr;
+            }
+        }
 
-    if (calleeF->arg_size() != args.size()) {
-        return logErrorV("Incorrect # arguments passed");
+        return llvmContext->getBuilder()->CreateCall(calleeF, argsV, "calltmp");
     }
 
-    std::vector<llvm::Value*> argsV{};
-    int e = args.size();
-
-    for (int i = 0; i < e; ++i) {
-        argsV.push_back(args[i]->codegen());
-        if (!argsV.back()) {
+    llvm::Value* visitIf(const ast::IfExprAST &e) {
+        ksDebugInfo->emitLocation(&e);
+        auto condV = visit(e.getCond());
+        if (!condV) {
             return nullptr;
         }
-    }
-
-    return llvmContext->getBuilder()->CreateCall(calleeF, argsV, "calltmp");
-}
-
-llvm::Value* ast::IfExprAST::codegen() {
-    ksDebugInfo->emitLocation(this);
-    auto condV = cond->codegen();
-    if (!condV) {
-        return nullptr;
-    }
 
-    condV = llvmContext->getBuilder()->CreateFCmpONE(condV, llvm::ConstantFP::get(*(llvmContext->getContext()), llvm::APFloat(0.0)), "ifcond");
+        condV = llvmContext->getBuilder()->CreateFCmpONE(condV, llvm::ConstantFP::get(*(llvmContext->getContext()), llvm::APFloat(0.0)), "ifcond");
 
-    auto theFunction = llvmContext->getBuilder()->GetInsertBlock()->getParent();
+        auto theFunction = llvmContext->getBuilder()->GetInsertBlock()->getParent();
 
-    auto thenBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "then", theFunction);
-    auto elseBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "else");
-    auto mergeBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "ifcont");
+        auto thenBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "then", theFunction);
+        auto elseBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "else");
+        auto mergeBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "ifcont");
 
-    llvmContext->getBuilder()->CreateCondBr(condV, thenBB, elseBB);
+        auto site = llvmContext->nextSite();
+        llvmContext->getBuilder()->CreateCondBr(condV, thenBB, elseBB, llvmContext->branchWeights(site, "then", "else"));
 
-    llvmContext->getBuilder()->SetInsertPoint(thenBB);
+        llvmContext->getBuilder()->SetInsertPoint(thenBB);
+        if (llvmContext->isInstrumented()) {
+            llvmContext->emitCounter("then", site, e.getLine());
+        }
 
-    auto thenV = then->codegen();
-    if (!thenV) {
-        return nullptr;
-    }
+        auto thenV = visit(e.getThen());
+        if (!thenV) {
+            return nullptr;
+        }
 
-    llvmContext->getBuilder()->CreateBr(mergeBB);
-    thenBB = llvmContext->getBuilder()->GetInsertBlock();
+        llvmContext->getBuilder()->CreateBr(mergeBB);
+        thenBB = llvmContext->getBuilder()->GetInsertBlock();
 
-    theFunction->getBasicBlockList().push_back(elseBB);
-    llvmContext->getBuilder()->SetInsertPoint(elseBB);
+        theFunction->getBasicBlockList().push_back(elseBB);
+        llvmContext->getBuilder()->SetInsertPoint(elseBB);
+        if (llvmContext->isInstrumented()) {
+            llvmContext->emitCounter("else", site, e.getLine());
+        }
 
-    auto elseV = else_->codegen();
-    if (!elseV) {
-        return nullptr;
-    }
+        auto elseV = visit(e.getElse());
+        if (!elseV) {
+            return nullptr;
+        }
 
-    llvmContext->getBuilder()->CreateBr(mergeBB);
-    elseBB = llvmContext->getBuilder()->GetInsertBlock();
+        llvmContext->getBuilder()->CreateBr(mergeBB);
+        elseBB = llvmContext->getBuilder()->GetInsertBlock();
 
-    theFunction->getBasicBlockList().push_back(mergeBB);
-    llvmContext->getBuilder()->SetInsertPoint(mergeBB);
+        theFunction->getBasicBlockList().push_back(mergeBB);
+        llvmContext->getBuilder()->SetInsertPoint(mergeBB);
 
-    auto pn = llvmContext->getBuilder()->CreatePHI(llvm::Type::getDoubleTy(*(llvmContext->getContext())), 2, "iftmp");
+        auto pn = llvmContext->getBuilder()->CreatePHI(llvm::Type::getDoubleTy(*(llvmContext->getContext())), 2, "iftmp");
 
-    pn->addIncoming(thenV, thenBB);
-    pn->addIncoming(elseV, elseBB);
-    return pn;
-}
+        pn->addIncoming(thenV, thenBB);
+        pn->addIncoming(elseV, elseBB);
+        return pn;
+    }
 
-llvm::Value* ast::ForExprAST::codegen() {
-    auto theFunction = llvmContext->getBuilder()->GetInsertBlock()->getParent();
-    auto alloca = llvmContext->createEntryBlockAlloca(theFunction, varName);
+    llvm::Value* visitFor(const ast::ForExprAST &e) {
+        const auto &varName = e.getVarName();
+        auto theFunction = llvmContext->getBuilder()->GetInsertBlock()->getParent();
+        auto alloca = llvmContext->createEntryBlockAlloca(theFunction, varName);
 
-    ksDebugInfo->emitLocation(this);
+        ksDebugInfo->emitLocation(&e);
+        auto site = llvmContext->nextSite();
 
-    auto startVal = start->codegen();
-    if (!startVal) {
-        return nullptr;
-    }
+        auto startVal = visit(e.getStart());
+        if (!startVal) {
+            return nullptr;
+        }
 
-    llvmContext->getBuilder()->CreateStore(startVal, alloca);
+        llvmContext->getBuilder()->CreateStore(startVal, alloca);
 
-//    auto preHeaderBB = llvmContext->getBuilder()->GetInsertBlock();
-    auto loopBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "loop", theFunction);
+        auto loopBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "loop", theFunction);
 
-    llvmContext->getBuilder()->CreateBr(loopBB);
-    llvmContext->getBuilder()->SetInsertPoint(loopBB);
+        llvmContext->getBuilder()->CreateBr(loopBB);
+        llvmContext->getBuilder()->SetInsertPoint(loopBB);
 
-//    auto variable = llvmContext->getBuilder()->CreatePHI(llvm::Type::getDoubleTy(*(llvmContext->getContext())), 2, varName);
-//    variable->addIncoming(startVal, preHeaderBB);
+        auto oldVal = ast::namedValues[varName];
+        ast::namedValues[varName] = alloca;
 
-    auto oldVal = ast::namedValues[varName];
-    ast::namedValues[varName] = alloca;
+        if (!visit(e.getBody())) {
+            return nullptr;
+        }
 
-    if (!body->codegen()) {
-        return nullptr;
-    }
+        llvm::Value *stepVal = nullptr;
+        if (auto *step = e.getStep()) {
+            stepVal = visit(*step);
+            if (!stepVal) {
+                return nullptr;
+            }
+        } else {
+            stepVal = llvm::ConstantFP::get(*(llvmContext->getContext()), llvm::APFloat(1.0));
+        }
 
-    llvm::Value *stepVal = nullptr;
-    if (step) {
-        stepVal = step->codegen();
-        if (!stepVal) {
+        auto endCond = visit(e.getEnd());
+        if (!endCond) {
             return nullptr;
         }
-    } else {
-        stepVal = llvm::ConstantFP::get(*(llvmContext->getContext()), llvm::APFloat(1.0));
-    }
 
-//    auto nextVar = llvmContext->getBuilder()->CreateFAdd(variable, stepVal, "nextvar");
-
-    auto endCond = end->codegen();
-    if (!endCond) {
-        return nullptr;
-    }
+        auto curVar = llvmContext->getBuilder()->CreateLoad(alloca->getAllocatedType(), alloca, varName.c_str());
+        auto nextVar = llvmContext->getBuilder()->CreateFAdd(curVar, stepVal, "nextvar");
+        llvmContext->getBuilder()->CreateStore(nextVar, alloca);
 
-    auto curVar = llvmContext->getBuilder()->CreateLoad(alloca->getAllocatedType(), alloca, varName.c_str());
-    auto nextVar = llvmContext->getBuilder()->CreateFAdd(curVar, stepVal, "nextvar");
-    llvmContext->getBuilder()->CreateStore(nextVar, alloca);
+        endCond = llvmContext->getBuilder()->CreateFCmpONE(endCond, llvm::ConstantFP::get(*(llvmContext->getContext()), llvm::APFloat(0.0)), "loopcond");
 
-    endCond = llvmContext->getBuilder()->CreateFCmpONE(endCond, llvm::ConstantFP::get(*(llvmContext->getContext()), llvm::APFloat(0.0)), "loopcond");
+        auto afterBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "afterloop", theFunction);
 
-//    auto loopEndBB = llvmContext->getBuilder()->GetInsertBlock();
-    auto afterBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "afterloop", theFunction);
+        if (llvmContext->isInstrumented()) {
+            // count the back-edge on a block of its own, the exit in afterBB.
+            auto backedgeBB = llvm::BasicBlock::Create(*(llvmContext->getContext()), "backedge", theFunction, afterBB);
+            llvmContext->getBuilder()->CreateCondBr(endCond, backedgeBB, afterBB, llvmContext->branchWeights(site, "backedge", "exit"));
+            llvmContext->getBuilder()->SetInsertPoint(backedgeBB);
+            llvmContext->emitCounter("backedge", site, e.getLine());
+            llvmContext->getBuilder()->CreateBr(loopBB);
+            llvmContext->getBuilder()->SetInsertPoint(afterBB);
+            llvmContext->emitCounter("exit", site, e.getLine());
+        } else {
+            llvmContext->getBuilder()->CreateCondBr(endCond, loopBB, afterBB, llvmContext->branchWeights(site, "backedge", "exit"));
+            llvmContext->getBuilder()->SetInsertPoint(afterBB);
+        }
 
-    llvmContext->getBuilder()->CreateCondBr(endCond, loopBB, afterBB);
-    llvmContext->getBuilder()->SetInsertPoint(afterBB);
+        if (oldVal) {
+            ast::namedValues[varName] = oldVal;
+        } else {
+            ast::namedValues.erase(varName);
+        }
 
-//    variable->addIncoming(nextVar, loopEndBB);
+        return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*(llvmContext->getContext())));
+    }
 
-    if (oldVal) {
-        namedValues[varName] = oldVal;
-    } else {
-        namedValues.erase(varName);
+    llvm::Value* visitWhile(const ast::WhileExprAST &) {
+        return logErrorV("while loops are not supported");
     }
+};
 
-    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*(llvmContext->getContext())));
+llvm::Function* ast::PrototypeAST::codegen() {
+    return codegen(llvmContext);
 }
 
-llvm::Function* ast::PrototypeAST::codegen() {
-    std::vector<llvm::Type*> doubles{args.size(), llvm::Type::getDoubleTy(*llvmContext->getContext())};
-    auto ft = llvm::FunctionType::get(llvm::Type::getDoubleTy(*llvmContext->getContext()), doubles, false);
+llvm::Function* ast::PrototypeAST::codegen(const std::shared_ptr<LLVMContext> &target) const {
+    std::vector<llvm::Type*> doubles{args.size(), llvm::Type::getDoubleTy(*target->getContext())};
+    auto ft = llvm::FunctionType::get(llvm::Type::getDoubleTy(*target->getContext()), doubles, false);
 
-    auto f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name, llvmContext->getModule().get());
+    auto f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name, target->getModule().get());
 
     auto idx = 0;
     for (auto &arg: f->args()) {
@@ -278,14 +309,23 @@ llvm::Function* ast::PrototypeAST::codegen() {
 }
 
 llvm::Function* ast::FunctionAST::codegen() {
+    PhaseTimer timer{TimeReport::Codegen};
     auto &p = *proto;
-    functionProtos[proto->getName()] = std::move(proto);
-    auto *theFunction = ast::getFunction(llvmContext, p.getName());
+    auto name = p.getName();
+    // hold on to the prototype being replaced: a redefinition that fails to
+    // codegen must leave the old one (and its arity) in place.
+    auto previous = llvmContext->getSymbols().exchange(name, std::move(proto));
+    auto *theFunction = ast::getFunction(llvmContext, name);
 
     if (!theFunction) {
+        llvmContext->getSymbols().exchange(name, std::move(previous));
         return nullptr;
     }
 
+    if (llvmContext->forcesFramePointers()) {
+        theFunction->addFnAttr("frame-pointer", "all");
+    }
+
     if (p.isBinaryOp()) {
         llvmContext->addToBinOpPrecedence(std::make_pair(p.getOperatorName(), p.getBinaryPrecedence()));
     }
@@ -293,18 +333,19 @@ llvm::Function* ast::FunctionAST::codegen() {
     auto bb = llvm::BasicBlock::Create(*llvmContext->getContext(), "entry", theFunction);
     llvmContext->getBuilder()->SetInsertPoint(bb);
 
-    auto unit = llvmContext->getDBuilder()->createFile(ksDebugInfo->theCU->getFilename(),
-                                     ksDebugInfo->theCU->getDirectory());
-    llvm::DIScope *fContext = unit;
     unsigned lineNo = p.getLine();
-    unsigned scopeLine = lineNo;
-    llvm::DISubprogram *sp = llvmContext->getDBuilder()->createFunction(
-            fContext, p.getName(), llvm::StringRef{}, unit, lineNo,
-            CreateFunctionType(theFunction->arg_size(), llvmContext, ksDebugInfo), scopeLine,
-            llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
-    theFunction->setSubprogram(sp);
-
-    ksDebugInfo->lexicalBlocks.push_back(sp);
+    llvm::DISubprogram *sp = nullptr;
+    if (ksDebugInfo->level != ast::DebugLevel::None) {
+        auto unit = ksDebugInfo->file;
+        llvm::DIScope *fContext = unit;
+        unsigned scopeLine = lineNo;
+        sp = llvmContext->getDBuilder()->createFunction(
+                fContext, p.getName(), llvm::StringRef{}, unit, lineNo,
+                ksDebugInfo->getFunctionType(theFunction->arg_size()), scopeLine,
+                llvm::DINode::FlagPrototyped, llvm::DISubprogram::SPFlagDefinition);
+        theFunction->setSubprogram(sp);
+        ksDebugInfo->lexicalBlocks.push_back(sp);
+    }
     ksDebugInfo->emitLocation(nullptr);
 
     namedValues.clear();
@@ -312,29 +353,41 @@ llvm::Function* ast::FunctionAST::codegen() {
     for (auto &arg: theFunction->args()) {
         auto alloca = llvmContext->createEntryBlockAlloca(theFunction, arg.getName());
 
-        llvm::DILocalVariable *d = llvmContext->getDBuilder()->createParameterVariable(
-                sp, arg.getName(), ++argIdx, unit, lineNo, ksDebugInfo->getDoubleTy(), true);
-        llvmContext->getDBuilder()->insertDeclare(alloca, d, llvmContext->getDBuilder()->createExpression(), llvm::DILocation::get(sp->getContext(), lineNo, 0, sp),
-                                llvmContext->getBuilder()->GetInsertBlock());
+        if (ksDebugInfo->level == ast::DebugLevel::Full) {
+            llvm::DILocalVariable *d = llvmContext->getDBuilder()->createParameterVariable(
+                    sp, arg.getName(), ++argIdx, ksDebugInfo->file, lineNo, ksDebugInfo->getDoubleTy(), true);
+            llvmContext->getDBuilder()->insertDeclare(alloca, d, llvmContext->getDBuilder()->createExpression(), llvm::DILocation::get(sp->getContext(), lineNo, 0, sp),
+                                    llvmContext->getBuilder()->GetInsertBlock());
+        }
 
         llvmContext->getBuilder()->CreateStore(&arg, alloca);
 
         namedValues[std::string{arg.getName()}] = alloca;
     }
+    llvmContext->beginFunction(*theFunction, lineNo);
     ksDebugInfo->emitLocation(body.get());
 
-    if (auto retVal = body->codegen()) {
+    if (auto retVal = Codegen{llvmContext, ksDebugInfo}.visit(*body)) {
         llvmContext->getBuilder()->CreateRet(retVal);
-        ksDebugInfo->lexicalBlocks.pop_back();
-        llvm::verifyFunction(*theFunction);
+        if (sp) {
+            ksDebugInfo->lexicalBlocks.pop_back();
+        }
+        {
+            PhaseTimer verifyTimer{TimeReport::Verify};
+            llvm::verifyFunction(*theFunction);
+        }
+        TimeReport::get().count(TimeReport::Functions);
+        TimeReport::get().count(TimeReport::IrInstructions, theFunction->getInstructionCount());
 //        llvmContext->getFPM()->run(*theFunction);
         return theFunction;
     }
 
     theFunction->eraseFromParent();
-    if (p.isBinaryOp()) {
-        llvmContext->eraseFromBinOpPrecedence(p.getOperatorName());
+    if (sp) {
+        ksDebugInfo->lexicalBlocks.pop_back();
+    }
+    if (previous) {
+        llvmContext->getSymbols().exchange(name, std::move(previous));
     }
-    ksDebugInfo->lexicalBlocks.pop_back();
     return nullptr;
-}
\ No newline at end of file
+}
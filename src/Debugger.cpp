@@ -1,5 +1,28 @@
 #include "Debugger.h"
 
+void ast::DebugInfo::initializeCompileUnit(llvm::StringRef filename, llvm::StringRef directory, DebugLevel level) {
+    this->filename = filename.str();
+    this->directory = directory.str();
+    this->level = level;
+    resetCompileUnit();
+}
+
+void ast::DebugInfo::resetCompileUnit() {
+    theCU = nullptr;
+    file = nullptr;
+    dblTy = nullptr;
+    functionTypes.clear();
+    lexicalBlocks.clear();
+    if (level == DebugLevel::None) {
+        return;
+    }
+
+    auto kind = level == DebugLevel::Full ? llvm::DICompileUnit::FullDebug : llvm::DICompileUnit::LineTablesOnly;
+    file = llvmContext->getDBuilder()->createFile(filename, directory);
+    theCU = llvmContext->getDBuilder()->createCompileUnit(llvm::dwarf::DW_LANG_C, file,
+                                                          "Kaleidoscope Compiler", false, "", 0, "", kind);
+}
+
 llvm::DIType* ast::DebugInfo::getDoubleTy() {
     if (dblTy) {
         return dblTy;
@@ -8,7 +31,29 @@ llvm::DIType* ast::DebugInfo::getDoubleTy() {
     return dblTy;
 }
 
-void ast::DebugInfo::emitLocation(ast::ExprAST *ast) {
+llvm::DISubroutineType* ast::DebugInfo::getFunctionType(unsigned numArgs) {
+    // line tables carry no types, so every function shares the empty signature.
+    if (level != DebugLevel::Full) {
+        numArgs = 0;
+    }
+    auto &fnTy = functionTypes[numArgs];
+    if (fnTy) {
+        return fnTy;
+    }
+
+    llvm::SmallVector<llvm::Metadata*, 8> eltTys{};
+    if (level == DebugLevel::Full) {
+        auto dblTy = getDoubleTy();
+        eltTys.push_back(dblTy);
+        for (unsigned i = 0, e = numArgs; i != e; ++i) {
+            eltTys.push_back(dblTy);
+        }
+    }
+    fnTy = llvmContext->getDBuilder()->createSubroutineType(llvmContext->getDBuilder()->getOrCreateTypeArray(eltTys));
+    return fnTy;
+}
+
+void ast::DebugInfo::setLocation(const ast::ExprAST *ast) {
     if (!ast) {
         return llvmContext->getBuilder()->SetCurrentDebugLocation(llvm::DebugLoc{});
     }
@@ -0,0 +1,238 @@
+#include <numeric>
+#include <sstream>
+#include "Parser.h"
+#include "Snapshot.h"
+#include "Engine.h"
+
+kal::Engine::Engine(unsigned jitListeners) {
+    llvmContext = std::make_shared<LLVMContext>();
+    llvmContext->initializeJit(0, jitListeners);
+    ksDebugInfo = std::make_shared<ast::DebugInfo>(llvmContext);
+    ksDebugInfo->initializeCompileUnit("<engine>", ".");
+}
+
+kal::Engine::~Engine() {
+    // prototypes hold on to the context, drop them so it can be released.
+    llvmContext->getSymbols().clear();
+}
+
+bool kal::Engine::compile(std::string_view src) {
+    std::unique_lock<std::shared_mutex> lock{sessionMutex};
+
+    std::istringstream input{std::string{src}};
+    resetLexer(&input);
+    getNextToken();
+
+    auto ok = true;
+    while (curTok != tokEof) {
+        switch (curTok) {
+            case ';':
+                getNextToken();
+                break;
+            case tokDef:
+                ok = compileDefinition() && ok;
+                break;
+            case tokExtern:
+                ok = compileExtern() && ok;
+                break;
+            default:
+                ok = compileTopLevelExpression().has_value() && ok;
+                break;
+        }
+    }
+    resetLexer(nullptr);
+    return ok;
+}
+
+bool kal::Engine::isSnapshot(std::string_view contents) {
+    return PreludeSnapshot::isSnapshot(llvm::StringRef{contents.data(), contents.size()});
+}
+
+std::shared_ptr<const PreludeSnapshot> kal::Engine::loadSnapshot(const std::string &path) {
+    auto snapshot = PreludeSnapshot::load(path);
+    if (!snapshot) {
+        logError(llvm::toString(snapshot.takeError()));
+        return nullptr;
+    }
+    return std::move(*snapshot);
+}
+
+bool kal::Engine::loadPrelude(const std::shared_ptr<const PreludeSnapshot> &snapshot) {
+    std::unique_lock<std::shared_mutex> lock{sessionMutex};
+    if (auto err = installPrelude(snapshot, llvmContext)) {
+        logError(llvm::toString(std::move(err)));
+        return false;
+    }
+    return true;
+}
+
+std::optional<double> kal::Engine::evaluate(std::string_view expr) {
+    return evaluate(std::vector<std::string>{std::string{expr}}).front();
+}
+
+/// codegenExprs - codegen the expressions `which` of `exprs` into the current
+/// module, each as a function named after its index; the indices that made
+/// it, with the function names in `names`.
+std::vector<size_t> kal::Engine::codegenExprs(const std::vector<std::string> &exprs, const std::vector<size_t> &which,
+                                              std::vector<std::string> &names) {
+    std::vector<size_t> slots{};
+    names.clear();
+    for (auto i: which) {
+        std::istringstream input{exprs[i]};
+        resetLexer(&input);
+        getNextToken();
+
+        auto name = "__anon_expr" + std::to_string(i);
+        auto fnAst = parseTopLevelExpr(llvmContext, ksDebugInfo, name);
+        if (!fnAst) {
+            continue;
+        }
+        if (curTok != tokEof && curTok != ';') {
+            logError("unexpected input after expression");
+            continue;
+        }
+        if (fnAst->codegen()) {
+            names.push_back(name);
+            slots.push_back(i);
+        }
+    }
+    resetLexer(nullptr);
+    return slots;
+}
+
+std::vector<std::optional<double>> kal::Engine::evaluate(const std::vector<std::string> &exprs) {
+    std::unique_lock<std::shared_mutex> lock{sessionMutex};
+
+    std::vector<std::optional<double>> results(exprs.size());
+    std::vector<size_t> all(exprs.size());
+    std::iota(all.begin(), all.end(), 0);
+    std::vector<std::string> names{};
+    auto slots = codegenExprs(exprs, all, names);
+    if (slots.empty()) {
+        return results;
+    }
+
+    std::vector<double> values{};
+    auto err = llvmContext->handleTopLevelExprsJit(names, values);
+    ksDebugInfo->resetCompileUnit();
+    for (size_t i = 0, e = values.size(); i != e; ++i) {
+        results[slots[i]] = values[i];
+    }
+    if (!err) {
+        return results;
+    }
+    if (slots.size() == 1) {
+        logError(llvm::toString(std::move(err)));
+        return results;
+    }
+
+    // the batch is compiled as a whole, so one expression that does not link
+    // fails all of them: run the ones that did not run yet on their own.
+    llvm::consumeError(std::move(err));
+    for (size_t i = values.size(), e = slots.size(); i != e; ++i) {
+        if (codegenExprs(exprs, {slots[i]}, names).empty()) {
+            continue;
+        }
+        values.clear();
+        err = llvmContext->handleTopLevelExprsJit(names, values);
+        ksDebugInfo->resetCompileUnit();
+        if (err) {
+            logError(llvm::toString(std::move(err)));
+            continue;
+        }
+        results[slots[i]] = values.front();
+    }
+    return results;
+}
+
+std::uint64_t kal::Engine::lookupAddress(const std::string &name) {
+    {
+        std::shared_lock<std::shared_mutex> lock{sessionMutex};
+        auto it = addressCache.find(name);
+        if (it != addressCache.end()) {
+            return it->second;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock{sessionMutex};
+    auto it = addressCache.find(name);
+    if (it != addressCache.end()) {
+        return it->second;
+    }
+
+    auto symbol = llvmContext->getJit()->lookup(name);
+    if (!symbol) {
+        llvm::consumeError(symbol.takeError());
+        return 0;
+    }
+    addressCache[name] = symbol->getAddress();
+    return symbol->getAddress();
+}
+
+bool kal::Engine::compileDefinition() {
+    auto fnAst = parseDefinition(llvmContext, ksDebugInfo);
+    if (!fnAst) {
+        getNextToken();
+        return false;
+    }
+
+    auto key = fnAst->definitionKey();
+    if (llvmContext->isDefinitionCurrent(fnAst->getName(), key)) {
+        return true;
+    }
+
+    auto *fnIR = fnAst->codegen();
+    if (!fnIR) {
+        return false;
+    }
+
+    auto name = fnIR->getName().str();
+    // relinking moves the callers of the redefined function too.
+    std::set<std::string> moved{name};
+    auto err = llvmContext->handleDefinition(name, std::move(key), &moved);
+    for (const auto &movedName: moved) {
+        addressCache.erase(movedName);
+    }
+    ksDebugInfo->resetCompileUnit();
+    if (err) {
+        logError(llvm::toString(std::move(err)));
+        return false;
+    }
+    return true;
+}
+
+bool kal::Engine::compileExtern() {
+    auto protoAst = parseExtern(llvmContext, ksDebugInfo);
+    if (!protoAst) {
+        getNextToken();
+        return false;
+    }
+
+    if (!protoAst->codegen()) {
+        return false;
+    }
+    auto name = protoAst->getName();
+    llvmContext->getSymbols().exchange(name, std::move(protoAst));
+    return true;
+}
+
+std::optional<double> kal::Engine::compileTopLevelExpression() {
+    auto fnAst = parseTopLevelExpr(llvmContext, ksDebugInfo);
+    if (!fnAst) {
+        getNextToken();
+        return std::nullopt;
+    }
+
+    auto *fnIR = fnAst->codegen();
+    if (!fnIR) {
+        return std::nullopt;
+    }
+
+    auto result = llvmContext->handleTopLevelExprJit(fnIR->getName().str());
+    ksDebugInfo->resetCompileUnit();
+    if (!result) {
+        logError(llvm::toString(result.takeError()));
+        return std::nullopt;
+    }
+    return *result;
+}
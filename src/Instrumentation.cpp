@@ -0,0 +1,89 @@
+#include <map>
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include "Instrumentation.h"
+
+// declared extern "C" in the header, which names it for the JIT.
+std::uint64_t __ks_counters[Instrumentation::maxCounters];
+
+Instrumentation& Instrumentation::get() {
+    static Instrumentation instrumentation{};
+    return instrumentation;
+}
+
+bool Instrumentation::addCounter(Counter counter, std::uint64_t &id) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto found = ids.find(std::make_tuple(counter.function, counter.kind, counter.index));
+    if (found != ids.end()) {
+        id = found->second;
+        // the site may have moved in the new definition.
+        counters[id].line = counter.line;
+        return true;
+    }
+    if (counters.size() == maxCounters) {
+        if (!full) {
+            llvm::errs() << "warning: more than " << maxCounters << " counters, new sites are not counted\n";
+            full = true;
+        }
+        return false;
+    }
+    id = counters.size();
+    ids.emplace(std::make_tuple(counter.function, counter.kind, counter.index), id);
+    counters.push_back(std::move(counter));
+    return true;
+}
+
+bool Instrumentation::writeReport(const std::string &path) {
+    std::lock_guard<std::mutex> lock{mutex};
+
+    struct Site {
+        int line = 0;
+        std::map<std::string, std::uint64_t> counts;
+    };
+    std::map<std::string, std::map<unsigned, Site>> functions{};
+    for (size_t id = 0, e = counters.size(); id != e; ++id) {
+        const auto &counter = counters[id];
+        auto &site = functions[counter.function][counter.kind == "entry" ? ~0u : counter.index];
+        site.line = counter.line;
+        site.counts[counter.kind] = __ks_counters[id];
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream out{path, ec, llvm::sys::fs::OF_Text};
+    if (ec) {
+        llvm::errs() << "Could not open " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+
+    llvm::json::OStream json{out, 2};
+    json.object([&] {
+        json.attribute("format", "kaleidoscope-counters");
+        json.attribute("version", 1);
+        json.attributeArray("functions", [&] {
+            for (const auto &function: functions) {
+                json.object([&] {
+                    json.attribute("name", function.first);
+                    auto entry = function.second.find(~0u);
+                    json.attribute("entry", static_cast<int64_t>(entry == function.second.end() ? 0 : entry->second.counts.at("entry")));
+                    json.attributeArray("sites", [&] {
+                        for (const auto &site: function.second) {
+                            if (site.first == ~0u) {
+                                continue;
+                            }
+                            json.object([&] {
+                                json.attribute("index", static_cast<int64_t>(site.first));
+                                json.attribute("line", site.second.line);
+                                for (const auto &count: site.second.counts) {
+                                    json.attribute(count.first, static_cast<int64_t>(count.second));
+                                }
+                            });
+                        }
+                    });
+                });
+            }
+        });
+    });
+    out << "\n";
+    return true;
+}
@@ -0,0 +1,167 @@
+#include <malloc.h>
+#include <sys/resource.h>
+#include <cstdlib>
+#include <new>
+#include "llvm/Support/Format.h"
+#include "MemReport.h"
+
+MemReport& MemReport::get() {
+    // never destroyed: operator delete still runs during static destruction.
+    alignas(MemReport) static unsigned char storage[sizeof(MemReport)];
+    static auto *report = new (storage) MemReport{};
+    return *report;
+}
+
+void MemReport::enable() {
+    TimeReport::get().trackPhases();
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+void MemReport::recordAlloc(void *block, size_t bytes) {
+    auto phase = PhaseTimer::currentPhase();
+    {
+        auto &shard = shardOf(block);
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        shard.blocks[block] = phase;
+    }
+
+    auto &counts = phases[phase];
+    counts.allocs.fetch_add(1, std::memory_order_relaxed);
+    counts.allocBytes.fetch_add(bytes, std::memory_order_relaxed);
+
+    auto live = liveBytes.fetch_add(bytes, std::memory_order_relaxed) + int64_t(bytes);
+    auto peak = peakBytes.load(std::memory_order_relaxed);
+    while (live > peak && !peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
+
+void MemReport::recordFree(void *block, size_t bytes) {
+    unsigned phase;
+    {
+        auto &shard = shardOf(block);
+        std::lock_guard<std::mutex> lock{shard.mutex};
+        auto counted = shard.blocks.find(block);
+        if (counted == shard.blocks.end()) {
+            // allocated before enable(): its allocation was never counted.
+            return;
+        }
+        phase = counted->second;
+        shard.blocks.erase(counted);
+    }
+
+    auto &counts = phases[phase];
+    counts.frees.fetch_add(1, std::memory_order_relaxed);
+    counts.freeBytes.fetch_add(bytes, std::memory_order_relaxed);
+    liveBytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void MemReport::countNode(llvm::StringRef type, size_t bytes) {
+    if (!isEnabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock{nodesMutex};
+    auto &counts = nodes[type];
+    ++counts.count;
+    counts.bytes += bytes;
+}
+
+void MemReport::print(llvm::raw_ostream &out) {
+    out << "===" << std::string(73, '-') << "===\n"
+        << "                     Kaleidoscope compile memory report\n"
+        << "===" << std::string(73, '-') << "===\n"
+        << "  phase          allocs    alloc (KB)       frees    freed (KB)      net (KB)\n";
+    uint64_t allocs = 0, allocBytes = 0, frees = 0, freeBytes = 0;
+    auto row = [&out](const char *name, uint64_t allocs, uint64_t allocBytes, uint64_t frees, uint64_t freeBytes) {
+        out << llvm::format("  %-10s %10llu %13.1f %11llu %13.1f %13.1f\n", name, (unsigned long long)allocs,
+                            allocBytes / 1024.0, (unsigned long long)frees, freeBytes / 1024.0,
+                            (double(allocBytes) - double(freeBytes)) / 1024.0);
+    };
+    for (unsigned p = 0; p <= TimeReport::NumPhases; ++p) {
+        const auto &counts = phases[p];
+        row(TimeReport::phaseName(TimeReport::Phase(p)), counts.allocs, counts.allocBytes, counts.frees, counts.freeBytes);
+        allocs += counts.allocs;
+        allocBytes += counts.allocBytes;
+        frees += counts.frees;
+        freeBytes += counts.freeBytes;
+    }
+    row("total", allocs, allocBytes, frees, freeBytes);
+
+    out << "\n  AST node                     count    size (KB)\n";
+    {
+        std::lock_guard<std::mutex> lock{nodesMutex};
+        uint64_t count = 0, bytes = 0;
+        for (const auto &node: nodes) {
+            out << llvm::format("  %-24s %9llu %12.1f\n", node.first.str().c_str(),
+                                (unsigned long long)node.second.count, node.second.bytes / 1024.0);
+            count += node.second.count;
+            bytes += node.second.bytes;
+        }
+        out << llvm::format("  %-24s %9llu %12.1f\n", static_cast<const char*>("total"), (unsigned long long)count,
+                            bytes / 1024.0);
+    }
+
+    // the IR is what codegen leaves behind; its net allocations approximate it.
+    const auto &codegen = phases[TimeReport::Codegen];
+    out << llvm::format("\n  IR: %llu functions, %llu instructions, ~%.1f KB allocated by codegen\n",
+                        (unsigned long long)TimeReport::get().getCount(TimeReport::Functions),
+                        (unsigned long long)TimeReport::get().getCount(TimeReport::IrInstructions),
+                        (double(codegen.allocBytes) - double(codegen.freeBytes)) / 1024.0);
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    out << llvm::format("  peak heap: %.1f KB, peak RSS: %ld KB\n", peakBytes.load() / 1024.0, usage.ru_maxrss);
+    out.flush();
+}
+
+// The counting allocator. Sizes are what malloc actually handed out, so that
+// a free subtracts exactly what its allocation added.
+
+static void* countedAlloc(size_t size) {
+    auto *p = std::malloc(size ? size : 1);
+    if (p && MemReport::get().isEnabled()) {
+        MemReport::get().recordAlloc(p, malloc_usable_size(p));
+    }
+    return p;
+}
+
+static void countedFree(void *p) noexcept {
+    if (p && MemReport::get().isEnabled()) {
+        MemReport::get().recordFree(p, malloc_usable_size(p));
+    }
+    std::free(p);
+}
+
+void* operator new(size_t size) {
+    if (auto *p = countedAlloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void operator delete(void *p) noexcept {
+    countedFree(p);
+}
+
+void operator delete[](void *p) noexcept {
+    countedFree(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    countedFree(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    countedFree(p);
+}
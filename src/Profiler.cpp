@@ -0,0 +1,258 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <cerrno>
+#include <set>
+#include "llvm/DebugInfo/DWARF/DWARFContext.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "Profiler.h"
+
+// set on the thread start() was called on; SIGPROF may land on any thread.
+static thread_local bool profiledThread = false;
+
+Profiler& Profiler::get() {
+    static Profiler profiler{};
+    return profiler;
+}
+
+void Profiler::onSignal(int sig, siginfo_t *info, void *context) {
+    auto savedErrno = errno;
+    auto &profiler = get();
+    if (!profiledThread) {
+        profiler.otherThreadSamples.fetch_add(1, std::memory_order_relaxed);
+        errno = savedErrno;
+        return;
+    }
+
+    auto *uc = static_cast<ucontext_t*>(context);
+#if defined(__x86_64__)
+    profiler.record(uc->uc_mcontext.gregs[REG_RIP], uc->uc_mcontext.gregs[REG_RBP]);
+#elif defined(__aarch64__)
+    profiler.record(uc->uc_mcontext.pc, uc->uc_mcontext.regs[29]);
+#endif
+    errno = savedErrno;
+}
+
+void Profiler::record(uintptr_t pc, uintptr_t fp) {
+    auto index = nextSample.fetch_add(1, std::memory_order_relaxed);
+    if (index >= maxSamples) {
+        return;
+    }
+
+    // slot layout: depth, then the pc and return addresses, innermost first.
+    auto *slot = &buffer[index * (maxDepth + 1)];
+    size_t depth = 0;
+    slot[1 + depth++] = pc;
+    // only follow frame pointers that stay inside this thread's stack and
+    // move towards its base, so a bogus chain cannot fault or loop.
+    while (depth < maxDepth && fp >= stackLow && fp + 2 * sizeof(uintptr_t) <= stackHigh &&
+           fp % sizeof(uintptr_t) == 0) {
+        auto *frame = reinterpret_cast<uintptr_t*>(fp);
+        if (!frame[1]) {
+            break;
+        }
+        slot[1 + depth++] = frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+    slot[0] = depth;
+}
+
+bool Profiler::start(unsigned intervalUs, size_t maxSamples) {
+    this->intervalUs = intervalUs;
+    this->maxSamples = maxSamples;
+    buffer.assign(maxSamples * (maxDepth + 1), 0);
+    nextSample = 0;
+    otherThreadSamples = 0;
+
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return false;
+    }
+    void *stackAddr = nullptr;
+    size_t stackSize = 0;
+    pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+    pthread_attr_destroy(&attr);
+    stackLow = reinterpret_cast<uintptr_t>(stackAddr);
+    stackHigh = stackLow + stackSize;
+    profiledThread = true;
+
+    struct sigaction action{};
+    action.sa_sigaction = onSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, nullptr) != 0) {
+        return false;
+    }
+
+    itimerval timer{};
+    timer.it_interval.tv_sec = intervalUs / 1000000;
+    timer.it_interval.tv_usec = intervalUs % 1000000;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+}
+
+void Profiler::stop() {
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN);
+    profiledThread = false;
+}
+
+void Profiler::notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile &obj,
+                                  const llvm::RuntimeDyld::LoadedObjectInfo &info) {
+    // the debug object carries the addresses the sections were loaded at.
+    auto debugObj = info.getObjectForDebug(obj);
+    const auto &loaded = debugObj.getBinary() ? *debugObj.getBinary() : obj;
+    auto dwarf = llvm::DWARFContext::create(loaded);
+
+    std::lock_guard<std::mutex> lock{mutex};
+    for (const auto &symbolSize: llvm::object::computeSymbolSizes(loaded)) {
+        const auto &symbol = symbolSize.first;
+        auto type = symbol.getType();
+        if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+            llvm::consumeError(type.takeError());
+            continue;
+        }
+        auto name = symbol.getName();
+        auto address = symbol.getAddress();
+        auto section = symbol.getSection();
+        if (!name || !address || !section) {
+            llvm::consumeError(name.takeError());
+            llvm::consumeError(address.takeError());
+            llvm::consumeError(section.takeError());
+            continue;
+        }
+
+        Function function{symbolSize.second, name->str(), {}};
+        auto rows = dwarf->getLineInfoForAddressRange({*address, (*section)->getIndex()}, symbolSize.second);
+        for (const auto &row: rows) {
+            function.lines.emplace_back(row.first, row.second.Line);
+        }
+        // code of a removed module may be reused; the newest owner wins.
+        functions[*address] = std::move(function);
+    }
+}
+
+const Profiler::Function* Profiler::findFunction(uint64_t address, uint64_t &start) const {
+    auto it = functions.upper_bound(address);
+    if (it == functions.begin()) {
+        return nullptr;
+    }
+    --it;
+    if (address >= it->first + it->second.size) {
+        return nullptr;
+    }
+    start = it->first;
+    return &it->second;
+}
+
+static std::string nativeName(uintptr_t address) {
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void*>(address), &info) && info.dli_sname) {
+        return llvm::demangle(info.dli_sname);
+    }
+    return "[unknown]";
+}
+
+bool Profiler::writeReport(const std::string &foldedPath, llvm::raw_ostream &table) {
+    struct Totals {
+        size_t self = 0;
+        size_t total = 0;
+        std::map<unsigned, size_t> lines;
+    };
+
+    std::lock_guard<std::mutex> lock{mutex};
+    auto recorded = nextSample.load();
+    auto count = std::min(recorded, maxSamples);
+    size_t outside = 0;
+    std::map<std::string, size_t> folded{};
+    std::map<std::string, Totals> totals{};
+
+    for (size_t i = 0; i < count; ++i) {
+        const auto *slot = &buffer[i * (maxDepth + 1)];
+        auto depth = slot[0];
+
+        // return addresses point past the call; step back into it.
+        auto frameAddress = [slot](size_t d) { return d == 0 ? slot[1] : slot[1 + d] - 1; };
+        size_t outermost = depth;
+        for (size_t d = 0; d < depth; ++d) {
+            uint64_t start;
+            if (findFunction(frameAddress(d), start)) {
+                outermost = d;
+            }
+        }
+        if (outermost == depth) {
+            ++outside;
+            continue;
+        }
+
+        std::string stack{};
+        std::set<std::string> seen{};
+        for (size_t d = outermost + 1; d-- > 0;) {
+            uint64_t start;
+            auto *function = findFunction(frameAddress(d), start);
+            auto name = function ? function->name : nativeName(frameAddress(d));
+            stack += (stack.empty() ? "" : ";") + name;
+            if (seen.insert(name).second) {
+                ++totals[name].total;
+            }
+            if (d == 0) {
+                auto &leaf = totals[name];
+                ++leaf.self;
+                if (function) {
+                    auto row = std::upper_bound(function->lines.begin(), function->lines.end(),
+                                                std::make_pair(uint64_t(slot[1]), ~0u));
+                    if (row != function->lines.begin()) {
+                        ++leaf.lines[std::prev(row)->second];
+                    }
+                }
+            }
+        }
+        ++folded[stack];
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream out{foldedPath, ec, llvm::sys::fs::OF_Text};
+    if (ec) {
+        llvm::errs() << "Could not open " << foldedPath << ": " << ec.message() << "\n";
+        return false;
+    }
+    for (const auto &stack: folded) {
+        out << stack.first << ' ' << stack.second << '\n';
+    }
+
+    std::vector<std::pair<std::string, Totals>> rows(totals.begin(), totals.end());
+    std::sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) { return a.second.self > b.second.self; });
+
+    auto ms = [this](size_t samples) { return samples * intervalUs / 1000.0; };
+    auto percent = [count](size_t samples) { return count ? 100.0 * samples / count : 0.0; };
+    table << "   self%    self ms   total%   total ms  function\n";
+    for (const auto &row: rows) {
+        table << llvm::format("%7.2f%% %10.1f %7.2f%% %10.1f  ", percent(row.second.self), ms(row.second.self),
+                              percent(row.second.total), ms(row.second.total))
+              << row.first;
+        if (!row.second.lines.empty()) {
+            auto hottest = std::max_element(row.second.lines.begin(), row.second.lines.end(),
+                                            [](const auto &a, const auto &b) { return a.second < b.second; });
+            table << " (hottest line " << hottest->first << ")";
+        }
+        table << '\n';
+    }
+    table << llvm::format("%7.2f%% %10.1f", percent(outside), ms(outside)) << "  [outside JIT'd code]\n";
+    table << count << " samples every " << intervalUs << "us";
+    if (recorded > count) {
+        table << ", " << recorded - count << " dropped (buffer full)";
+    }
+    if (otherThreadSamples) {
+        table << ", " << otherThreadSamples.load() << " on other threads";
+    }
+    table << "; folded stacks written to " << foldedPath << "\n";
+    return true;
+}
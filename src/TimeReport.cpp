@@ -0,0 +1,97 @@
+#include "llvm/Pass.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Timer.h"
+#include "TimeReport.h"
+
+static const char *phaseNames[TimeReport::NumPhases] = {"lex", "parse", "codegen", "verify", "optimize", "emit"};
+static const char *counterNames[TimeReport::NumCounters] = {"tokens", "AST nodes", "functions", "IR instructions"};
+static const char *counterKeys[TimeReport::NumCounters] = {"tokens", "ast_nodes", "functions", "ir_instructions"};
+
+void TimeReport::enable() {
+    llvm::TimePassesIsEnabled = true;
+    passTimes = std::make_unique<llvm::TimePassesHandler>(true);
+    trackPhases();
+}
+
+const char* TimeReport::phaseName(Phase phase) {
+    return phase < NumPhases ? phaseNames[phase] : "other";
+}
+
+void TimeReport::registerPassCallbacks(llvm::PassInstrumentationCallbacks &pic) {
+    if (passTimes) {
+        passTimes->registerCallbacks(pic);
+    }
+}
+
+void TimeReport::print(llvm::raw_ostream &out) {
+    uint64_t totalWall = 0, totalCpu = 0;
+    for (unsigned p = 0; p < NumPhases; ++p) {
+        totalWall += wall[p].load(std::memory_order_relaxed);
+        totalCpu += cpu[p].load(std::memory_order_relaxed);
+    }
+
+    out << "===" << std::string(73, '-') << "===\n"
+        << "                      Kaleidoscope compile time report\n"
+        << "===" << std::string(73, '-') << "===\n"
+        << "  phase          wall (ms)     cpu (ms)   wall %\n";
+    auto row = [&out, totalWall](const char *name, uint64_t wallNs, uint64_t cpuNs) {
+        out << llvm::format("  %-10s %12.3f %12.3f %7.1f%%\n", name, wallNs / 1e6, cpuNs / 1e6,
+                            totalWall ? 100.0 * wallNs / totalWall : 0.0);
+    };
+    for (unsigned p = 0; p < NumPhases; ++p) {
+        row(phaseNames[p], wall[p].load(std::memory_order_relaxed), cpu[p].load(std::memory_order_relaxed));
+    }
+    row("total", totalWall, totalCpu);
+
+    out << "\n";
+    for (unsigned c = 0; c < NumCounters; ++c) {
+        out << llvm::format("  %-16s %12llu\n", counterNames[c],
+                            (unsigned long long)counters[c].load(std::memory_order_relaxed));
+    }
+    out << "\n";
+
+    llvm::reportAndResetTimings(&out);
+    if (passTimes) {
+        passTimes->setOutStream(out);
+        passTimes->print();
+    }
+    out.flush();
+}
+
+bool TimeReport::writeJson(const std::string &path) {
+    std::error_code ec;
+    llvm::raw_fd_ostream out{path, ec, llvm::sys::fs::OF_Text};
+    if (ec) {
+        llvm::errs() << "Could not open " << path << ": " << ec.message() << "\n";
+        return false;
+    }
+
+    llvm::json::OStream json{out, 2};
+    json.object([&] {
+        json.attributeObject("phases", [&] {
+            for (unsigned p = 0; p < NumPhases; ++p) {
+                json.attributeObject(phaseNames[p], [&] {
+                    json.attribute("wall_ms", wall[p].load(std::memory_order_relaxed) / 1e6);
+                    json.attribute("cpu_ms", cpu[p].load(std::memory_order_relaxed) / 1e6);
+                });
+            }
+        });
+        json.attributeObject("counters", [&] {
+            for (unsigned c = 0; c < NumCounters; ++c) {
+                json.attribute(counterKeys[c], static_cast<int64_t>(counters[c].load(std::memory_order_relaxed)));
+            }
+        });
+        // LLVM writes its timers as "time.<group>.<timer>.<kind>": seconds.
+        json.attributeBegin("passes");
+        json.rawValue([](llvm::raw_ostream &os) {
+            os << "{";
+            llvm::TimerGroup::printAllJSONValues(os, "");
+            os << "}";
+        });
+        json.attributeEnd();
+    });
+    out << "\n";
+    return true;
+}
@@ -1,20 +1,27 @@
 #include <utility>
 #include <vector>
 #include <map>
+#include <set>
+#include "llvm/ADT/Hashing.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Function.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/TypeName.h"
 #include "LLVM.h"
+#include "MemReport.h"
 
 struct SourceLocation {
     int line;
     int col;
 };
 
-static SourceLocation curLoc;
-static SourceLocation lexLoc{1, 0};
+static thread_local SourceLocation curLoc;
+static thread_local SourceLocation lexLoc{1, 0};
+static thread_local std::istream *lexInput = nullptr;
 
 static int advance() {
-    auto lastChar = getchar();
+    auto lastChar = lexInput ? lexInput->get() : getchar();
 
     if (lastChar == '\n' || lastChar == '\r') {
         ++lexLoc.line;
@@ -26,86 +33,145 @@ static int advance() {
 }
 
 namespace ast {
-    static std::map<std::string, llvm::AllocaInst*> namedValues;
+    static thread_local std::map<std::string, llvm::AllocaInst*> namedValues;
+
+    /// makeNode - std::make_unique for AST nodes, counted by type for
+    /// --mem-report.
+    template <typename T, typename... Args>
+    std::unique_ptr<T> makeNode(Args&&... args) {
+        MemReport::get().countNode(llvm::getTypeName<T>(), sizeof(T));
+        return std::make_unique<T>(std::forward<Args>(args)...);
+    }
+
+    /// ExprKind - the concrete type of an ExprAST, for ExprVisitor and for
+    /// llvm::isa/dyn_cast.
+    enum class ExprKind : uint8_t {
+        Number,
+        Variable,
+        Unary,
+        Binary,
+        Call,
+        If,
+        For,
+        While,
+        Var
+    };
 
+    /// ExprAST - base of the expression nodes. Passes over expressions are
+    /// ExprVisitors that switch on the node's kind, not virtual methods.
     class ExprAST {
+        ExprKind kind;
         SourceLocation loc;
     public:
-        ExprAST(SourceLocation loc = curLoc): loc(loc) {}
+        ExprAST(ExprKind kind, SourceLocation loc = curLoc): kind(kind), loc(loc) {
+            TimeReport::get().count(TimeReport::AstNodes);
+        }
         virtual ~ExprAST() = default;
-        virtual llvm::Value* codegen() = 0;
+        ExprKind getKind() const {
+            return kind;
+        }
         int getLine() const {
             return loc.line;
         }
         int getCol() const {
             return loc.col;
         }
-        virtual llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) {
-            return out << ':' << getLine() << ':' << getCol()  << '\n';
-        }
+        /// dump - print the expression as a tree, nested `ind` levels deep.
+        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) const;
+        /// hash - structural hash of the expression. Source locations are left
+        /// out so that moving a definition around does not count as a change.
+        llvm::hash_code hash() const;
+        /// writeCanonical - serialize the expression so that only structurally
+        /// equal ones (locations left out, as in hash()) write the same text.
+        void writeCanonical(llvm::raw_ostream &out) const;
+        /// collectCallees - names of the functions this expression calls,
+        /// including the functions behind user defined operators.
+        void collectCallees(std::set<std::string> &callees) const;
+    };
+
+    /// DebugLevel - how much debug info codegen emits: nothing (-g0), a
+    /// subprogram per function plus line locations (-gline-tables-only), or
+    /// also types and parameter variables (-g).
+    enum class DebugLevel {
+        None,
+        LineTablesOnly,
+        Full
     };
 
     struct DebugInfo {
-        llvm::DICompileUnit *theCU;
-        llvm::DIType *dblTy;
+        DebugLevel level = DebugLevel::Full;
+        llvm::DICompileUnit *theCU = nullptr;
+        llvm::DIFile *file = nullptr;
+        llvm::DIType *dblTy = nullptr;
+        std::map<unsigned, llvm::DISubroutineType*> functionTypes;
         std::vector<llvm::DIScope*> lexicalBlocks;
         std::shared_ptr<LLVMContext> llvmContext;
+        std::string filename;
+        std::string directory;
 
         DebugInfo(std::shared_ptr<LLVMContext> llvmContext): lexicalBlocks(std::vector<llvm::DIScope*>{}), llvmContext(std::move(llvmContext)) {}
 
-        void emitLocation(ast::ExprAST *ast);
+        void initializeCompileUnit(llvm::StringRef filename, llvm::StringRef directory, DebugLevel level = DebugLevel::Full);
+        // resetCompileUnit - start a new CU for the next module handed to the JIT.
+        void resetCompileUnit();
+        // emitLocation - inline so that at -g0 codegen pays only for the check.
+        void emitLocation(const ast::ExprAST *ast) {
+            if (level != DebugLevel::None) {
+                setLocation(ast);
+            }
+        }
+        void setLocation(const ast::ExprAST *ast);
         llvm::DIType *getDoubleTy();
+        llvm::DISubroutineType *getFunctionType(unsigned numArgs);
     };
 
-    class  NumberExprAST: public ExprAST {
+    class NumberExprAST: public ExprAST {
         double val;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
-        NumberExprAST(double val, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo):
-        val(val), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+        NumberExprAST(double val):
+        ast::ExprAST(ExprKind::Number), val(val) {}
 
-        llvm::Value* codegen() override;
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::Number;
+        }
 
-        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) override {
-            return ast::ExprAST::dump(out << val, ind);
+        double getValue() const {
+            return val;
         }
     };
 
     class VariableExprAST: public ExprAST {
         std::string name;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
-        VariableExprAST(SourceLocation loc, std::string name, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo):
-        ast::ExprAST(loc), name(std::move(name)), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+        VariableExprAST(SourceLocation loc, std::string name):
+        ast::ExprAST(ExprKind::Variable, loc), name(std::move(name)) {}
 
-        llvm::Value* codegen() override;
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::Variable;
+        }
 
         inline const std::string& getName() const {
             return name;
         }
-
-        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) override {
-            return ast::ExprAST::dump(out << name, ind);
-        }
     };
 
     class UnaryExprAST: public ExprAST {
         char op;
         std::unique_ptr<ExprAST> operand;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
-        UnaryExprAST(char op, std::unique_ptr<ExprAST> operand, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo):
-            op(op), operand(std::move(operand)), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+        UnaryExprAST(char op, std::unique_ptr<ExprAST> operand):
+            ast::ExprAST(ExprKind::Unary), op(op), operand(std::move(operand)) {}
+
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::Unary;
+        }
 
-        llvm::Value* codegen() override;
+        char getOp() const {
+            return op;
+        }
 
-        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) override {
-            ast::ExprAST::dump(out << "unary" << op, ind);
-            operand->dump(out, ind + 1);
-            return out;
+        const ExprAST& getOperand() const {
+            return *operand;
         }
     };
 
@@ -113,92 +179,122 @@ namespace ast {
         char op;
         std::unique_ptr<ExprAST> lhs;
         std::unique_ptr<ExprAST> rhs;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
-        BinaryExprAST(SourceLocation loc, char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo):
-            ast::ExprAST(loc), op(op), lhs(std::move(lhs)), rhs(std::move(rhs)), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+        BinaryExprAST(SourceLocation loc, char op, std::unique_ptr<ExprAST> lhs, std::unique_ptr<ExprAST> rhs):
+            ast::ExprAST(ExprKind::Binary, loc), op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
 
-        llvm::Value* codegen() override;
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::Binary;
+        }
+
+        char getOp() const {
+            return op;
+        }
 
-        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) override {
-            ast::ExprAST::dump(out << "binary" << op, ind);
-            lhs->dump(llvmContext->indent(out, ind) << "LHS:", ind + 1);
-            rhs->dump(llvmContext->indent(out, ind) << "RHS:", ind + 1);
-            return out;
+        const ExprAST& getLHS() const {
+            return *lhs;
+        }
+
+        const ExprAST& getRHS() const {
+            return *rhs;
         }
     };
 
     class CallexprAST: public ExprAST {
         std::string callee;
         std::vector<std::unique_ptr<ExprAST>> args;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
-        CallexprAST(SourceLocation loc, std::string callee, std::vector<std::unique_ptr<ExprAST>> args, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo):
-            ast::ExprAST(loc), callee(std::move(callee)), args(std::move(args)), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+        CallexprAST(SourceLocation loc, std::string callee, std::vector<std::unique_ptr<ExprAST>> args):
+            ast::ExprAST(ExprKind::Call, loc), callee(std::move(callee)), args(std::move(args)) {}
 
-        llvm::Value* codegen() override;
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::Call;
+        }
 
-        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) override {
-            ast::ExprAST::dump(out << "call" << callee, ind);
-            for (const auto &arg: args) {
-                arg->dump(llvmContext->indent(out, ind + 1), ind + 1);
-            }
-            return out;
+        const std::string& getCallee() const {
+            return callee;
+        }
+
+        const std::vector<std::unique_ptr<ExprAST>>& getArgs() const {
+            return args;
         }
     };
 
     class IfExprAST: public ExprAST {
         std::unique_ptr<ExprAST> cond, then, else_;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
-        IfExprAST(SourceLocation loc, std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> then, std::unique_ptr<ExprAST> else_, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo):
-        ast::ExprAST(loc), cond(std::move(cond)), then(std::move(then)), else_(std::move(else_)), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+        IfExprAST(SourceLocation loc, std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> then, std::unique_ptr<ExprAST> else_):
+        ast::ExprAST(ExprKind::If, loc), cond(std::move(cond)), then(std::move(then)), else_(std::move(else_)) {}
+
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::If;
+        }
 
-        llvm::Value* codegen() override;
+        const ExprAST& getCond() const {
+            return *cond;
+        }
+
+        const ExprAST& getThen() const {
+            return *then;
+        }
 
-        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) override {
-            ast::ExprAST::dump(out << "if", ind);
-            cond->dump(llvmContext->indent(out, ind) << "Cond:", ind + 1);
-            then->dump(llvmContext->indent(out, ind) << "Then:", ind + 1);
-            else_->dump(llvmContext->indent(out, ind) << "Else:", ind + 1);
-            return out;
+        const ExprAST& getElse() const {
+            return *else_;
         }
     };
 
     class ForExprAST: public ExprAST {
         std::string varName;
         std::unique_ptr<ExprAST> start, end, step, body;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
         ForExprAST(std::string varName, std::unique_ptr<ExprAST> start,
                    std::unique_ptr<ExprAST> end, std::unique_ptr<ExprAST> step,
-                   std::unique_ptr<ExprAST> body, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo): varName(std::move(varName)), start(std::move(start)),
-                   end(std::move(end)), step(std::move(step)), body(std::move(body)), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+                   std::unique_ptr<ExprAST> body): ast::ExprAST(ExprKind::For), varName(std::move(varName)), start(std::move(start)),
+                   end(std::move(end)), step(std::move(step)), body(std::move(body)) {}
+
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::For;
+        }
+
+        const std::string& getVarName() const {
+            return varName;
+        }
 
-        llvm::Value* codegen() override;
+        const ExprAST& getStart() const {
+            return *start;
+        }
+
+        const ExprAST& getEnd() const {
+            return *end;
+        }
 
-        llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) override {
-            ast::ExprAST::dump(out << "for", ind);
-            start->dump(llvmContext->indent(out, ind) << "Cond:", ind + 1);
-            end->dump(llvmContext->indent(out, ind) << "End:", ind + 1);
-            step->dump(llvmContext->indent(out, ind) << "Step:", ind + 1);
-            body->dump(llvmContext->indent(out, ind) << "Body:", ind + 1);
-            return out;
+        /// getStep - nullptr if the loop steps by 1.
+        const ExprAST* getStep() const {
+            return step.get();
+        }
+
+        const ExprAST& getBody() const {
+            return *body;
         }
     };
 
     class WhileExprAST: public ExprAST {
         std::unique_ptr<ExprAST> end, body;
-        std::shared_ptr<LLVMContext> llvmContext;
     public:
-        WhileExprAST(std::unique_ptr<ExprAST> end, std::unique_ptr<ExprAST> body, std::shared_ptr<LLVMContext> llvmContext):
-            end(std::move(end)), body(std::move(body)), llvmContext(std::move(llvmContext)) {}
+        WhileExprAST(std::unique_ptr<ExprAST> end, std::unique_ptr<ExprAST> body):
+            ast::ExprAST(ExprKind::While), end(std::move(end)), body(std::move(body)) {}
 
-        llvm::Value* codegen() override;
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::While;
+        }
+
+        const ExprAST& getEnd() const {
+            return *end;
+        }
+
+        const ExprAST& getBody() const {
+            return *body;
+        }
     };
 
     class PrototypeAST {
@@ -212,9 +308,14 @@ namespace ast {
         PrototypeAST(SourceLocation loc, std::string name, std::vector<std::string> args, std::shared_ptr<LLVMContext> llvmContext,
                      bool isOperator = false, unsigned prec = 0):
             name(std::move(name)), args(std::move(args)), llvmContext(std::move(llvmContext)),
-            isOperator(isOperator), precedence(prec), line(loc.line) {}
+            isOperator(isOperator), precedence(prec), line(loc.line) {
+            TimeReport::get().count(TimeReport::AstNodes);
+        }
 
         llvm::Function* codegen();
+        /// codegen - declare the function in another context's module; used to
+        /// call a function whose prototype came from a different file.
+        llvm::Function* codegen(const std::shared_ptr<LLVMContext> &target) const;
 
         const std::string& getName() const {
             return this->name;
@@ -240,17 +341,35 @@ namespace ast {
         int getLine() const {
             return line;
         }
+
+        size_t getNumArgs() const {
+            return args.size();
+        }
+
+        const std::vector<std::string>& getArgs() const {
+            return args;
+        }
+
+        llvm::hash_code hash() const {
+            return llvm::hash_combine(name, llvm::hash_combine_range(args.begin(), args.end()), isOperator, precedence);
+        }
+
+        /// writeCanonical - what hash() covers, as text (see ExprAST).
+        void writeCanonical(llvm::raw_ostream &out) const {
+            out << name.size() << ':' << name << (isOperator ? 'o' : 'f') << precedence << ';' << args.size() << ';';
+            for (const auto &arg: args) {
+                out << arg.size() << ':' << arg;
+            }
+        }
     };
-    static std::map<std::string, std::unique_ptr<PrototypeAST>> functionProtos;
 
-    static llvm::Function* getFunction(const std::shared_ptr<LLVMContext> &llvmContext, std::string name) {
+    inline llvm::Function* getFunction(const std::shared_ptr<LLVMContext> &llvmContext, std::string name) {
         if (auto *f = llvmContext->getModule()->getFunction(name)) {
             return f;
         }
 
-        auto fi = functionProtos.find(name);
-        if (fi != functionProtos.end()) {
-            return fi->second->codegen();
+        if (auto proto = llvmContext->getSymbols().find(name)) {
+            return proto->codegen(llvmContext);
         }
 
         return nullptr;
@@ -267,6 +386,40 @@ namespace ast {
 
         llvm::Function* codegen();
 
+        /// getName - only valid before codegen(), which hands the prototype
+        /// over to the context.
+        const std::string& getName() const {
+            return proto->getName();
+        }
+
+        const PrototypeAST& getProto() const {
+            return *proto;
+        }
+
+        const ExprAST& getBody() const {
+            return *body;
+        }
+
+        /// definitionKey - identifies the code codegen() would produce: the
+        /// prototype, the body and the arity every callee currently has (a
+        /// caller of a function whose signature changed must be checked again).
+        DefinitionKey definitionKey() const {
+            DefinitionKey key{};
+            llvm::raw_string_ostream out{key.canonical};
+            proto->writeCanonical(out);
+            body->writeCanonical(out);
+
+            std::set<std::string> callees{};
+            body->collectCallees(callees);
+            for (const auto &callee: callees) {
+                auto calleeProto = llvmContext->getSymbols().find(callee);
+                out << callee.size() << ':' << callee << (calleeProto ? int(calleeProto->getNumArgs()) : -1) << ';';
+            }
+            out.flush();
+            key.hash = llvm::hash_value(key.canonical);
+            return key;
+        }
+
         llvm::raw_ostream& dump(llvm::raw_ostream &out, int ind) {
             llvmContext->indent(out, ind) << "FunctionAST\n";
             ++ind;
@@ -278,22 +431,359 @@ namespace ast {
     class VarExprAST : public ExprAST {
         std::vector<std::pair<std::string, std::unique_ptr<ast::ExprAST>>> varNames;
         std::unique_ptr<ast::ExprAST> body;
-        std::shared_ptr<LLVMContext> llvmContext;
-        std::shared_ptr<DebugInfo> ksDebugInfo;
     public:
         VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ast::ExprAST>>> varNames,
-                   std::unique_ptr<ast::ExprAST> body, std::shared_ptr<LLVMContext> llvmContext, std::shared_ptr<DebugInfo> ksDebugInfo):
-                   varNames(std::move(varNames)), body(std::move(body)), llvmContext(std::move(llvmContext)), ksDebugInfo(std::move(ksDebugInfo)) {}
+                   std::unique_ptr<ast::ExprAST> body):
+                   ast::ExprAST(ExprKind::Var), varNames(std::move(varNames)), body(std::move(body)) {}
+
+        static bool classof(const ExprAST *e) {
+            return e->getKind() == ExprKind::Var;
+        }
+
+        /// getVarNames - the names bound, each with its initializer or nullptr
+        /// (initialized to 0).
+        const std::vector<std::pair<std::string, std::unique_ptr<ast::ExprAST>>>& getVarNames() const {
+            return varNames;
+        }
+
+        const ExprAST& getBody() const {
+            return *body;
+        }
+    };
+
+    /// ExprVisitor - a pass over expressions, dispatched on the node kind
+    /// without virtual calls (CRTP, like llvm::InstVisitor). `Derived` has a
+    /// visit method for every kind; visit() switches to the one for a node,
+    /// so the compiler can inline the pass into its own recursion.
+    template <typename Derived, typename RetTy = void>
+    class ExprVisitor {
+    public:
+        RetTy visit(const ExprAST &e) {
+            auto &derived = static_cast<Derived&>(*this);
+            switch (e.getKind()) {
+                case ExprKind::Number:
+                    return derived.visitNumber(llvm::cast<NumberExprAST>(e));
+                case ExprKind::Variable:
+                    return derived.visitVariable(llvm::cast<VariableExprAST>(e));
+                case ExprKind::Unary:
+                    return derived.visitUnary(llvm::cast<UnaryExprAST>(e));
+                case ExprKind::Binary:
+                    return derived.visitBinary(llvm::cast<BinaryExprAST>(e));
+                case ExprKind::Call:
+                    return derived.visitCall(llvm::cast<CallexprAST>(e));
+                case ExprKind::If:
+                    return derived.visitIf(llvm::cast<IfExprAST>(e));
+                case ExprKind::For:
+                    return derived.visitFor(llvm::cast<ForExprAST>(e));
+                case ExprKind::While:
+                    return derived.visitWhile(llvm::cast<WhileExprAST>(e));
+                case ExprKind::Var:
+                    return derived.visitVar(llvm::cast<VarExprAST>(e));
+            }
+            llvm_unreachable("unknown expression kind");
+        }
+    };
+
+    /// StructuralHash - ExprAST::hash().
+    struct StructuralHash: ExprVisitor<StructuralHash, llvm::hash_code> {
+        llvm::hash_code visitNumber(const NumberExprAST &e) {
+            return llvm::hash_combine('n', llvm::DoubleToBits(e.getValue()));
+        }
+
+        llvm::hash_code visitVariable(const VariableExprAST &e) {
+            return llvm::hash_combine('v', e.getName());
+        }
 
-        llvm::Value* codegen() override;
+        llvm::hash_code visitUnary(const UnaryExprAST &e) {
+            return llvm::hash_combine('u', e.getOp(), visit(e.getOperand()));
+        }
+
+        llvm::hash_code visitBinary(const BinaryExprAST &e) {
+            return llvm::hash_combine('b', e.getOp(), visit(e.getLHS()), visit(e.getRHS()));
+        }
+
+        llvm::hash_code visitCall(const CallexprAST &e) {
+            auto h = llvm::hash_combine('c', e.getCallee());
+            for (const auto &arg: e.getArgs()) {
+                h = llvm::hash_combine(h, visit(*arg));
+            }
+            return h;
+        }
+
+        llvm::hash_code visitIf(const IfExprAST &e) {
+            return llvm::hash_combine('i', visit(e.getCond()), visit(e.getThen()), visit(e.getElse()));
+        }
+
+        llvm::hash_code visitFor(const ForExprAST &e) {
+            return llvm::hash_combine('f', e.getVarName(), visit(e.getStart()), visit(e.getEnd()),
+                                      e.getStep() ? visit(*e.getStep()) : llvm::hash_code(0), visit(e.getBody()));
+        }
+
+        llvm::hash_code visitWhile(const WhileExprAST &e) {
+            return llvm::hash_combine('w', visit(e.getEnd()), visit(e.getBody()));
+        }
+
+        llvm::hash_code visitVar(const VarExprAST &e) {
+            auto h = llvm::hash_combine('V', visit(e.getBody()));
+            for (const auto &namedVar: e.getVarNames()) {
+                h = llvm::hash_combine(h, namedVar.first, namedVar.second ? visit(*namedVar.second) : llvm::hash_code(0));
+            }
+            return h;
+        }
+    };
+
+    /// CanonicalWriter - ExprAST::writeCanonical(). Names go with their length
+    /// and numbers as their bits, so different trees never write the same text.
+    struct CanonicalWriter: ExprVisitor<CanonicalWriter> {
+        llvm::raw_ostream &out;
+
+        explicit CanonicalWriter(llvm::raw_ostream &out): out(out) {}
+
+        void writeName(llvm::StringRef name) {
+            out << name.size() << ':' << name;
+        }
+
+        void visitNumber(const NumberExprAST &e) {
+            out << 'n' << llvm::DoubleToBits(e.getValue()) << ';';
+        }
+
+        void visitVariable(const VariableExprAST &e) {
+            out << 'v';
+            writeName(e.getName());
+        }
+
+        void visitUnary(const UnaryExprAST &e) {
+            out << 'u' << e.getOp();
+            visit(e.getOperand());
+        }
+
+        void visitBinary(const BinaryExprAST &e) {
+            out << 'b' << e.getOp();
+            visit(e.getLHS());
+            visit(e.getRHS());
+        }
+
+        void visitCall(const CallexprAST &e) {
+            out << 'c';
+            writeName(e.getCallee());
+            out << e.getArgs().size() << ';';
+            for (const auto &arg: e.getArgs()) {
+                visit(*arg);
+            }
+        }
+
+        void visitIf(const IfExprAST &e) {
+            out << 'i';
+            visit(e.getCond());
+            visit(e.getThen());
+            visit(e.getElse());
+        }
+
+        void visitFor(const ForExprAST &e) {
+            out << 'f';
+            writeName(e.getVarName());
+            visit(e.getStart());
+            visit(e.getEnd());
+            if (e.getStep()) {
+                out << 's';
+                visit(*e.getStep());
+            } else {
+                out << '-';
+            }
+            visit(e.getBody());
+        }
+
+        void visitWhile(const WhileExprAST &e) {
+            out << 'w';
+            visit(e.getEnd());
+            visit(e.getBody());
+        }
+
+        void visitVar(const VarExprAST &e) {
+            out << 'V' << e.getVarNames().size() << ';';
+            for (const auto &namedVar: e.getVarNames()) {
+                writeName(namedVar.first);
+                if (namedVar.second) {
+                    out << '=';
+                    visit(*namedVar.second);
+                } else {
+                    out << '-';
+                }
+            }
+            visit(e.getBody());
+        }
+    };
+
+    /// CalleeCollector - ExprAST::collectCallees().
+    struct CalleeCollector: ExprVisitor<CalleeCollector> {
+        std::set<std::string> &callees;
+
+        explicit CalleeCollector(std::set<std::string> &callees): callees(callees) {}
+
+        void visitNumber(const NumberExprAST &) {}
+
+        void visitVariable(const VariableExprAST &) {}
+
+        void visitUnary(const UnaryExprAST &e) {
+            callees.insert(std::string("unary") + e.getOp());
+            visit(e.getOperand());
+        }
+
+        void visitBinary(const BinaryExprAST &e) {
+            // the builtin operators are emitted inline; anything else is a call.
+            if (!llvm::StringRef("=<+-*").contains(e.getOp())) {
+                callees.insert(std::string("binary") + e.getOp());
+            }
+            visit(e.getLHS());
+            visit(e.getRHS());
+        }
+
+        void visitCall(const CallexprAST &e) {
+            callees.insert(e.getCallee());
+            for (const auto &arg: e.getArgs()) {
+                visit(*arg);
+            }
+        }
+
+        void visitIf(const IfExprAST &e) {
+            visit(e.getCond());
+            visit(e.getThen());
+            visit(e.getElse());
+        }
+
+        void visitFor(const ForExprAST &e) {
+            visit(e.getStart());
+            visit(e.getEnd());
+            if (e.getStep()) {
+                visit(*e.getStep());
+            }
+            visit(e.getBody());
+        }
+
+        void visitWhile(const WhileExprAST &e) {
+            visit(e.getEnd());
+            visit(e.getBody());
+        }
+
+        void visitVar(const VarExprAST &e) {
+            for (const auto &namedVar: e.getVarNames()) {
+                if (namedVar.second) {
+                    visit(*namedVar.second);
+                }
+            }
+            visit(e.getBody());
+        }
+    };
+
+    /// Dumper - ExprAST::dump(): a node and its location on a line, then its
+    /// children one level deeper.
+    struct Dumper: ExprVisitor<Dumper> {
+        llvm::raw_ostream &out;
+        int ind;
+
+        Dumper(llvm::raw_ostream &out, int ind): out(out), ind(ind) {}
+
+        void location(const ExprAST &e) {
+            out << ':' << e.getLine() << ':' << e.getCol() << '\n';
+        }
+
+        void child(const char *label, const ExprAST &e) {
+            out.indent(ind) << label;
+            ++ind;
+            visit(e);
+            --ind;
+        }
+
+        void visitNumber(const NumberExprAST &e) {
+            out << e.getValue();
+            location(e);
+        }
+
+        void visitVariable(const VariableExprAST &e) {
+            out << e.getName();
+            location(e);
+        }
+
+        void visitUnary(const UnaryExprAST &e) {
+            out << "unary" << e.getOp();
+            location(e);
+            ++ind;
+            visit(e.getOperand());
+            --ind;
+        }
 
-        llvm::raw_ostream &dump(llvm::raw_ostream &out, int ind) override {
-            ast::ExprAST::dump(out << "var", ind);
-            for (const auto &namedVar: varNames) {
-                namedVar.second->dump(llvmContext->indent(out, ind) << namedVar.first << ':', ind + 1);
+        void visitBinary(const BinaryExprAST &e) {
+            out << "binary" << e.getOp();
+            location(e);
+            child("LHS:", e.getLHS());
+            child("RHS:", e.getRHS());
+        }
+
+        void visitCall(const CallexprAST &e) {
+            out << "call" << e.getCallee();
+            location(e);
+            ++ind;
+            for (const auto &arg: e.getArgs()) {
+                out.indent(ind);
+                visit(*arg);
             }
-            body->dump(llvmContext->indent(out, ind) << "Body:", ind + 1);
-            return out;
+            --ind;
+        }
+
+        void visitIf(const IfExprAST &e) {
+            out << "if";
+            location(e);
+            child("Cond:", e.getCond());
+            child("Then:", e.getThen());
+            child("Else:", e.getElse());
+        }
+
+        void visitFor(const ForExprAST &e) {
+            out << "for";
+            location(e);
+            child("Cond:", e.getStart());
+            child("End:", e.getEnd());
+            if (e.getStep()) {
+                child("Step:", *e.getStep());
+            }
+            child("Body:", e.getBody());
+        }
+
+        void visitWhile(const WhileExprAST &e) {
+            out << "while";
+            location(e);
+            child("End:", e.getEnd());
+            child("Body:", e.getBody());
+        }
+
+        void visitVar(const VarExprAST &e) {
+            out << "var";
+            location(e);
+            for (const auto &namedVar: e.getVarNames()) {
+                if (namedVar.second) {
+                    child((namedVar.first + ':').c_str(), *namedVar.second);
+                } else {
+                    out.indent(ind) << namedVar.first << ":\n";
+                }
+            }
+            child("Body:", e.getBody());
         }
     };
+
+    inline llvm::raw_ostream& ExprAST::dump(llvm::raw_ostream &out, int ind) const {
+        Dumper{out, ind}.visit(*this);
+        return out;
+    }
+
+    inline llvm::hash_code ExprAST::hash() const {
+        return StructuralHash{}.visit(*this);
+    }
+
+    inline void ExprAST::writeCanonical(llvm::raw_ostream &out) const {
+        CanonicalWriter{out}.visit(*this);
+    }
+
+    inline void ExprAST::collectCallees(std::set<std::string> &callees) const {
+        CalleeCollector{callees}.visit(*this);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,609 @@
+#ifndef KALEIDOSCOPE_ASTCACHE_H
+#define KALEIDOSCOPE_ASTCACHE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "Parser.h"
+
+/// AstCache - the parsed AST of a source file, written beside it (foo.ks ->
+/// foo.kast) by --ast-cache and keyed on a hash of the file's contents.
+///
+/// Loading an unchanged file from its cache skips lexing and parsing: the
+/// cache is mapped, its checksum verified and its records checked in one
+/// pass, and the AST of every top-level item is then built straight from
+/// the mapped records. Nothing is decoded up front, the records can also be
+/// walked in place.
+///
+/// The file is little endian: a header (magic, version, a checksum of the
+/// rest of the file, counts, the hash and size of the source), then four
+/// arrays of fixed size records and the string data, 8 byte aligned:
+///  - strings: offset and size of every distinct name in the string data;
+///    nodes, items and arguments refer to names by index.
+///  - arguments: the names of the prototypes' arguments.
+///  - nodes: the expression trees in pre-order. A node has a kind, an
+///    operator, flags, its source location, the size of its subtree in nodes
+///    and a payload (a number's bits or a name); its children follow it, and
+///    the next sibling of a node comes right after its subtree.
+///  - items: the definitions, externs and top-level expressions in source
+///    order, with their prototype (name, arguments, whether it is an
+///    operator and its precedence, line) and the root node of their body.
+class AstCache {
+public:
+    enum NodeKind : uint8_t {
+        Number,
+        Variable,
+        Unary,
+        Binary,
+        Call,
+        If,
+        For,
+        Var,
+        // a name bound by a var expression, with its initializer if any.
+        VarBinding,
+        NumNodeKinds
+    };
+
+    enum ItemKind : uint8_t {
+        Definition,
+        Extern,
+        TopLevelExpression,
+        NumItemKinds
+    };
+
+    /// flags of a For node.
+    enum NodeFlags : uint8_t {
+        HasStep = 1
+    };
+
+    struct Header {
+        char magic[8];
+        llvm::support::ulittle32_t version;
+        // xxHash64 of everything after it, so a damaged file is parsed again.
+        llvm::support::ulittle64_t checksum;
+        llvm::support::ulittle32_t numStrings;
+        llvm::support::ulittle32_t numArgs;
+        llvm::support::ulittle32_t numNodes;
+        llvm::support::ulittle32_t numItems;
+        llvm::support::ulittle32_t stringDataSize;
+        llvm::support::ulittle64_t sourceHash;
+        llvm::support::ulittle64_t sourceSize;
+    };
+
+    struct String {
+        llvm::support::ulittle32_t offset;
+        llvm::support::ulittle32_t size;
+    };
+
+    struct Node {
+        uint8_t kind;
+        uint8_t op;
+        uint8_t flags;
+        uint8_t reserved;
+        llvm::support::ulittle32_t size;
+        llvm::support::little32_t line;
+        llvm::support::little32_t col;
+        llvm::support::ulittle64_t payload;
+    };
+
+    struct Item {
+        uint8_t kind;
+        uint8_t isOperator;
+        uint8_t reserved[2];
+        llvm::support::ulittle32_t precedence;
+        llvm::support::ulittle32_t name;
+        llvm::support::ulittle32_t firstArg;
+        llvm::support::ulittle32_t numArgs;
+        llvm::support::little32_t line;
+        llvm::support::ulittle32_t body;
+        llvm::support::ulittle32_t reserved2;
+    };
+
+    static_assert(sizeof(Header) == 56 && sizeof(String) == 8 && sizeof(Node) == 24 && sizeof(Item) == 32,
+                  "the records are the file format");
+
+    static constexpr llvm::StringLiteral magic{"KALASTC\x01"};
+    static constexpr uint32_t version = 3;
+    static constexpr uint32_t noBody = ~0u;
+
+    /// pathFor - where the cache of the source file `path` lives.
+    static std::string pathFor(llvm::StringRef path) {
+        llvm::SmallString<128> cachePath{path};
+        llvm::sys::path::replace_extension(cachePath, "kast");
+        return cachePath.str().str();
+    }
+
+    static uint64_t hashSource(llvm::StringRef contents) {
+        return llvm::xxHash64(contents);
+    }
+
+    /// load - map the cache at `path` if it holds the AST of a source with
+    /// `sourceHash` and `sourceSize`; an error if it is missing, stale or
+    /// damaged.
+    static llvm::Expected<std::unique_ptr<AstCache>> load(const std::string &path, uint64_t sourceHash,
+                                                          uint64_t sourceSize) {
+        auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+        if (!buffer) {
+            return llvm::createStringError(buffer.getError(), "could not read %s: %s", path.c_str(),
+                                           buffer.getError().message().c_str());
+        }
+        std::unique_ptr<AstCache> cache{new AstCache{std::move(*buffer)}};
+        if (auto err = cache->map()) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: %s", path.c_str(),
+                                           llvm::toString(std::move(err)).c_str());
+        }
+        if (cache->header->sourceHash != sourceHash || cache->header->sourceSize != sourceSize) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: source changed", path.c_str());
+        }
+        return std::move(cache);
+    }
+
+    size_t getNumItems() const {
+        return header->numItems;
+    }
+
+    size_t getNumNodes() const {
+        return header->numNodes;
+    }
+
+    const Item& getItem(size_t index) const {
+        return items[index];
+    }
+
+    const Node& getNode(uint32_t index) const {
+        return nodes[index];
+    }
+
+    llvm::StringRef getString(uint32_t index) const {
+        return {stringData + strings[index].offset, strings[index].size};
+    }
+
+    /// forEachChild - call `f` with the index of every child of a node.
+    template <typename F>
+    void forEachChild(uint32_t index, F f) const {
+        auto end = index + nodes[index].size;
+        for (auto child = index + 1; child < end; child += nodes[child].size) {
+            f(child);
+        }
+    }
+
+    /// buildPrototype - the prototype of an item. Like parseDefinition() and
+    /// parseExtern(), registers the precedence of a binary operator.
+    std::unique_ptr<ast::PrototypeAST> buildPrototype(size_t index, const std::shared_ptr<LLVMContext> &llvmContext) const {
+        const auto &item = items[index];
+        std::vector<std::string> argNames{};
+        argNames.reserve(item.numArgs);
+        for (uint32_t a = item.firstArg; a < item.firstArg + item.numArgs; ++a) {
+            argNames.push_back(getString(args[a]).str());
+        }
+        auto proto = ast::makeNode<ast::PrototypeAST>(SourceLocation{item.line, 0}, getString(item.name).str(),
+                                                      std::move(argNames), llvmContext, item.isOperator != 0,
+                                                      unsigned(item.precedence));
+        if (proto->isBinaryOp()) {
+            llvmContext->addToBinOpPrecedence(std::make_pair(proto->getOperatorName(), proto->getBinaryPrecedence()));
+        }
+        return proto;
+    }
+
+    /// buildDefinition - the AST of a Definition or TopLevelExpression item.
+    std::unique_ptr<ast::FunctionAST> buildDefinition(size_t index, const std::shared_ptr<LLVMContext> &llvmContext,
+                                                      const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) const {
+        auto proto = buildPrototype(index, llvmContext);
+        auto body = buildExpr(items[index].body, llvmContext, ksDebugInfo);
+        return ast::makeNode<ast::FunctionAST>(std::move(proto), std::move(body), llvmContext, ksDebugInfo);
+    }
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> file;
+    const Header *header = nullptr;
+    const String *strings = nullptr;
+    const llvm::support::ulittle32_t *args = nullptr;
+    const Node *nodes = nullptr;
+    const Item *items = nullptr;
+    const char *stringData = nullptr;
+
+    explicit AstCache(std::unique_ptr<llvm::MemoryBuffer> file): file(std::move(file)) {}
+
+    friend class AstCacheWriter;
+
+    /// layout - offsets of the arrays and the string data, and the size of
+    /// the file, for the counts in `header`.
+    struct Layout {
+        uint64_t strings, args, nodes, items, stringData, size;
+
+        explicit Layout(const Header &header) {
+            strings = sizeof(Header);
+            args = strings + uint64_t(header.numStrings) * sizeof(String);
+            nodes = llvm::alignTo(args + uint64_t(header.numArgs) * sizeof(uint32_t), 8);
+            items = nodes + uint64_t(header.numNodes) * sizeof(Node);
+            stringData = items + uint64_t(header.numItems) * sizeof(Item);
+            size = stringData + header.stringDataSize;
+        }
+    };
+
+    /// checksummed - the bytes of a cache file its checksum covers.
+    static llvm::StringRef checksummed(llvm::StringRef contents) {
+        return contents.drop_front(offsetof(Header, checksum) + sizeof(Header::checksum));
+    }
+
+    static llvm::Error damaged(const char *what) {
+        return llvm::createStringError(llvm::inconvertibleErrorCode(), "damaged AST cache: %s", what);
+    }
+
+    bool isExpr(uint32_t index) const {
+        return nodes[index].kind != VarBinding;
+    }
+
+    /// map - point the arrays into the file and check every record, so that
+    /// walking and building never read out of bounds.
+    llvm::Error map() {
+        auto contents = file->getBuffer();
+        if (contents.size() < sizeof(Header) || !contents.startswith(magic)) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "not an AST cache");
+        }
+        header = reinterpret_cast<const Header*>(contents.data());
+        if (header->version != version) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "AST cache version %u, expected %u",
+                                           uint32_t(header->version), version);
+        }
+        if (header->checksum != llvm::xxHash64(checksummed(contents))) {
+            return damaged("checksum mismatch");
+        }
+        Layout layout{*header};
+        if (layout.size != contents.size()) {
+            return damaged("wrong size");
+        }
+        strings = reinterpret_cast<const String*>(contents.data() + layout.strings);
+        args = reinterpret_cast<const llvm::support::ulittle32_t*>(contents.data() + layout.args);
+        nodes = reinterpret_cast<const Node*>(contents.data() + layout.nodes);
+        items = reinterpret_cast<const Item*>(contents.data() + layout.items);
+        stringData = contents.data() + layout.stringData;
+
+        uint32_t numStrings = header->numStrings;
+        for (uint32_t s = 0; s < numStrings; ++s) {
+            if (uint64_t(strings[s].offset) + strings[s].size > header->stringDataSize) {
+                return damaged("string out of bounds");
+            }
+        }
+        for (uint32_t a = 0; a < header->numArgs; ++a) {
+            if (args[a] >= numStrings) {
+                return damaged("argument name out of bounds");
+            }
+        }
+        // children come after their parent, so checking from the last node
+        // to the first only ever walks children that were checked already.
+        for (auto index = uint32_t(header->numNodes); index-- > 0;) {
+            if (auto err = checkNode(index)) {
+                return err;
+            }
+        }
+        for (uint32_t i = 0; i < header->numItems; ++i) {
+            const auto &item = items[i];
+            if (item.kind >= NumItemKinds || item.name >= numStrings ||
+                uint64_t(item.firstArg) + item.numArgs > header->numArgs) {
+                return damaged("bad item");
+            }
+            if (item.isOperator && (item.numArgs < 1 || item.numArgs > 2 || getString(item.name).empty())) {
+                return damaged("bad operator");
+            }
+            auto hasBody = item.kind != Extern;
+            if (hasBody != (item.body != noBody) || (hasBody && (item.body >= header->numNodes || !isExpr(item.body)))) {
+                return damaged("bad item body");
+            }
+        }
+        return llvm::Error::success();
+    }
+
+    llvm::Error checkNode(uint32_t index) const {
+        const auto &node = nodes[index];
+        if (node.kind >= NumNodeKinds || node.size < 1 || uint64_t(index) + node.size > header->numNodes) {
+            return damaged("bad node");
+        }
+        llvm::SmallVector<uint32_t, 4> children{};
+        auto end = index + node.size;
+        auto child = index + 1;
+        for (; child < end; child += nodes[child].size) {
+            children.push_back(child);
+        }
+        if (child != end) {
+            return damaged("children do not match the subtree size");
+        }
+
+        auto count = children.size();
+        auto exprs = size_t(std::count_if(children.begin(), children.end(), [this](uint32_t c) { return isExpr(c); }));
+        bool ok;
+        switch (NodeKind(node.kind)) {
+            case Number:
+                ok = count == 0;
+                break;
+            case Variable:
+            case Call:
+                ok = node.payload < header->numStrings && (node.kind == Call || count == 0) && exprs == count;
+                break;
+            case Unary:
+                ok = count == 1 && exprs == 1;
+                break;
+            case Binary:
+                ok = count == 2 && exprs == 2;
+                break;
+            case If:
+                ok = count == 3 && exprs == 3;
+                break;
+            case For:
+                ok = node.payload < header->numStrings && count == ((node.flags & HasStep) ? 4 : 3) && exprs == count;
+                break;
+            case Var:
+                // bindings, then the body.
+                ok = count >= 2 && exprs == 1 && isExpr(children.back());
+                break;
+            case VarBinding:
+                ok = node.payload < header->numStrings && count <= 1 && exprs == count;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+        return ok ? llvm::Error::success() : damaged("bad children");
+    }
+
+    std::unique_ptr<ast::ExprAST> buildExpr(uint32_t index, const std::shared_ptr<LLVMContext> &llvmContext,
+                                            const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) const {
+        const auto &node = nodes[index];
+        SourceLocation loc{node.line, node.col};
+        llvm::SmallVector<std::unique_ptr<ast::ExprAST>, 4> children{};
+        std::vector<std::pair<std::string, std::unique_ptr<ast::ExprAST>>> varNames{};
+        forEachChild(index, [&](uint32_t child) {
+            if (nodes[child].kind == VarBinding) {
+                auto init = nodes[child].size > 1 ? buildExpr(child + 1, llvmContext, ksDebugInfo) : nullptr;
+                varNames.emplace_back(getString(nodes[child].payload).str(), std::move(init));
+            } else {
+                children.push_back(buildExpr(child, llvmContext, ksDebugInfo));
+            }
+        });
+
+        // the nodes the parser gives no location take the lexer's.
+        curLoc = loc;
+        switch (NodeKind(node.kind)) {
+            case Number:
+                return ast::makeNode<ast::NumberExprAST>(llvm::BitsToDouble(node.payload));
+            case Variable:
+                return ast::makeNode<ast::VariableExprAST>(loc, getString(node.payload).str());
+            case Unary:
+                return ast::makeNode<ast::UnaryExprAST>(char(node.op), std::move(children[0]));
+            case Binary:
+                return ast::makeNode<ast::BinaryExprAST>(loc, char(node.op), std::move(children[0]), std::move(children[1]));
+            case Call: {
+                std::vector<std::unique_ptr<ast::ExprAST>> callArgs{std::make_move_iterator(children.begin()),
+                                                                    std::make_move_iterator(children.end())};
+                return ast::makeNode<ast::CallexprAST>(loc, getString(node.payload).str(), std::move(callArgs));
+            }
+            case If:
+                return ast::makeNode<ast::IfExprAST>(loc, std::move(children[0]), std::move(children[1]),
+                                                     std::move(children[2]));
+            case For: {
+                auto hasStep = (node.flags & HasStep) != 0;
+                return ast::makeNode<ast::ForExprAST>(getString(node.payload).str(), std::move(children[0]),
+                                                      std::move(children[1]), hasStep ? std::move(children[2]) : nullptr,
+                                                      std::move(children.back()));
+            }
+            case Var:
+                return ast::makeNode<ast::VarExprAST>(std::move(varNames), std::move(children[0]));
+            default:
+                llvm_unreachable("map() checked the node kinds");
+        }
+    }
+};
+
+/// AstCacheWriter - collects the top-level items of a file as they are
+/// parsed and writes them as an AstCache.
+class AstCacheWriter: public ast::ExprVisitor<AstCacheWriter> {
+    std::vector<AstCache::String> strings{};
+    std::string stringData{};
+    llvm::StringMap<uint32_t> stringIndex{};
+    std::vector<llvm::support::ulittle32_t> args{};
+    std::vector<AstCache::Node> nodes{};
+    std::vector<AstCache::Item> items{};
+
+    void addItem(AstCache::ItemKind kind, const ast::PrototypeAST &proto, uint32_t body) {
+        AstCache::Item item{};
+        item.kind = kind;
+        item.isOperator = proto.isUnaryOp() || proto.isBinaryOp();
+        item.precedence = proto.getBinaryPrecedence();
+        item.name = intern(proto.getName());
+        item.firstArg = args.size();
+        item.numArgs = proto.getNumArgs();
+        item.line = proto.getLine();
+        item.body = body;
+        for (const auto &arg: proto.getArgs()) {
+            args.emplace_back(intern(arg));
+        }
+        items.push_back(item);
+    }
+
+    template <typename T>
+    static void writeArray(llvm::raw_ostream &out, const std::vector<T> &array) {
+        out.write(reinterpret_cast<const char*>(array.data()), array.size() * sizeof(T));
+    }
+public:
+    /// intern - the index of `s` in the string table.
+    uint32_t intern(llvm::StringRef s) {
+        auto inserted = stringIndex.try_emplace(s, strings.size());
+        if (inserted.second) {
+            AstCache::String entry{};
+            entry.offset = stringData.size();
+            entry.size = s.size();
+            strings.push_back(entry);
+            stringData += s;
+        }
+        return inserted.first->second;
+    }
+
+    /// beginNode - start the subtree of `expr`; its children are visited
+    /// next, then endNode() closes it.
+    size_t beginNode(AstCache::NodeKind kind, const ast::ExprAST &expr, uint8_t op = 0, uint64_t payload = 0,
+                     uint8_t flags = 0) {
+        AstCache::Node node{};
+        node.kind = kind;
+        node.op = op;
+        node.flags = flags;
+        node.line = expr.getLine();
+        node.col = expr.getCol();
+        node.payload = payload;
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+
+    void endNode(size_t index) {
+        nodes[index].size = nodes.size() - index;
+    }
+
+    void visitNumber(const ast::NumberExprAST &e) {
+        endNode(beginNode(AstCache::Number, e, 0, llvm::DoubleToBits(e.getValue())));
+    }
+
+    void visitVariable(const ast::VariableExprAST &e) {
+        endNode(beginNode(AstCache::Variable, e, 0, intern(e.getName())));
+    }
+
+    void visitUnary(const ast::UnaryExprAST &e) {
+        auto node = beginNode(AstCache::Unary, e, e.getOp());
+        visit(e.getOperand());
+        endNode(node);
+    }
+
+    void visitBinary(const ast::BinaryExprAST &e) {
+        auto node = beginNode(AstCache::Binary, e, e.getOp());
+        visit(e.getLHS());
+        visit(e.getRHS());
+        endNode(node);
+    }
+
+    void visitCall(const ast::CallexprAST &e) {
+        auto node = beginNode(AstCache::Call, e, 0, intern(e.getCallee()));
+        for (const auto &arg: e.getArgs()) {
+            visit(*arg);
+        }
+        endNode(node);
+    }
+
+    void visitIf(const ast::IfExprAST &e) {
+        auto node = beginNode(AstCache::If, e);
+        visit(e.getCond());
+        visit(e.getThen());
+        visit(e.getElse());
+        endNode(node);
+    }
+
+    void visitFor(const ast::ForExprAST &e) {
+        auto node = beginNode(AstCache::For, e, 0, intern(e.getVarName()), e.getStep() ? AstCache::HasStep : 0);
+        visit(e.getStart());
+        visit(e.getEnd());
+        if (e.getStep()) {
+            visit(*e.getStep());
+        }
+        visit(e.getBody());
+        endNode(node);
+    }
+
+    void visitWhile(const ast::WhileExprAST &) {
+        // the parser does not produce while loops, so the format has no node
+        // for them.
+        llvm_unreachable("while loops are not cached");
+    }
+
+    void visitVar(const ast::VarExprAST &e) {
+        auto node = beginNode(AstCache::Var, e);
+        for (const auto &namedVar: e.getVarNames()) {
+            auto binding = beginNode(AstCache::VarBinding, e, 0, intern(namedVar.first));
+            if (namedVar.second) {
+                visit(*namedVar.second);
+            }
+            endNode(binding);
+        }
+        visit(e.getBody());
+        endNode(node);
+    }
+
+    void addDefinition(const ast::FunctionAST &fnAst) {
+        addItem(AstCache::Definition, fnAst.getProto(), nodes.size());
+        visit(fnAst.getBody());
+    }
+
+    void addExtern(const ast::PrototypeAST &proto) {
+        addItem(AstCache::Extern, proto, AstCache::noBody);
+    }
+
+    void addTopLevelExpression(const ast::FunctionAST &fnAst) {
+        addItem(AstCache::TopLevelExpression, fnAst.getProto(), nodes.size());
+        visit(fnAst.getBody());
+    }
+
+    /// write - write the cache to `path`, through a temporary file so that
+    /// a concurrent load never sees half of it.
+    llvm::Error write(const std::string &path, uint64_t sourceHash, uint64_t sourceSize) const {
+        AstCache::Header header{};
+        std::copy(AstCache::magic.begin(), AstCache::magic.end(), header.magic);
+        header.version = AstCache::version;
+        header.numStrings = strings.size();
+        header.numArgs = args.size();
+        header.numNodes = nodes.size();
+        header.numItems = items.size();
+        header.stringDataSize = stringData.size();
+        header.sourceHash = sourceHash;
+        header.sourceSize = sourceSize;
+        AstCache::Layout layout{header};
+
+        std::string contents{};
+        {
+            llvm::raw_string_ostream out{contents};
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            writeArray(out, strings);
+            writeArray(out, args);
+            out.write_zeros(layout.nodes - out.tell());
+            writeArray(out, nodes);
+            writeArray(out, items);
+            out << stringData;
+        }
+        header.checksum = llvm::xxHash64(AstCache::checksummed(contents));
+        std::copy_n(reinterpret_cast<const char*>(&header), sizeof(header), contents.begin());
+
+        int fd;
+        llvm::SmallString<128> tempPath{};
+        if (auto ec = llvm::sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tempPath)) {
+            return llvm::createStringError(ec, "could not write %s: %s", path.c_str(), ec.message().c_str());
+        }
+        {
+            llvm::raw_fd_ostream out{fd, true};
+            out << contents;
+            out.close();
+            if (out.has_error()) {
+                auto ec = out.error();
+                out.clear_error();
+                llvm::sys::fs::remove(tempPath);
+                return llvm::createStringError(ec, "could not write %s: %s", path.c_str(), ec.message().c_str());
+            }
+        }
+        if (auto ec = llvm::sys::fs::rename(tempPath, path)) {
+            llvm::sys::fs::remove(tempPath);
+            return llvm::createStringError(ec, "could not write %s: %s", path.c_str(), ec.message().c_str());
+        }
+        return llvm::Error::success();
+    }
+};
+
+#endif // KALEIDOSCOPE_ASTCACHE_H
@@ -0,0 +1,31 @@
+#ifndef KALEIDOSCOPE_BUILTINS_H
+#define KALEIDOSCOPE_BUILTINS_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+/// putchard - putchar that takes a double and returns 0.
+extern "C" DLLEXPORT double putchard(double X);
+
+/// printd - print a double and a newline, returns 0.
+extern "C" DLLEXPORT double printd(double X);
+
+/// runtimeBuiltins - the functions of the runtime Kaleidoscope programs can
+/// call, by name. The JIT defines them up front instead of searching the
+/// process for them.
+inline const std::vector<std::pair<std::string, void*>>& runtimeBuiltins() {
+    static const std::vector<std::pair<std::string, void*>> builtins{
+        {"putchard", reinterpret_cast<void*>(&putchard)},
+        {"printd", reinterpret_cast<void*>(&printd)},
+    };
+    return builtins;
+}
+
+#endif // KALEIDOSCOPE_BUILTINS_H
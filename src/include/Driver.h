@@ -0,0 +1,360 @@
+#ifndef KALEIDOSCOPE_DRIVER_H
+#define KALEIDOSCOPE_DRIVER_H
+
+#include <fstream>
+#include <sstream>
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "AstCache.h"
+#include "Parser.h"
+#include "Remarks.h"
+#include "Snapshot.h"
+
+/// DriverOptions - how compileFiles() turns its inputs into objects.
+struct DriverOptions {
+    /// single linked object; empty writes one object per input.
+    std::string output;
+    unsigned jobs = 0;
+    /// optimize the linked program as a whole; requires an output.
+    bool lto = false;
+    /// functions that stay external after LTO, everything else is internal.
+    std::set<std::string> exports;
+    ast::DebugLevel debugLevel = ast::DebugLevel::Full;
+    /// counts of an --instrument run to optimize for, if any.
+    std::shared_ptr<const ProfileData> profile;
+    /// where the optimization remarks of every context go, if anywhere.
+    std::shared_ptr<RemarkCollector> remarks;
+    /// write the output as a PreludeSnapshot instead of a plain object.
+    bool snapshot = false;
+    /// target triple to compile for, the default triple if empty.
+    std::string triple;
+    /// load the AST of unchanged inputs from their AstCache instead of
+    /// parsing them, and write the cache of the others.
+    bool astCache = false;
+};
+
+/// SourceUnit - one input file on its way through compileFiles(). Every
+/// unit has its own context and module, so units never share LLVM state;
+/// prototypes are shared through the registry all their contexts point at.
+struct SourceUnit {
+    std::string path;
+    std::shared_ptr<LLVMContext> llvmContext;
+    std::shared_ptr<ast::DebugInfo> ksDebugInfo;
+    std::vector<std::unique_ptr<ast::FunctionAST>> definitions;
+    std::ostringstream diagnostics;
+    llvm::SmallVector<char, 0> bitcode;
+    bool ok = true;
+
+    SourceUnit(std::string path, const std::shared_ptr<SymbolRegistry> &symbols):
+        path(std::move(path)), llvmContext(std::make_shared<LLVMContext>(symbols)),
+        ksDebugInfo(std::make_shared<ast::DebugInfo>(llvmContext)) {}
+};
+
+/// loadCachedUnit - what parseUnit() does, from the AstCache at `cachePath`.
+/// False if there is no cache for the file as it is now.
+static bool loadCachedUnit(SourceUnit &unit, SymbolRegistry &symbols, const std::string &cachePath,
+                           uint64_t sourceHash, uint64_t sourceSize) {
+    PhaseTimer timer{TimeReport::Parse};
+    auto cache = AstCache::load(cachePath, sourceHash, sourceSize);
+    if (!cache) {
+        llvm::consumeError(cache.takeError());
+        return false;
+    }
+    for (size_t i = 0; i < (*cache)->getNumItems(); ++i) {
+        switch ((*cache)->getItem(i).kind) {
+            case AstCache::Definition: {
+                auto fnAst = (*cache)->buildDefinition(i, unit.llvmContext, unit.ksDebugInfo);
+                symbols.exchange(fnAst->getName(), std::make_shared<ast::PrototypeAST>(fnAst->getProto()));
+                unit.definitions.push_back(std::move(fnAst));
+                break;
+            }
+            case AstCache::Extern: {
+                auto protoAst = (*cache)->buildPrototype(i, unit.llvmContext);
+                auto name = protoAst->getName();
+                symbols.exchange(name, std::move(protoAst));
+                break;
+            }
+            default:
+                unit.diagnostics << "Warning: top-level expression ignored when compiling files\n";
+                break;
+        }
+    }
+    return true;
+}
+
+/// parseUnit - first phase: parse the whole file and publish its prototypes,
+/// so that the second phase can codegen calls into any other file. Operator
+/// precedence is still per file; a file using a binary operator must define
+/// it or declare it with extern (with its precedence) before the use. With
+/// --ast-cache, an unchanged file is loaded from its cache, and a file that
+/// parses cleanly gets one.
+static void parseUnit(SourceUnit &unit, SymbolRegistry &symbols, const DriverOptions &options) {
+    std::ifstream in{unit.path};
+    if (!in) {
+        unit.diagnostics << "Error: could not open file\n";
+        unit.ok = false;
+        return;
+    }
+
+    llvm::SmallString<128> directory{unit.path};
+    llvm::sys::fs::make_absolute(directory);
+    llvm::sys::path::remove_filename(directory);
+    unit.ksDebugInfo->initializeCompileUnit(llvm::sys::path::filename(unit.path), directory, options.debugLevel);
+
+    std::string cachePath{};
+    uint64_t sourceHash = 0, sourceSize = 0;
+    std::unique_ptr<AstCacheWriter> cacheWriter{};
+    if (options.astCache) {
+        if (auto source = llvm::MemoryBuffer::getFile(unit.path, false, false)) {
+            cachePath = AstCache::pathFor(unit.path);
+            sourceHash = AstCache::hashSource((*source)->getBuffer());
+            sourceSize = (*source)->getBufferSize();
+            if (loadCachedUnit(unit, symbols, cachePath, sourceHash, sourceSize)) {
+                return;
+            }
+            cacheWriter = std::make_unique<AstCacheWriter>();
+        }
+    }
+
+    errorStream = &unit.diagnostics;
+    resetLexer(&in);
+    getNextToken();
+
+    while (curTok != tokEof) {
+        switch (curTok) {
+            case ';':
+                getNextToken();
+                break;
+            case tokDef:
+                if (auto fnAst = parseDefinition(unit.llvmContext, unit.ksDebugInfo)) {
+                    if (cacheWriter) {
+                        cacheWriter->addDefinition(*fnAst);
+                    }
+                    symbols.exchange(fnAst->getName(), std::make_shared<ast::PrototypeAST>(fnAst->getProto()));
+                    unit.definitions.push_back(std::move(fnAst));
+                } else {
+                    unit.ok = false;
+                    getNextToken();
+                }
+                break;
+            case tokExtern:
+                if (auto protoAst = parseExtern(unit.llvmContext, unit.ksDebugInfo)) {
+                    if (cacheWriter) {
+                        cacheWriter->addExtern(*protoAst);
+                    }
+                    auto name = protoAst->getName();
+                    symbols.exchange(name, std::move(protoAst));
+                } else {
+                    unit.ok = false;
+                    getNextToken();
+                }
+                break;
+            default:
+                if (auto fnAst = parseTopLevelExpr(unit.llvmContext, unit.ksDebugInfo)) {
+                    if (cacheWriter) {
+                        cacheWriter->addTopLevelExpression(*fnAst);
+                    }
+                    unit.diagnostics << "Warning: top-level expression ignored when compiling files\n";
+                } else {
+                    unit.ok = false;
+                    getNextToken();
+                }
+                break;
+        }
+    }
+    resetLexer(nullptr);
+    errorStream = nullptr;
+
+    // a file with errors is parsed again, so that they are reported again.
+    if (cacheWriter && unit.ok) {
+        if (auto err = cacheWriter->write(cachePath, sourceHash, sourceSize)) {
+            unit.diagnostics << "Warning: " << llvm::toString(std::move(err)) << "\n";
+        }
+    }
+}
+
+/// codegenUnit - second phase: codegen every definition of the file into its
+/// module. With an objectFile the module is compiled right away, otherwise
+/// it is kept as bitcode for linkUnits(). For LTO the module gets the
+/// pre-link optimizations first and its bitcode is also written next to the
+/// source (foo.ks -> foo.bc).
+static void codegenUnit(SourceUnit &unit, const std::string &objectFile, const DriverOptions &options) {
+    errorStream = &unit.diagnostics;
+    for (auto &fnAst: unit.definitions) {
+        if (!fnAst->codegen()) {
+            unit.ok = false;
+        }
+    }
+    unit.definitions.clear();
+    errorStream = nullptr;
+
+    auto &module = *unit.llvmContext->getModule();
+    unit.llvmContext->getDBuilder()->finalize();
+    module.setModuleIdentifier(unit.path);
+    {
+        PhaseTimer timer{TimeReport::Verify};
+        // through the unit's diagnostics, so units on other threads do not
+        // interleave with it.
+        std::string problems{};
+        llvm::raw_string_ostream out{problems};
+        if (llvm::verifyModule(module, &out)) {
+            unit.diagnostics << "Error: invalid module\n" << out.str();
+            unit.ok = false;
+        }
+    }
+    if (!unit.ok) {
+        return;
+    }
+
+    if (!objectFile.empty()) {
+        unit.ok = LLVMContext::emitObjectFile(module, objectFile, options.triple);
+        return;
+    }
+
+    if (options.lto) {
+        auto tm = LLVMContext::createTargetMachine(options.triple);
+        if (!tm) {
+            unit.ok = false;
+            return;
+        }
+        LLVMContext::optimizeModule(module, *tm, true);
+    }
+    llvm::raw_svector_ostream out{unit.bitcode};
+    llvm::WriteBitcodeToFile(module, out);
+
+    if (options.lto) {
+        llvm::SmallString<128> path{unit.path};
+        llvm::sys::path::replace_extension(path, "bc");
+        std::error_code ec;
+        llvm::raw_fd_ostream file{path, ec, llvm::sys::fs::OF_None};
+        if (ec) {
+            unit.diagnostics << "Error: could not write " << path.str().str() << ": " << ec.message() << "\n";
+            unit.ok = false;
+            return;
+        }
+        file.write(unit.bitcode.data(), unit.bitcode.size());
+    }
+}
+
+static size_t countDefinitions(const llvm::Module &module) {
+    return std::count_if(module.begin(), module.end(), [](const llvm::Function &f) { return !f.isDeclaration(); });
+}
+
+/// optimizeProgram - the LTO step: every function that is not exported
+/// becomes internal, so the whole-program pipeline may inline it into its
+/// callers across files and global DCE can drop it once it is unused.
+static bool optimizeProgram(llvm::Module &program, const DriverOptions &options) {
+    auto tm = LLVMContext::createTargetMachine(options.triple);
+    if (!tm) {
+        return false;
+    }
+
+    auto before = countDefinitions(program);
+    llvm::internalizeModule(program, [&options](const llvm::GlobalValue &gv) {
+        return options.exports.count(gv.getName().str()) != 0;
+    });
+    LLVMContext::optimizeModule(program, *tm, false);
+
+    llvm::outs() << "LTO: kept " << countDefinitions(program) << " of " << before << " functions\n";
+    return true;
+}
+
+/// linkUnits - merge the bitcode of every unit into one module with
+/// llvm::Linker and compile it into the output, optimizing the whole program
+/// first for LTO. A snapshot also gets the prototypes of `symbols`.
+static bool linkUnits(std::vector<std::unique_ptr<SourceUnit>> &units, const SymbolRegistry &symbols,
+                      const DriverOptions &options) {
+    llvm::LLVMContext context{};
+    if (options.remarks) {
+        options.remarks->attach(context);
+    }
+    auto merged = std::make_unique<llvm::Module>(options.output, context);
+    llvm::Linker linker{*merged};
+
+    for (auto &unit: units) {
+        auto buffer = llvm::MemoryBufferRef{llvm::StringRef{unit->bitcode.data(), unit->bitcode.size()}, unit->path};
+        auto module = llvm::parseBitcodeFile(buffer, context);
+        if (!module) {
+            llvm::errs() << unit->path << ": " << llvm::toString(module.takeError()) << "\n";
+            return false;
+        }
+        if (linker.linkInModule(std::move(*module))) {
+            return false;
+        }
+    }
+    auto defined = PreludeSnapshot::definedFunctions(*merged);
+    if (options.lto && !optimizeProgram(*merged, options)) {
+        return false;
+    }
+    if (options.snapshot) {
+        if (auto err = PreludeSnapshot::write(*merged, symbols, options.output, defined)) {
+            llvm::errs() << llvm::toString(std::move(err)) << "\n";
+            return false;
+        }
+        return true;
+    }
+    return LLVMContext::emitObjectFile(*merged, options.output, options.triple);
+}
+
+/// compileFiles - ahead-of-time compile several .ks files in parallel.
+///
+/// Each file is lexed, parsed and codegen'd on a pool thread with its own
+/// context. All files are parsed before any is codegen'd, so a call may
+/// refer to a definition in any file. Without an output every file gets its
+/// own object next to it (foo.ks -> foo.o); with one, the modules are linked
+/// and written as a single object.
+static bool compileFiles(const std::vector<std::string> &paths, const DriverOptions &options) {
+    auto symbols = std::make_shared<SymbolRegistry>();
+    std::vector<std::unique_ptr<SourceUnit>> units{};
+    for (const auto &path: paths) {
+        units.push_back(std::make_unique<SourceUnit>(path, symbols));
+        units.back()->llvmContext->setProfile(options.profile);
+        if (options.remarks) {
+            options.remarks->attach(*units.back()->llvmContext->getContext());
+        }
+    }
+
+    llvm::ThreadPool pool{llvm::hardware_concurrency(options.jobs)};
+    for (auto &unit: units) {
+        pool.async([&unit, &symbols, &options] { parseUnit(*unit, *symbols, options); });
+    }
+    pool.wait();
+
+    for (auto &unit: units) {
+        std::string objectFile{};
+        if (options.output.empty()) {
+            llvm::SmallString<128> path{unit->path};
+            llvm::sys::path::replace_extension(path, "o");
+            objectFile = path.str().str();
+        }
+        pool.async([&unit, objectFile, &options] { codegenUnit(*unit, objectFile, options); });
+    }
+    pool.wait();
+
+    auto ok = true;
+    for (auto &unit: units) {
+        std::istringstream lines{unit->diagnostics.str()};
+        for (std::string line; std::getline(lines, line);) {
+            std::cerr << unit->path << ": " << line << std::endl;
+        }
+        ok = ok && unit->ok;
+    }
+
+    if (ok && !options.output.empty()) {
+        ok = linkUnits(units, *symbols, options);
+    }
+    // prototypes hold on to their contexts, drop them so those can be released.
+    symbols->clear();
+
+    if (ok) {
+        llvm::outs() << "Wrote " << (options.output.empty() ? std::to_string(units.size()) + " object files" : options.output) << "\n";
+    }
+    return ok;
+}
+
+#endif // KALEIDOSCOPE_DRIVER_H
@@ -0,0 +1,90 @@
+#ifndef KALEIDOSCOPE_ENGINE_H
+#define KALEIDOSCOPE_ENGINE_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class LLVMContext;
+class PreludeSnapshot;
+
+namespace ast {
+    struct DebugInfo;
+}
+
+namespace kal {
+
+    /// Engine - an embeddable Kaleidoscope JIT session.
+    ///
+    /// compile() accepts any mix of definitions, externs and top-level
+    /// expressions. Each definition is added to the JIT on its own, so a later
+    /// compile() that redefines a function replaces the old code. Compiling a
+    /// whole program again only codegens the definitions whose AST changed;
+    /// everything else keeps its object code, and callers of a changed
+    /// definition are relinked from the object cache.
+    ///
+    /// lookup() resolves a symbol once and caches the typed pointer. The cache is
+    /// safe to read from many threads and the returned pointers can be called
+    /// concurrently. A pointer stays valid until its function, or a function
+    /// it calls, is redefined (which relinks it to a new address); callers
+    /// must not call through it while such a compile() runs.
+    ///
+    /// Separate engines share no state and may compile on different threads.
+    class Engine {
+        std::shared_ptr<LLVMContext> llvmContext;
+        std::shared_ptr<ast::DebugInfo> ksDebugInfo;
+        mutable std::shared_mutex sessionMutex;
+        std::unordered_map<std::string, std::uint64_t> addressCache;
+
+        bool compileDefinition();
+        bool compileExtern();
+        std::optional<double> compileTopLevelExpression();
+        std::vector<size_t> codegenExprs(const std::vector<std::string> &exprs, const std::vector<size_t> &which,
+                                         std::vector<std::string> &names);
+    public:
+        /// jitListeners - JitListeners flags (LLVM.h) for profiling or
+        /// debugging the code this engine generates.
+        explicit Engine(unsigned jitListeners = 0);
+        ~Engine();
+
+        Engine(const Engine&) = delete;
+        Engine& operator=(const Engine&) = delete;
+
+        bool compile(std::string_view src);
+
+        /// isSnapshot - whether `contents` is a prelude snapshot rather than
+        /// source.
+        static bool isSnapshot(std::string_view contents);
+
+        /// loadSnapshot - map a prelude snapshot (kal_llvm --snapshot); nullptr
+        /// after printing why when it can not be loaded.
+        static std::shared_ptr<const PreludeSnapshot> loadSnapshot(const std::string &path);
+
+        /// loadPrelude - install a snapshot instead of compiling its source;
+        /// one snapshot can be shared by any number of engines.
+        bool loadPrelude(const std::shared_ptr<const PreludeSnapshot> &snapshot);
+
+        std::optional<double> evaluate(std::string_view expr);
+
+        /// evaluate - run a batch of top-level expressions through one module,
+        /// paying for a single JIT add instead of one per expression. If the
+        /// batch fails, the expressions that did not run yet are run again one
+        /// module each, so one bad expression only fails itself and none runs
+        /// twice.
+        std::vector<std::optional<double>> evaluate(const std::vector<std::string> &exprs);
+
+        std::uint64_t lookupAddress(const std::string &name);
+
+        template <typename Signature>
+        Signature* lookup(const std::string &name) {
+            return reinterpret_cast<Signature*>(static_cast<std::uintptr_t>(lookupAddress(name)));
+        }
+    };
+}
+
+#endif // KALEIDOSCOPE_ENGINE_H
@@ -0,0 +1,57 @@
+#ifndef KALEIDOSCOPE_INSTRUMENTATION_H
+#define KALEIDOSCOPE_INSTRUMENTATION_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/// Instrumentation - execution counters behind --instrument.
+///
+/// Codegen registers a counter for every function entry, if branch and loop
+/// (addCounter) and emits an inline add to __ks_counters[id]: no call and no
+/// thread-local lookup on the hot path. A redefined function gets the ids of
+/// its previous definition back, so the array only grows with new sites.
+/// JIT'd code runs on the main thread only, so the add is a plain one.
+class Instrumentation {
+public:
+    /// Counter - what one counter counts. kind is "entry", "then", "else",
+    /// "backedge" or "exit"; index numbers the ifs and loops of a function in
+    /// codegen order, so it is stable across runs of the same source.
+    struct Counter {
+        std::string function;
+        std::string kind;
+        unsigned index;
+        int line;
+    };
+
+    /// maxCounters - capacity of __ks_counters; untouched pages cost nothing.
+    static constexpr std::uint64_t maxCounters = 1 << 20;
+
+    static Instrumentation& get();
+
+    /// addCounter - id of the counter for `counter`'s site, the one it had
+    /// before if the function is being redefined. Fails once the array is
+    /// full.
+    bool addCounter(Counter counter, std::uint64_t &id);
+
+    /// writeReport - JSON report with the counts merged per function, the
+    /// format --profile-use reads back.
+    bool writeReport(const std::string &path);
+
+private:
+    std::mutex mutex;
+    std::vector<Counter> counters;
+    std::map<std::tuple<std::string, std::string, unsigned>, std::uint64_t> ids;
+    bool full = false;
+
+    Instrumentation() = default;
+};
+
+/// __ks_counters - the counts, indexed by counter id; instrumented code
+/// refers to it by name and the JIT resolves it from the host process.
+extern "C" std::uint64_t __ks_counters[Instrumentation::maxCounters];
+
+#endif // KALEIDOSCOPE_INSTRUMENTATION_H
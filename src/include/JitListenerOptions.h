@@ -0,0 +1,20 @@
+#ifndef KALEIDOSCOPE_JITLISTENEROPTIONS_H
+#define KALEIDOSCOPE_JITLISTENEROPTIONS_H
+
+#include "llvm/Support/CommandLine.h"
+#include "LLVM.h"
+
+// Command line switches for the JitListeners flags, shared by the tools that
+// run a JIT.
+
+static llvm::cl::opt<bool> gdbJit("gdb-jit", llvm::cl::desc("Register JIT'd objects with the GDB JIT interface"));
+static llvm::cl::opt<bool> perfJitdump("perf-jitdump", llvm::cl::desc("Write a perf jitdump of the JIT'd code (record with -k 1, then perf inject --jit)"));
+static llvm::cl::opt<bool> perfMap("perf-map", llvm::cl::desc("Write JIT'd function names to /tmp/perf-<pid>.map"));
+
+static unsigned selectedJitListeners() {
+    return (gdbJit ? GdbJitListener : NoJitListeners) |
+           (perfJitdump ? PerfJitdumpListener : NoJitListeners) |
+           (perfMap ? PerfMapJitListener : NoJitListeners);
+}
+
+#endif // KALEIDOSCOPE_JITLISTENEROPTIONS_H
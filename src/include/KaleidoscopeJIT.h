@@ -13,55 +13,127 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/JITLink/EHFrameSupport.h"
+#include "llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/ThreadPool.h"
+#include "SlabMemoryManager.h"
 #include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace llvm {
     namespace orc {
 
-        class KaleidoscopeJIT {
+        class KaleidoscopeJIT : public ResourceManager {
         private:
             std::unique_ptr<ExecutionSession> ES;
 
             DataLayout DL;
             MangleAndInterner Mangle;
 
-            RTDyldObjectLinkingLayer ObjectLayer;
+            // RTDyldObjectLinkingLayer, or ObjectLinkingLayer with JITLink.
+            std::unique_ptr<ObjectLayer> LinkLayer;
             IRCompileLayer CompileLayer;
 
             JITDylib &MainJD;
 
+            std::unique_ptr<ThreadPool> CompileThreads;
+
+            // Resolved symbols by unmangled name, so that repeated lookups
+            // neither mangle nor go through the ExecutionSession. The names
+            // each resource tracker defines are recorded when its module or
+            // object is added; removing the tracker drops them from the cache.
+            std::mutex CacheMutex;
+            StringMap<JITEvaluatedSymbol> SymbolCache;
+            DenseMap<ResourceKey, std::vector<std::string>> TrackerNames;
+            // bumped on every removal; lookups that raced with one do not
+            // cache what they found.
+            uint64_t CacheGeneration = 0;
+
+            void recordNames(const ResourceTrackerSP &RT, std::vector<std::string> Names) {
+                std::lock_guard<std::mutex> Lock(CacheMutex);
+                auto &Recorded = TrackerNames[RT->getKeyUnsafe()];
+                Recorded.insert(Recorded.end(), std::make_move_iterator(Names.begin()),
+                                std::make_move_iterator(Names.end()));
+            }
+
+            /// The unmangled names of the global symbols Obj defines.
+            std::vector<std::string> definedNames(MemoryBufferRef Obj) {
+                std::vector<std::string> Names;
+                auto File = object::ObjectFile::createObjectFile(Obj);
+                if (!File) {
+                    consumeError(File.takeError());
+                    return Names;
+                }
+                for (const auto &Sym : (*File)->symbols()) {
+                    auto Flags = Sym.getFlags();
+                    auto Name = Sym.getName();
+                    if (!Flags || !Name || !(*Flags & object::SymbolRef::SF_Global) ||
+                        (*Flags & object::SymbolRef::SF_Undefined)) {
+                        if (!Flags)
+                            consumeError(Flags.takeError());
+                        if (!Name)
+                            consumeError(Name.takeError());
+                        continue;
+                    }
+                    auto Unmangled = *Name;
+                    if (char Prefix = DL.getGlobalPrefix())
+                        Unmangled.consume_front(StringRef(&Prefix, 1));
+                    Names.push_back(Unmangled.str());
+                }
+                return Names;
+            }
+
         public:
             KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                            JITTargetMachineBuilder JTMB, DataLayout DL)
+                            JITTargetMachineBuilder JTMB, DataLayout DL,
+                            std::unique_ptr<ObjectLayer> LinkLayer,
+                            ObjectCache *ObjCache = nullptr)
                     : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-                      ObjectLayer(*this->ES,
-                                  []() { return std::make_unique<SectionMemoryManager>(); }),
-                      CompileLayer(*this->ES, ObjectLayer,
-                                   std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                      LinkLayer(std::move(LinkLayer)),
+                      CompileLayer(*this->ES, *this->LinkLayer,
+                                   std::make_unique<ConcurrentIRCompiler>(std::move(JTMB), ObjCache)),
                       MainJD(this->ES->createBareJITDylib("<main>")) {
                 MainJD.addGenerator(
                         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
                                 DL.getGlobalPrefix())));
+                this->ES->registerResourceManager(*this);
             }
 
-            ~KaleidoscopeJIT() {
+            ~KaleidoscopeJIT() override {
+                if (CompileThreads)
+                    CompileThreads->wait();
                 if (auto Err = ES->endSession())
                     ES->reportError(std::move(Err));
+                ES->deregisterResourceManager(*this);
             }
 
-            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+            /// With UseJITLink, objects are linked by JITLink in memory of an
+            /// InProcessMemoryManager and compiled for the small PIC code model.
+            /// Otherwise RuntimeDyld links them, with Slabs into the slabs of
+            /// that pool instead of a SectionMemoryManager each.
+            static Expected<std::unique_ptr<KaleidoscopeJIT>> Create(ObjectCache *ObjCache = nullptr,
+                                                                     std::shared_ptr<SlabPool> Slabs = nullptr,
+                                                                     bool UseJITLink = false) {
                 auto EPC = SelfExecutorProcessControl::Create();
                 if (!EPC)
                     return EPC.takeError();
@@ -71,26 +143,142 @@ namespace llvm {
                 JITTargetMachineBuilder JTMB(
                         ES->getExecutorProcessControl().getTargetTriple());
 
+                std::unique_ptr<ObjectLayer> LinkLayer;
+                if (UseJITLink) {
+                    auto MemMgr = jitlink::InProcessMemoryManager::Create();
+                    if (!MemMgr)
+                        return MemMgr.takeError();
+                    auto Layer = std::make_unique<ObjectLinkingLayer>(*ES, std::move(*MemMgr));
+                    Layer->addPlugin(std::make_unique<EHFrameRegistrationPlugin>(
+                            *ES, std::make_unique<jitlink::InProcessEHFrameRegistrar>()));
+                    LinkLayer = std::move(Layer);
+                    // JIT memory can be anywhere, so the small code model
+                    // has to go with position independent code.
+                    JTMB.setCodeModel(CodeModel::Small);
+                    JTMB.setRelocationModel(Reloc::PIC_);
+                } else {
+                    LinkLayer = std::make_unique<RTDyldObjectLinkingLayer>(
+                            *ES, [Slabs]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                                if (Slabs)
+                                    return std::make_unique<SlabMemoryManager>(Slabs);
+                                return std::make_unique<SectionMemoryManager>();
+                            });
+                }
+
                 auto DL = JTMB.getDefaultDataLayoutForTarget();
                 if (!DL)
                     return DL.takeError();
 
                 return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                                         std::move(*DL));
+                                                         std::move(*DL), std::move(LinkLayer), ObjCache);
             }
 
             const DataLayout &getDataLayout() const { return DL; }
 
+            ExecutionSession &getExecutionSession() { return *ES; }
+
+            /// Materialize modules on a pool of NumThreads threads. A lookup that
+            /// pulls in several uncompiled modules then compiles them in parallel.
+            void enableConcurrentCompilation(unsigned NumThreads) {
+                CompileThreads = std::make_unique<ThreadPool>(hardware_concurrency(NumThreads));
+                ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+                    // ThreadPool tasks must be copyable, so share ownership of T.
+                    auto SharedT = std::shared_ptr<Task>(std::move(T));
+                    CompileThreads->async([SharedT]() { SharedT->run(); });
+                });
+            }
+
+            /// Block until every dispatched materialization has finished.
+            void waitForCompiles() {
+                if (CompileThreads)
+                    CompileThreads->wait();
+            }
+
+            /// Tell L about every object linked from now on, e.g. to make the
+            /// code visible to a debugger or profiler. Only RuntimeDyld supports
+            /// listeners; returns false with JITLink.
+            bool registerJITEventListener(JITEventListener &L) {
+                if (!isa<RTDyldObjectLinkingLayer>(LinkLayer.get()))
+                    return false;
+                static_cast<RTDyldObjectLinkingLayer &>(*LinkLayer).registerJITEventListener(L);
+                return true;
+            }
+
+            bool usesJITLink() const { return isa<ObjectLinkingLayer>(LinkLayer.get()); }
+
             JITDylib &getMainJITDylib() { return MainJD; }
 
+            /// Define Symbols (unmangled name and address) as absolute symbols,
+            /// so that calls to them are resolved without searching the process.
+            Error defineAbsolute(const std::vector<std::pair<std::string, void *>> &Symbols) {
+                SymbolMap Map;
+                for (const auto &Symbol : Symbols)
+                    Map[Mangle(Symbol.first)] = JITEvaluatedSymbol(
+                            pointerToJITTargetAddress(Symbol.second),
+                            JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+                return MainJD.define(absoluteSymbols(std::move(Map)));
+            }
+
             Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
                 if (!RT)
                     RT = MainJD.getDefaultResourceTracker();
+                std::vector<std::string> Names;
+                TSM.withModuleDo([&](Module &M) {
+                    for (const auto &GV : M.global_values())
+                        if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+                            Names.push_back(GV.getName().str());
+                });
+                recordNames(RT, std::move(Names));
                 return CompileLayer.add(RT, std::move(TSM));
             }
 
+            Error addObject(std::unique_ptr<MemoryBuffer> Obj, ResourceTrackerSP RT = nullptr) {
+                if (!RT)
+                    RT = MainJD.getDefaultResourceTracker();
+                recordNames(RT, definedNames(Obj->getMemBufferRef()));
+                return LinkLayer->add(RT, std::move(Obj));
+            }
+
             Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
-                return ES->lookup({&MainJD}, Mangle(Name.str()));
+                uint64_t Generation;
+                {
+                    std::lock_guard<std::mutex> Lock(CacheMutex);
+                    auto It = SymbolCache.find(Name);
+                    if (It != SymbolCache.end())
+                        return It->second;
+                    Generation = CacheGeneration;
+                }
+                auto Symbol = ES->lookup({&MainJD}, Mangle(Name.str()));
+                if (Symbol) {
+                    std::lock_guard<std::mutex> Lock(CacheMutex);
+                    if (Generation == CacheGeneration)
+                        SymbolCache[Name] = *Symbol;
+                }
+                return Symbol;
+            }
+
+            Error handleRemoveResources(ResourceKey K) override {
+                std::lock_guard<std::mutex> Lock(CacheMutex);
+                ++CacheGeneration;
+                auto It = TrackerNames.find(K);
+                if (It == TrackerNames.end())
+                    return Error::success();
+                for (const auto &Name : It->second)
+                    SymbolCache.erase(Name);
+                TrackerNames.erase(It);
+                return Error::success();
+            }
+
+            void handleTransferResources(ResourceKey DstK, ResourceKey SrcK) override {
+                std::lock_guard<std::mutex> Lock(CacheMutex);
+                auto It = TrackerNames.find(SrcK);
+                if (It == TrackerNames.end())
+                    return;
+                auto Names = std::move(It->second);
+                TrackerNames.erase(It);
+                auto &Dst = TrackerNames[DstK];
+                Dst.insert(Dst.end(), std::make_move_iterator(Names.begin()),
+                           std::make_move_iterator(Names.end()));
             }
         };
 
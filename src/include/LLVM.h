@@ -1,8 +1,14 @@
+#ifndef KALEIDOSCOPE_LLVM_H
+#define KALEIDOSCOPE_LLVM_H
+
+#include <llvm/ADT/Hashing.h>
 #include <llvm/ADT/Optional.h>
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Host.h>
 #include <llvm/Support/TargetSelect.h>
@@ -18,9 +24,58 @@
 #include <cstdio>
 #include <cstdlib>
 #include <memory>
+#include <mutex>
 #include <iostream>
 #include <system_error>
+#include <set>
 #include <utility>
+#include "Builtins.h"
+#include "Instrumentation.h"
+#include "KaleidoscopeJIT.h"
+#include "ObjectCache.h"
+#include "PerfMap.h"
+#include "ProfileData.h"
+#include "Profiler.h"
+#include "SlabMemoryManager.h"
+#include "SymbolRegistry.h"
+#include "TimeReport.h"
+
+/// DefinitionKey - FunctionAST::definitionKey(): a canonical serialization of
+/// the definition and its hash. Keys are only equal if the serializations
+/// are, so a hash collision never keeps stale code.
+struct DefinitionKey {
+    llvm::hash_code hash;
+    std::string canonical;
+
+    bool operator==(const DefinitionKey &other) const {
+        return hash == other.hash && canonical == other.canonical;
+    }
+};
+
+/// JitDefinition - a definition living in the JIT: the tracker owning its
+/// code, the functions it calls, so callers can be found on redefinition, the
+/// key of the AST it was compiled from (see FunctionAST::definitionKey) and
+/// its arity, which the code of its callers was compiled for.
+struct JitDefinition {
+    llvm::orc::ResourceTrackerSP tracker;
+    std::set<std::string> callees;
+    DefinitionKey key;
+    unsigned numArgs;
+};
+
+/// JitListeners - opt-in ways of exposing JIT'd code to outside tools; the
+/// JIT registers one event listener per flag.
+enum JitListeners: unsigned {
+    NoJitListeners = 0,
+    // GDB JIT interface: gdb sees functions and, with -g, source lines.
+    GdbJitListener = 1u << 0,
+    // perf jitdump (~/.debug/jit); `perf record -k 1` then `perf inject --jit`.
+    PerfJitdumpListener = 1u << 1,
+    // /tmp/perf-<pid>.map, read by perf report as is.
+    PerfMapJitListener = 1u << 2,
+    // the built-in Profiler; also forces frame pointers in generated code.
+    ProfilerJitListener = 1u << 3
+};
 
 class LLVMContext {
     std::unique_ptr<llvm::LLVMContext> theContext;
@@ -28,18 +83,33 @@ class LLVMContext {
     std::unique_ptr<llvm::IRBuilder<>> builder;
     std::unique_ptr<llvm::DIBuilder> dBuilder;
     //    std::unique_ptr<llvm::legacy::FunctionPassManager> theFPM;
-//    std::unique_ptr<llvm::orc::KaleidoscopeJIT> theJit;
     std::map<char, int> binOpPrecedence;
+    mutable std::mutex binOpMutex;
+    std::shared_ptr<SymbolRegistry> symbols;
     llvm::ExitOnError exitOnError;
+    std::mutex jitErrorsMutex;
+    std::vector<std::string> jitErrors;
+    std::unique_ptr<DefinitionObjectCache> objectCache;
+    std::shared_ptr<SlabPool> slabs;
+    bool jitLink = false;
+    // keep the memory of prelude objects alive; declared before theJit, which
+    // must be gone first.
+    std::vector<std::shared_ptr<const void>> preludeOwners;
+    std::unique_ptr<llvm::orc::KaleidoscopeJIT> theJit;
+    std::map<std::string, JitDefinition> definitions;
+    bool framePointers = false;
+    bool instrumented = false;
+    std::shared_ptr<const ProfileData> profile;
+    std::string currentFunction;
+    unsigned functionSites = 0;
 public:
-    LLVMContext() {
+    explicit LLVMContext(std::shared_ptr<SymbolRegistry> symbols = std::make_shared<SymbolRegistry>()): symbols(std::move(symbols)) {
         binOpPrecedence = std::map<char, int>{};
         binOpPrecedence['='] = 2;
         binOpPrecedence['<'] = 10;
         binOpPrecedence['+'] = 20;
         binOpPrecedence['-'] = 20;
         binOpPrecedence['*'] = 40;
-//        theJit = exitOnError(llvm::orc::KaleidoscopeJIT::Create());
         initializeModuleAndPassManager();
     }
 
@@ -61,28 +131,102 @@ public:
 
 /*   inline const std::unique_ptr<llvm::legacy::FunctionPassManager>& getFPM() const {
            return theFPM;
-       }
-
-       inline const std::unique_ptr<llvm::orc::KaleidoscopeJIT>& getJit() const {
-           return theJit;
        }*/
 
-    inline const std::map<char, int>& getBinOpPrecedence() const {
-        return binOpPrecedence;
+    inline const std::unique_ptr<llvm::orc::KaleidoscopeJIT>& getJit() const {
+        return theJit;
+    }
+
+    bool forcesFramePointers() const {
+        return framePointers;
+    }
+
+    /// enableInstrumentation - have codegen count function entries, if
+    /// branches and loop iterations (see Instrumentation).
+    void enableInstrumentation() {
+        instrumented = true;
+    }
+
+    bool isInstrumented() const {
+        return instrumented;
+    }
+
+    /// setProfile - annotate the code generated from now on with the
+    /// counts of an earlier --instrument run (see ProfileData).
+    void setProfile(std::shared_ptr<const ProfileData> profileData) {
+        profile = std::move(profileData);
+        if (profile) {
+            profile->annotateModule(*theModule);
+        }
+    }
+
+    /// beginFunction - start numbering the sites (ifs and loops) of `f`, the
+    /// key counters and profile data are looked up by, then count its
+    /// entries or apply its profile.
+    void beginFunction(llvm::Function &f, int line) {
+        currentFunction = f.getName().str();
+        functionSites = 0;
+        if (profile) {
+            profile->annotateFunction(f);
+        }
+        if (instrumented) {
+            emitCounter("entry", 0, line);
+        }
+    }
+
+    unsigned nextSite() {
+        return functionSites++;
+    }
+
+    /// branchWeights - profile weights of a branch on `site`, nullptr
+    /// without a profile.
+    llvm::MDNode* branchWeights(unsigned site, const char *taken, const char *notTaken) const {
+        return profile ? profile->branchWeights(*theContext, currentFunction, site, taken, notTaken) : nullptr;
+    }
+
+    /// emitCounter - count every execution of the builder's insert point.
+    void emitCounter(const char *kind, unsigned site, int line) {
+        std::uint64_t id;
+        if (!Instrumentation::get().addCounter({currentFunction, kind, site, line}, id)) {
+            return;
+        }
+        auto *countsTy = llvm::ArrayType::get(builder->getInt64Ty(), Instrumentation::maxCounters);
+        auto *counts = theModule->getOrInsertGlobal("__ks_counters", countsTy);
+        auto *counter = builder->CreateConstInBoundsGEP2_64(countsTy, counts, 0, id);
+        auto *count = builder->CreateLoad(builder->getInt64Ty(), counter);
+        builder->CreateStore(builder->CreateAdd(count, builder->getInt64(1)), counter);
+    }
+
+    inline SymbolRegistry& getSymbols() {
+        return *symbols;
+    }
+
+    int getBinOpPrecedence(char binOp) const {
+        std::lock_guard<std::mutex> lock{binOpMutex};
+        auto it = binOpPrecedence.find(binOp);
+        return it == binOpPrecedence.end() ? -1 : it->second;
     }
 
     void addToBinOpPrecedence(std::pair<char, int> binOp) {
+        std::lock_guard<std::mutex> lock{binOpMutex};
         binOpPrecedence[binOp.first] = binOp.second;
     }
 
     void eraseFromBinOpPrecedence(char binOp) {
+        std::lock_guard<std::mutex> lock{binOpMutex};
         binOpPrecedence.erase(binOp);
     }
 
     void initializeModuleAndPassManager() {
         theContext = std::make_unique<llvm::LLVMContext>();
         theModule = std::make_unique<llvm::Module>("my cool jit", *theContext);
-//        theModule->setDataLayout(theJit->getDataLayout());
+        if (theJit) {
+            theModule->setDataLayout(theJit->getDataLayout());
+        }
+
+        if (profile) {
+            profile->annotateModule(*theModule);
+        }
 
         builder = std::make_unique<llvm::IRBuilder<>>(*theContext);
 
@@ -104,75 +248,395 @@ public:
         theFPM->doInitialization();*/
     }
 
-    void initializeTargetRegistry() {
-        llvm::InitializeAllTargetInfos();
-        llvm::InitializeAllTargets();
-        llvm::InitializeAllTargetMCs();
-        llvm::InitializeAllAsmParsers();
-        llvm::InitializeAllAsmPrinters();
+    /// initializeTargets - register the backend `triple` needs. That is the
+    /// native one, unless `triple` is for another architecture: then every
+    /// backend LLVM was built with is registered, the first time one is
+    /// needed. Returns false if kal was built with the native backend only
+    /// (KAL_MINIMAL_LLVM) and `triple` needs another. Thread safe.
+    static bool initializeTargets(const llvm::Triple &triple) {
+        static std::once_flag native;
+        std::call_once(native, [] {
+            llvm::InitializeNativeTarget();
+            llvm::InitializeNativeTargetAsmPrinter();
+            llvm::InitializeNativeTargetAsmParser();
+        });
+        if (triple.getArch() == llvm::Triple{llvm::sys::getProcessTriple()}.getArch()) {
+            return true;
+        }
+#ifdef KAL_NATIVE_TARGET_ONLY
+        return false;
+#else
+        static std::once_flag all;
+        std::call_once(all, [] {
+            llvm::InitializeAllTargetInfos();
+            llvm::InitializeAllTargets();
+            llvm::InitializeAllTargetMCs();
+            llvm::InitializeAllAsmParsers();
+            llvm::InitializeAllAsmPrinters();
+        });
+        return true;
+#endif
+    }
 
-        auto targetTriple = llvm::sys::getDefaultTargetTriple();
-        theModule->setTargetTriple(targetTriple);
+    /// createTargetMachine - target machine for `triple` (the default triple
+    /// if empty), with the target's default relocation and code models unless
+    /// given. Initializes the backend on first use.
+    static std::unique_ptr<llvm::TargetMachine> createTargetMachine(
+            std::string targetTriple = "", llvm::Optional<llvm::Reloc::Model> rm = llvm::None,
+            llvm::Optional<llvm::CodeModel::Model> cm = llvm::None) {
+        if (targetTriple.empty()) {
+            targetTriple = llvm::sys::getDefaultTargetTriple();
+        }
+        if (!initializeTargets(llvm::Triple{targetTriple})) {
+            llvm::errs() << "kal was built with the native backend only (KAL_MINIMAL_LLVM), not for " << targetTriple
+                         << "\n";
+            return nullptr;
+        }
 
         std::string error;
         auto target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
 
         if (!target) {
             llvm::errs() << error;
-            return;
+            return nullptr;
         }
 
-        auto cpu = "generic";
+        // not every backend has a "generic" CPU, "" picks each one's default.
+        auto native = llvm::Triple{targetTriple}.getArch() == llvm::Triple{llvm::sys::getProcessTriple()}.getArch();
+        auto cpu = native ? "generic" : "";
         auto features = "";
 
         llvm::TargetOptions opt;
-        auto rm = llvm::Optional<llvm::Reloc::Model>();
-        auto theTargetMachine = target->createTargetMachine(targetTriple, cpu, features, opt, rm);
+        return std::unique_ptr<llvm::TargetMachine>{target->createTargetMachine(targetTriple, cpu, features, opt, rm, cm)};
+    }
 
-        theModule->setDataLayout(theTargetMachine->createDataLayout());
+    /// optimizeModule - run a new pass manager pipeline over `module`.
+    /// preLink is the per-file half of an LTO build, which must keep every
+    /// external definition; otherwise it is the whole-program half, which
+    /// expects all modules linked together and non-exported symbols internal.
+    static void optimizeModule(llvm::Module &module, llvm::TargetMachine &tm, bool preLink) {
+        PhaseTimer timer{TimeReport::Optimize};
+        module.setTargetTriple(tm.getTargetTriple().str());
+        module.setDataLayout(tm.createDataLayout());
+
+        llvm::LoopAnalysisManager lam;
+        llvm::FunctionAnalysisManager fam;
+        llvm::CGSCCAnalysisManager cgam;
+        llvm::ModuleAnalysisManager mam;
+
+        llvm::PassInstrumentationCallbacks pic;
+        TimeReport::get().registerPassCallbacks(pic);
+        llvm::PassBuilder pb{&tm, llvm::PipelineTuningOptions{}, llvm::None, &pic};
+        pb.registerModuleAnalyses(mam);
+        pb.registerCGSCCAnalyses(cgam);
+        pb.registerFunctionAnalyses(fam);
+        pb.registerLoopAnalyses(lam);
+        pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+        auto mpm = preLink ? pb.buildLTOPreLinkDefaultPipeline(llvm::OptimizationLevel::O2)
+                           : pb.buildLTODefaultPipeline(llvm::OptimizationLevel::O2, nullptr);
+        mpm.run(module, mam);
+    }
+
+    /// emitObjectFile - compile `module` for `triple` (the default triple if
+    /// empty) into `filename`. Safe to call for different modules from
+    /// several threads.
+    static bool emitObjectFile(llvm::Module &module, const std::string &filename, const std::string &triple = "") {
+        PhaseTimer timer{TimeReport::Emit};
+        auto theTargetMachine = createTargetMachine(triple);
+        if (!theTargetMachine) {
+            return false;
+        }
 
-        auto filename = "/home/sbcd90/Documents/programs/kaleidoscope-llvm/src/output.o";
         std::error_code ec;
         llvm::raw_fd_ostream dest(filename, ec, llvm::sys::fs::OF_None);
 
         if (ec) {
             llvm::errs() << "Could not open file: " << ec.message();
-            return;
+            return false;
         }
+        return emitObject(module, *theTargetMachine, dest);
+    }
+
+    /// emitObject - compile `module` with `theTargetMachine` into `dest`.
+    static bool emitObject(llvm::Module &module, llvm::TargetMachine &theTargetMachine, llvm::raw_pwrite_stream &dest) {
+        module.setTargetTriple(theTargetMachine.getTargetTriple().str());
+        module.setDataLayout(theTargetMachine.createDataLayout());
 
         llvm::legacy::PassManager pass;
         auto fileType = llvm::CGFT_ObjectFile;
 
-        if (theTargetMachine->addPassesToEmitFile(pass, dest, nullptr, fileType)) {
+        if (theTargetMachine.addPassesToEmitFile(pass, dest, nullptr, fileType)) {
             llvm::errs() << "TheTargetMachine can't emit a file of this type";
+            return false;
         }
 
-        pass.run(*theModule);
+        pass.run(module);
         dest.flush();
+        return true;
+    }
 
-        llvm::outs() << "Wrote " << filename << "\n";
+    void initializeTargetRegistry() {
+        auto filename = "/home/sbcd90/Documents/programs/kaleidoscope-llvm/src/output.o";
+        if (emitObjectFile(*theModule, filename)) {
+            llvm::outs() << "Wrote " << filename << "\n";
+        }
     }
 
-/*    void handleTopLevelExprJit() {
-        auto rt = theJit->getMainJITDylib().createResourceTracker();
-        auto tsm = llvm::orc::ThreadSafeModule{std::move(theModule), std::move(theContext)};
-        exitOnError(theJit->addModule(std::move(tsm), rt));
+    /// useSlabMemory - have the JIT initializeJit() creates place its code and
+    /// data in slabs of `slabSize` bytes (see SlabPool).
+    void useSlabMemory(size_t slabSize, bool hugePages) {
+        slabs = std::make_shared<SlabPool>(slabSize, hugePages);
+    }
 
-        initializeModuleAndPassManager();
+    inline const std::shared_ptr<SlabPool>& getSlabPool() const {
+        return slabs;
+    }
 
-        auto exprSymbol = exitOnError(theJit->lookup("__anon_expr"));
+    /// useJitLink - have the JIT initializeJit() creates link with JITLink
+    /// instead of RuntimeDyld. JIT listeners and slabs need RuntimeDyld.
+    void useJitLink() {
+        jitLink = true;
+    }
 
-        double (*fp)() = (double (*)())(intptr_t)exprSymbol.getAddress();
-        std::cout << "Evaluated to " << fp() << std::endl;
+    /// initializeJit - create the JIT; with compileThreads > 0 modules are
+    /// compiled on a thread pool when they are first looked up. `listeners`
+    /// is a set of JitListeners flags.
+    void initializeJit(unsigned compileThreads = 0, unsigned listeners = NoJitListeners) {
+        initializeTargets(llvm::Triple{llvm::sys::getProcessTriple()});
+
+        objectCache = std::make_unique<DefinitionObjectCache>();
+        theJit = exitOnError(llvm::orc::KaleidoscopeJIT::Create(objectCache.get(), slabs, jitLink));
+        exitOnError(theJit->defineAbsolute(runtimeBuiltins()));
+        if (compileThreads) {
+            theJit->enableConcurrentCompilation(compileThreads);
+        }
+        if (listeners != NoJitListeners && theJit->usesJITLink()) {
+            llvm::errs() << "warning: JIT listeners are not supported with JITLink, the JIT'd code is not reported\n";
+        }
+        if (listeners & GdbJitListener) {
+            theJit->registerJITEventListener(*llvm::JITEventListener::createGDBRegistrationListener());
+        }
+        if (listeners & PerfJitdumpListener) {
+            if (auto *perf = llvm::JITEventListener::createPerfJITEventListener()) {
+                theJit->registerJITEventListener(*perf);
+            } else {
+                llvm::errs() << "warning: LLVM was built without perf support, no jitdump is written\n";
+            }
+        }
+        if (listeners & PerfMapJitListener) {
+            theJit->registerJITEventListener(PerfMapListener::get());
+        }
+        if (listeners & ProfilerJitListener) {
+            theJit->registerJITEventListener(Profiler::get());
+            framePointers = true;
+        }
+        theJit->getExecutionSession().setErrorReporter([this](llvm::Error err) {
+            std::lock_guard<std::mutex> lock{jitErrorsMutex};
+            jitErrors.push_back(llvm::toString(std::move(err)));
+        });
+        theModule->setDataLayout(theJit->getDataLayout());
+    }
 
-        exitOnError(rt->remove());
+    /// addPreludeObject - have the JIT link `object` (on the first lookup of
+    /// a symbol it defines) straight from where it is, without a copy. `owner`
+    /// keeps that memory alive as long as the JIT may read it.
+    llvm::Error addPreludeObject(llvm::MemoryBufferRef object, std::shared_ptr<const void> owner) {
+        preludeOwners.push_back(std::move(owner));
+        return theJit->addObject(llvm::MemoryBuffer::getMemBuffer(object, false));
     }
 
-    void handleDefinition() {
+    /// addModuleToJit - hand the current module to the JIT under its own
+    /// resource tracker and start a fresh one. `identifier` names the module,
+    /// and with it the module's entry in the object cache.
+    llvm::Expected<llvm::orc::ResourceTrackerSP> addModuleToJit(const std::string &identifier) {
+        dBuilder->finalize();
+        theModule->setModuleIdentifier(identifier);
+        auto rt = theJit->getMainJITDylib().createResourceTracker();
         auto tsm = llvm::orc::ThreadSafeModule{std::move(theModule), std::move(theContext)};
-        exitOnError(theJit->addModule(std::move(tsm)));
         initializeModuleAndPassManager();
-    }*/
+
+        if (auto err = theJit->addModule(std::move(tsm), rt)) {
+            return std::move(err);
+        }
+        return rt;
+    }
+
+    /// flushJitErrors - print the errors reported by materializations. With a
+    /// compile pool they arrive on other threads, so wait for those to finish
+    /// first; errors then always show up right after the lookup that hit them.
+    void flushJitErrors() {
+        theJit->waitForCompiles();
+        std::lock_guard<std::mutex> lock{jitErrorsMutex};
+        for (const auto &err: jitErrors) {
+            llvm::errs() << "JIT session error: " << err << "\n";
+        }
+        jitErrors.clear();
+    }
+
+    llvm::Expected<double> handleTopLevelExprJit(const std::string &name) {
+        std::vector<double> results{};
+        if (auto err = handleTopLevelExprsJit({name}, results)) {
+            return std::move(err);
+        }
+        return results.front();
+    }
+
+    /// handleTopLevelExprsJit - run several top-level expressions that were
+    /// codegen'd into the current module with a single JIT add and removal.
+    /// The value of each expression that ran is appended to `results`; the
+    /// first one that fails to compile stops the batch with its error, and
+    /// the expressions after it are not run.
+    llvm::Error handleTopLevelExprsJit(const std::vector<std::string> &names, std::vector<double> &results) {
+        auto rt = addModuleToJit("__anon_expr");
+        if (!rt) {
+            return rt.takeError();
+        }
+
+        for (const auto &name: names) {
+            // the lookup compiles everything the expression needs.
+            auto exprSymbol = [this, &name] {
+                PhaseTimer timer{TimeReport::Emit};
+                auto symbol = theJit->lookup(name);
+                flushJitErrors();
+                return symbol;
+            }();
+            if (!exprSymbol) {
+                llvm::consumeError((*rt)->remove());
+                objectCache->erase("__anon_expr");
+                return exprSymbol.takeError();
+            }
+
+            double (*fp)() = (double (*)())(intptr_t)exprSymbol->getAddress();
+            results.push_back(fp());
+        }
+
+        objectCache->erase("__anon_expr");
+        return (*rt)->remove();
+    }
+
+    /// handleDefinition - move the module holding `name` into the JIT. A
+    /// previous definition of the same name is released and everything already
+    /// linked against it is relinked, so callers see the new code. If the
+    /// arity changed, the callers were compiled for the old one: they are
+    /// removed instead, along with their prototypes, and reported as an error.
+    /// The names of all the definitions whose code moved or went away are
+    /// added to `moved`.
+    llvm::Error handleDefinition(const std::string &name, DefinitionKey key,
+                                 std::set<std::string> *moved = nullptr) {
+        PhaseTimer timer{TimeReport::Emit};
+        std::set<std::string> callees{};
+        for (const auto &f: *theModule) {
+            if (f.isDeclaration()) {
+                callees.insert(f.getName().str());
+            }
+        }
+        auto numArgs = unsigned(theModule->getFunction(name)->arg_size());
+
+        auto previous = definitions.find(name);
+        auto replaced = previous != definitions.end();
+        auto oldNumArgs = replaced ? previous->second.numArgs : numArgs;
+        if (auto err = removeDefinition(name)) {
+            return err;
+        }
+
+        auto rt = addModuleToJit(name);
+        if (!rt) {
+            return rt.takeError();
+        }
+        definitions[name] = JitDefinition{std::move(*rt), std::move(callees), std::move(key), numArgs};
+
+        if (!replaced) {
+            return llvm::Error::success();
+        }
+        auto callers = findCallers(name);
+        if (moved) {
+            moved->insert(callers.begin(), callers.end());
+        }
+        if (numArgs != oldNumArgs) {
+            return removeCallers(name, callers);
+        }
+        return relinkCallers(callers);
+    }
+
+    /// isDefinitionCurrent - whether the JIT already holds code for `name`
+    /// compiled from an AST with this key, so codegen can be skipped.
+    bool isDefinitionCurrent(const std::string &name, const DefinitionKey &key) const {
+        auto it = definitions.find(name);
+        return it != definitions.end() && it->second.key == key;
+    }
+
+    llvm::Error removeDefinition(const std::string &name) {
+        auto it = definitions.find(name);
+        if (it == definitions.end()) {
+            return llvm::Error::success();
+        }
+        auto rt = std::move(it->second.tracker);
+        definitions.erase(it);
+        objectCache->erase(name);
+        return rt->remove();
+    }
+
+    /// findCallers - the definitions calling `name`, directly or through
+    /// other definitions.
+    std::set<std::string> findCallers(const std::string &name) const {
+        std::set<std::string> callers{};
+        std::vector<std::string> worklist{name};
+        while (!worklist.empty()) {
+            auto callee = worklist.back();
+            worklist.pop_back();
+            for (const auto &def: definitions) {
+                if (def.second.callees.count(callee) && callers.insert(def.first).second) {
+                    worklist.push_back(def.first);
+                }
+            }
+        }
+        callers.erase(name);
+        return callers;
+    }
+
+    /// relinkCallers - compiled `callers` were linked against the old address
+    /// of a redefined function. Load them again from their cached objects;
+    /// callers not compiled yet will link against the new definition when
+    /// they are.
+    llvm::Error relinkCallers(const std::set<std::string> &callers) {
+        for (const auto &caller: callers) {
+            auto obj = objectCache->getObjectCopy(caller);
+            if (!obj) {
+                continue;
+            }
+
+            auto &def = definitions[caller];
+            if (auto err = def.tracker->remove()) {
+                return err;
+            }
+            def.tracker = theJit->getMainJITDylib().createResourceTracker();
+            if (auto err = theJit->addObject(std::move(obj), def.tracker)) {
+                return err;
+            }
+        }
+        return llvm::Error::success();
+    }
+
+    /// removeCallers - drop `callers` of `name`, which were compiled for
+    /// another arity of it, from the JIT and the symbols, so using them is an
+    /// unknown function rather than a call with the wrong arguments.
+    llvm::Error removeCallers(const std::string &name, const std::set<std::string> &callers) {
+        if (callers.empty()) {
+            return llvm::Error::success();
+        }
+        std::string removed{};
+        for (const auto &caller: callers) {
+            if (auto err = removeDefinition(caller)) {
+                return err;
+            }
+            symbols->exchange(caller, nullptr);
+            removed += (removed.empty() ? "" : ", ") + caller;
+        }
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                       "the number of arguments of %s changed, removed its callers: %s",
+                                       name.c_str(), removed.c_str());
+    }
 
     llvm::AllocaInst* createEntryBlockAlloca(llvm::Function *theFunction, llvm::StringRef varName) {
         llvm::IRBuilder<> tmpB{&theFunction->getEntryBlock(), theFunction->getEntryBlock().begin()};
@@ -183,3 +647,5 @@ public:
         return o << std::string(size, ' ');
     }
 };
+
+#endif // KALEIDOSCOPE_LLVM_H
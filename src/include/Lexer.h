@@ -24,12 +24,19 @@ enum Token {
     tokWhile = -15
 };
 
-static std::string identifierStr;
-static double numVal;
+static thread_local std::string identifierStr;
+static thread_local double numVal;
+static thread_local int lastChar = ' ';
+
+/// resetLexer - point the lexer at a new input (nullptr reads stdin) and drop
+/// the lookahead character left over from the previous one.
+static inline void resetLexer(std::istream *input) {
+    lexInput = input;
+    lastChar = ' ';
+    lexLoc = SourceLocation{1, 0};
+}
 
 static int getTok() {
-    static int lastChar = ' ';
-
     while (isspace(lastChar)) {
         lastChar = advance();
     }
@@ -0,0 +1,110 @@
+#ifndef KALEIDOSCOPE_MEMREPORT_H
+#define KALEIDOSCOPE_MEMREPORT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include "TimeReport.h"
+
+/// MemReport - where compile memory goes, for --mem-report.
+///
+/// kal_engine replaces the global operator new and delete with ones that
+/// count every allocation against the phase running on the calling thread
+/// (the phases of TimeReport; "other" outside of any), and its free against
+/// the same phase, so that a phase's net is what it left allocated. They
+/// also track the live heap and its peak. AST nodes created through ast::makeNode are also
+/// counted by type, with the size of the node itself (not the strings and
+/// vectors it owns). Only the frees of blocks allocated after enable() are
+/// counted, so memory allocated before does not show up at all.
+class MemReport {
+public:
+    static MemReport& get();
+
+    void enable();
+
+    bool isEnabled() const {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void recordAlloc(void *block, size_t bytes);
+    void recordFree(void *block, size_t bytes);
+    void countNode(llvm::StringRef type, size_t bytes);
+
+    void print(llvm::raw_ostream &out);
+
+private:
+    struct PhaseCounts {
+        std::atomic<uint64_t> allocs{0};
+        std::atomic<uint64_t> allocBytes{0};
+        std::atomic<uint64_t> frees{0};
+        std::atomic<uint64_t> freeBytes{0};
+    };
+    struct NodeCounts {
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+    };
+
+    /// MallocAllocator - for the report's own bookkeeping, which must not go
+    /// through the counting operator new.
+    template <typename T>
+    struct MallocAllocator {
+        using value_type = T;
+
+        MallocAllocator() = default;
+        template <typename U>
+        MallocAllocator(const MallocAllocator<U>&) {}
+
+        T* allocate(size_t n) {
+            if (auto *p = std::malloc(n * sizeof(T))) {
+                return static_cast<T*>(p);
+            }
+            throw std::bad_alloc{};
+        }
+        void deallocate(T *p, size_t) {
+            std::free(p);
+        }
+
+        template <typename U>
+        bool operator==(const MallocAllocator<U>&) const {
+            return true;
+        }
+        template <typename U>
+        bool operator!=(const MallocAllocator<U>&) const {
+            return false;
+        }
+    };
+
+    /// CountedBlocks - blocks allocated since enable() and the phase of each,
+    /// sharded by address so that threads seldom wait for each other.
+    struct CountedBlocks {
+        std::mutex mutex;
+        std::unordered_map<void*, unsigned, std::hash<void*>, std::equal_to<void*>,
+                           MallocAllocator<std::pair<void* const, unsigned>>> blocks;
+    };
+    static constexpr size_t numShards = 64;
+
+    std::atomic<bool> enabled{false};
+    // indexed by TimeReport::Phase, the last entry is "other".
+    PhaseCounts phases[TimeReport::NumPhases + 1];
+    std::atomic<int64_t> liveBytes{0};
+    std::atomic<int64_t> peakBytes{0};
+    CountedBlocks counted[numShards];
+    std::mutex nodesMutex;
+    std::map<llvm::StringRef, NodeCounts> nodes;
+
+    MemReport() = default;
+
+    CountedBlocks& shardOf(void *block) {
+        // malloc hands out 16 byte aligned blocks.
+        return counted[(reinterpret_cast<uintptr_t>(block) >> 4) % numShards];
+    }
+};
+
+#endif // KALEIDOSCOPE_MEMREPORT_H
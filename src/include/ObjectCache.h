@@ -0,0 +1,42 @@
+#ifndef KALEIDOSCOPE_OBJECTCACHE_H
+#define KALEIDOSCOPE_OBJECTCACHE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <mutex>
+
+/// DefinitionObjectCache - keeps the object code the JIT produced for each
+/// module, keyed by module identifier (the name of the definition it holds).
+/// Lets a definition be linked again without going back to IR.
+class DefinitionObjectCache: public llvm::ObjectCache {
+    std::mutex mutex;
+    llvm::StringMap<std::unique_ptr<llvm::MemoryBuffer>> objects;
+public:
+    void notifyObjectCompiled(const llvm::Module *m, llvm::MemoryBufferRef obj) override {
+        std::lock_guard<std::mutex> lock{mutex};
+        objects[m->getModuleIdentifier()] = llvm::MemoryBuffer::getMemBufferCopy(obj.getBuffer(), obj.getBufferIdentifier());
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *m) override {
+        return nullptr;
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObjectCopy(llvm::StringRef identifier) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = objects.find(identifier);
+        if (it == objects.end()) {
+            return nullptr;
+        }
+        return llvm::MemoryBuffer::getMemBufferCopy(it->second->getBuffer(), it->second->getBufferIdentifier());
+    }
+
+    void erase(llvm::StringRef identifier) {
+        std::lock_guard<std::mutex> lock{mutex};
+        objects.erase(identifier);
+    }
+};
+
+#endif // KALEIDOSCOPE_OBJECTCACHE_H
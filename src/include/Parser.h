@@ -1,10 +1,15 @@
+#ifndef KALEIDOSCOPE_PARSER_H
+#define KALEIDOSCOPE_PARSER_H
+
 #include "Lexer.h"
 #include <map>
 #include <iostream>
 
-static int curTok = 1;
+static thread_local int curTok = 1;
 
 static int getNextToken() {
+    PhaseTimer timer{TimeReport::Lex};
+    TimeReport::get().count(TimeReport::Tokens);
     return curTok = getTok();
 }
 
@@ -13,18 +18,20 @@ static int getTokPrecedence(const std::shared_ptr<LLVMContext> &llvmContext) {
         return -1;
     }
 
-    if (llvmContext->getBinOpPrecedence().find(curTok) == llvmContext->getBinOpPrecedence().end()) {
-        return -1;
-    }
-    auto tokPrec = llvmContext->getBinOpPrecedence().at(curTok);
+    auto tokPrec = llvmContext->getBinOpPrecedence(curTok);
     if (tokPrec <= 0) {
         return -1;
     }
     return tokPrec;
 }
 
+// Diagnostics go to stdout unless the calling thread collects them (the
+// pipelined parser, or a file compiled by the driver). Inline so codegen
+// errors raised in Ast.cpp land in the same stream.
+inline thread_local std::ostream *errorStream = nullptr;
+
 static std::unique_ptr<ast::ExprAST> logError(std::string s) {
-    std::cout << "Error: " << s << std::endl;
+    (errorStream ? *errorStream : std::cout) << "Error: " << s << std::endl;
     return nullptr;
 }
 
@@ -36,7 +43,7 @@ static std::unique_ptr<ast::PrototypeAST> logErrorP(std::string s) {
 static std::unique_ptr<ast::ExprAST> parseExpression(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo);
 
 static std::unique_ptr<ast::ExprAST> parseNumberExpr(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
-    auto result = std::make_unique<ast::NumberExprAST>(numVal, llvmContext, ksDebugInfo);
+    auto result = ast::makeNode<ast::NumberExprAST>(numVal);
     getNextToken();
     return std::move(result);
 }
@@ -61,7 +68,7 @@ static std::unique_ptr<ast::ExprAST> parseIdentifierExpr(const std::shared_ptr<L
     getNextToken();
 
     if (curTok != '(') {
-        return std::make_unique<ast::VariableExprAST>(litLoc, idName, llvmContext, ksDebugInfo);
+        return ast::makeNode<ast::VariableExprAST>(litLoc, idName);
     }
 
     getNextToken();
@@ -86,7 +93,7 @@ static std::unique_ptr<ast::ExprAST> parseIdentifierExpr(const std::shared_ptr<L
     }
 
     getNextToken();
-    return std::make_unique<ast::CallexprAST>(litLoc, idName, std::move(args), llvmContext, ksDebugInfo);
+    return ast::makeNode<ast::CallexprAST>(litLoc, idName, std::move(args));
 }
 
 static std::unique_ptr<ast::ExprAST> parseIfExpr(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
@@ -119,7 +126,7 @@ static std::unique_ptr<ast::ExprAST> parseIfExpr(const std::shared_ptr<LLVMConte
         return nullptr;
     }
 
-    return std::make_unique<ast::IfExprAST>(ifLoc, std::move(cond), std::move(then), std::move(else_), llvmContext, ksDebugInfo);
+    return ast::makeNode<ast::IfExprAST>(ifLoc, std::move(cond), std::move(then), std::move(else_));
 }
 
 static std::unique_ptr<ast::ExprAST> parseForExpr(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
@@ -171,7 +178,7 @@ static std::unique_ptr<ast::ExprAST> parseForExpr(const std::shared_ptr<LLVMCont
         return nullptr;
     }
 
-    return std::make_unique<ast::ForExprAST>(idName, std::move(start), std::move(end), std::move(step), std::move(body), llvmContext, ksDebugInfo);
+    return ast::makeNode<ast::ForExprAST>(idName, std::move(start), std::move(end), std::move(step), std::move(body));
 }
 
 static std::unique_ptr<ast::ExprAST> parseVarExpr(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
@@ -217,7 +224,7 @@ static std::unique_ptr<ast::ExprAST> parseVarExpr(const std::shared_ptr<LLVMCont
     if (!body) {
         return nullptr;
     }
-    return std::make_unique<ast::VarExprAST>(std::move(varNames), std::move(body), llvmContext, ksDebugInfo);
+    return ast::makeNode<ast::VarExprAST>(std::move(varNames), std::move(body));
 }
 
 static std::unique_ptr<ast::ExprAST> parsePrimary(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
@@ -247,7 +254,7 @@ static std::unique_ptr<ast::ExprAST> parseUnary(const std::shared_ptr<LLVMContex
     auto opC = curTok;
     getNextToken();
     if (auto operand = parseUnary(llvmContext, ksDebugInfo)) {
-        return std::make_unique<ast::UnaryExprAST>(opC, std::move(operand), llvmContext, ksDebugInfo);
+        return ast::makeNode<ast::UnaryExprAST>(opC, std::move(operand));
     }
     return nullptr;
 }
@@ -279,7 +286,7 @@ static std::unique_ptr<ast::ExprAST> parseBinOpRHS(int exprPrec,
             }
         }
 
-        lhs = std::make_unique<ast::BinaryExprAST>(binLoc, binOp, std::move(lhs), std::move(rhs), llvmContext, ksDebugInfo);
+        lhs = ast::makeNode<ast::BinaryExprAST>(binLoc, binOp, std::move(lhs), std::move(rhs));
     }
 }
 
@@ -353,10 +360,11 @@ static std::unique_ptr<ast::PrototypeAST> parsePrototype(const std::shared_ptr<L
     if (kind && argNames.size() != kind) {
         return logErrorP("Invalid number of operands for operator"s);
     }
-    return std::make_unique<ast::PrototypeAST>(fnLoc, fnName, std::move(argNames), llvmContext, kind != 0, binaryPrecedence);
+    return ast::makeNode<ast::PrototypeAST>(fnLoc, fnName, std::move(argNames), llvmContext, kind != 0, binaryPrecedence);
 }
 
 static std::unique_ptr<ast::FunctionAST> parseDefinition(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+    PhaseTimer timer{TimeReport::Parse};
     getNextToken();
     auto proto = parsePrototype(llvmContext, ksDebugInfo);
     if (proto == nullptr) {
@@ -364,34 +372,90 @@ static std::unique_ptr<ast::FunctionAST> parseDefinition(const std::shared_ptr<L
     }
 
     if (auto e = parseExpression(llvmContext, ksDebugInfo)) {
-        return std::make_unique<ast::FunctionAST>(std::move(proto), std::move(e), llvmContext, ksDebugInfo);
+        // register the operator now so the definitions that follow parse with
+        // it, even when they are parsed ahead of this one's codegen.
+        if (proto->isBinaryOp()) {
+            llvmContext->addToBinOpPrecedence(std::make_pair(proto->getOperatorName(), proto->getBinaryPrecedence()));
+        }
+        return ast::makeNode<ast::FunctionAST>(std::move(proto), std::move(e), llvmContext, ksDebugInfo);
     }
     return nullptr;
 }
 
-static std::unique_ptr<ast::FunctionAST> parseTopLevelExpr(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+static std::unique_ptr<ast::FunctionAST> parseTopLevelExpr(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo,
+                                                          const std::string &name = "__anon_expr") {
+    PhaseTimer timer{TimeReport::Parse};
     SourceLocation fnLoc = curLoc;
     if (auto e = parseExpression(llvmContext, ksDebugInfo)) {
-        auto proto = std::make_unique<ast::PrototypeAST>(fnLoc, "__anon_expr",
-                                                         std::vector<std::string>{}, llvmContext);
-        return std::make_unique<ast::FunctionAST>(std::move(proto), std::move(e), llvmContext, ksDebugInfo);
+        auto proto = ast::makeNode<ast::PrototypeAST>(fnLoc, name,
+                                                      std::vector<std::string>{}, llvmContext);
+        return ast::makeNode<ast::FunctionAST>(std::move(proto), std::move(e), llvmContext, ksDebugInfo);
     }
     return nullptr;
 }
 
 static std::unique_ptr<ast::PrototypeAST> parseExtern(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+    PhaseTimer timer{TimeReport::Parse};
     getNextToken();
-    return parsePrototype(llvmContext, ksDebugInfo);
+    auto proto = parsePrototype(llvmContext, ksDebugInfo);
+    // an extern binary operator is used like one defined here, so what
+    // follows must parse with its precedence.
+    if (proto && proto->isBinaryOp()) {
+        llvmContext->addToBinOpPrecedence(std::make_pair(proto->getOperatorName(), proto->getBinaryPrecedence()));
+    }
+    return proto;
 }
 
-static void handleDefinition(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
-    if (auto fnAst = parseDefinition(llvmContext, ksDebugInfo)) {
-        if (auto *fnIR = fnAst->codegen()) {
+static void codegenDefinition(std::unique_ptr<ast::FunctionAST> fnAst, const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+    // re-reading an unchanged definition keeps the code the JIT already has.
+    auto key = fnAst->definitionKey();
+    if (llvmContext->getJit() && llvmContext->isDefinitionCurrent(fnAst->getName(), key)) {
+        return;
+    }
+
+    if (auto *fnIR = fnAst->codegen()) {
 /*            std::cout << "Read function definition:" << std::endl;
             fnIR->print(llvm::errs());
             std::cout << std::endl;*/
-//            llvmContext->handleDefinition();
+        if (llvmContext->getJit()) {
+            auto err = llvmContext->handleDefinition(fnIR->getName().str(), std::move(key));
+            ksDebugInfo->resetCompileUnit();
+            if (err) {
+                logError(llvm::toString(std::move(err)));
+            }
         }
+    }
+}
+
+static void codegenExtern(std::unique_ptr<ast::PrototypeAST> protoAst, const std::shared_ptr<LLVMContext> &llvmContext) {
+    if (protoAst->codegen()) {
+        auto name = protoAst->getName();
+        llvmContext->getSymbols().exchange(name, std::move(protoAst));
+    }
+}
+
+static void codegenTopLevelExpression(std::unique_ptr<ast::FunctionAST> fnAst, const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+    auto *fnIR = fnAst->codegen();
+    if (!fnIR || !llvmContext->getJit()) {
+        return;
+    }
+/*                   std::cout << "Read top-level expression:" << std::endl;
+                   fnIR->print(llvm::errs());
+
+                   std::cout << std::endl;*/
+
+    auto result = llvmContext->handleTopLevelExprJit(fnIR->getName().str());
+    ksDebugInfo->resetCompileUnit();
+    if (!result) {
+        logError(llvm::toString(result.takeError()));
+        return;
+    }
+    std::cout << "Evaluated to " << *result << std::endl;
+}
+
+static void handleDefinition(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+    if (auto fnAst = parseDefinition(llvmContext, ksDebugInfo)) {
+        codegenDefinition(std::move(fnAst), llvmContext, ksDebugInfo);
     } else {
         getNextToken();
     }
@@ -399,12 +463,7 @@ static void handleDefinition(const std::shared_ptr<LLVMContext> &llvmContext, co
 
 static void handleExtern(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
     if (auto protoAst = parseExtern(llvmContext, ksDebugInfo)) {
-        if (auto *fnIR = protoAst->codegen()) {
-/*            std::cout << "Read extern: " << std::endl;
-            fnIR->print(llvm::errs());
-            std::cout << std::endl;*/
-            ast::functionProtos[protoAst->getName()] = std::move(protoAst);
-        }
+        codegenExtern(std::move(protoAst), llvmContext);
     } else {
         getNextToken();
     }
@@ -412,22 +471,13 @@ static void handleExtern(const std::shared_ptr<LLVMContext> &llvmContext, const
 
 static void handleTopLevelExpression(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
     if (auto fnAst = parseTopLevelExpr(llvmContext, ksDebugInfo)) {
-        fnAst->codegen();
-/*       if (auto *fnIR = fnAst->codegen()) {
-                   std::cout << "Read top-level expression:" << std::endl;
-                   fnIR->print(llvm::errs());
-
-                   std::cout << std::endl;
-
-            llvmContext->handleTopLevelExprJit();
-            fnIR->eraseFromParent();
-        }*/
+        codegenTopLevelExpression(std::move(fnAst), llvmContext, ksDebugInfo);
     } else {
         getNextToken();
     }
 }
 
-static void mainLoop(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+static inline void mainLoop(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
     while (true) {
         std::cout << "ready> ";
         switch (curTok) {
@@ -447,4 +497,6 @@ static void mainLoop(const std::shared_ptr<LLVMContext> &llvmContext, const std:
                 break;
         }
     }
-}
\ No newline at end of file
+}
+
+#endif // KALEIDOSCOPE_PARSER_H
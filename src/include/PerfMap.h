@@ -0,0 +1,69 @@
+#ifndef KALEIDOSCOPE_PERFMAP_H
+#define KALEIDOSCOPE_PERFMAP_H
+
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// PerfMapListener - appends every function the JIT loads to
+/// /tmp/perf-<pid>.map, the plain symbol table perf falls back to for
+/// addresses outside any mapped file. Unlike jitdump it needs no
+/// `perf inject` step, but gives names only, no source lines, and the
+/// entries of freed code stay in the file. There is one map per process,
+/// so every JIT in it shares the listener returned by get().
+class PerfMapListener: public llvm::JITEventListener {
+    std::mutex mutex;
+    std::unique_ptr<llvm::raw_fd_ostream> out;
+
+    PerfMapListener() {
+        std::error_code ec;
+        auto path = "/tmp/perf-" + std::to_string(::getpid()) + ".map";
+        out = std::make_unique<llvm::raw_fd_ostream>(path, ec, llvm::sys::fs::OF_Text);
+        if (ec) {
+            llvm::errs() << "Could not open " << path << ": " << ec.message() << "\n";
+            out.reset();
+        }
+    }
+public:
+    static PerfMapListener& get() {
+        static PerfMapListener listener{};
+        return listener;
+    }
+
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile &obj,
+                            const llvm::RuntimeDyld::LoadedObjectInfo &info) override {
+        if (!out) {
+            return;
+        }
+
+        // the debug object carries the addresses the sections were loaded at.
+        auto debugObj = info.getObjectForDebug(obj);
+        const auto &loaded = debugObj.getBinary() ? *debugObj.getBinary() : obj;
+
+        std::lock_guard<std::mutex> lock{mutex};
+        for (const auto &symbolSize: llvm::object::computeSymbolSizes(loaded)) {
+            const auto &symbol = symbolSize.first;
+            auto type = symbol.getType();
+            if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+                llvm::consumeError(type.takeError());
+                continue;
+            }
+            auto name = symbol.getName();
+            auto address = symbol.getAddress();
+            if (!name || !address) {
+                llvm::consumeError(name.takeError());
+                llvm::consumeError(address.takeError());
+                continue;
+            }
+            *out << llvm::format("%llx %llx ", (unsigned long long)*address, (unsigned long long)symbolSize.second)
+                 << *name << "\n";
+        }
+        out->flush();
+    }
+};
+
+#endif // KALEIDOSCOPE_PERFMAP_H
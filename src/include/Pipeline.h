@@ -0,0 +1,135 @@
+#include <condition_variable>
+#include <deque>
+#include <sstream>
+#include <thread>
+#include "Parser.h"
+
+/// BoundedQueue - blocking single-producer/single-consumer hand-off with a
+/// fixed capacity, so a fast parser cannot run arbitrarily far ahead.
+template <typename T>
+class BoundedQueue {
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<T> items;
+    size_t capacity;
+public:
+    explicit BoundedQueue(size_t capacity): capacity(std::max<size_t>(capacity, 1)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock{mutex};
+        notFull.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+    }
+
+    T pop() {
+        std::unique_lock<std::mutex> lock{mutex};
+        notEmpty.wait(lock, [this] { return !items.empty(); });
+        auto item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return item;
+    }
+};
+
+/// PipelineItem - one step of mainLoop() as seen by the parser thread. The
+/// prompt and parse diagnostics are buffered so the codegen thread can print
+/// them in input order, exactly where the serial loop would have.
+struct PipelineItem {
+    enum Kind {
+        Text,
+        Definition,
+        Extern,
+        TopLevel,
+        Eof
+    } kind = Text;
+    std::string output;
+    std::unique_ptr<ast::FunctionAST> function;
+    std::unique_ptr<ast::PrototypeAST> proto;
+};
+
+static void parserLoop(BoundedQueue<PipelineItem> &queue, const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo) {
+    std::ostringstream out;
+    errorStream = &out;
+    out << "ready> ";
+    getNextToken();
+
+    while (true) {
+        PipelineItem item{};
+        out << "ready> ";
+        switch (curTok) {
+            case tokEof:
+                item.kind = PipelineItem::Eof;
+                break;
+            case ';':
+                getNextToken();
+                break;
+            case tokDef:
+                if ((item.function = parseDefinition(llvmContext, ksDebugInfo))) {
+                    item.kind = PipelineItem::Definition;
+                } else {
+                    getNextToken();
+                }
+                break;
+            case tokExtern:
+                if ((item.proto = parseExtern(llvmContext, ksDebugInfo))) {
+                    item.kind = PipelineItem::Extern;
+                } else {
+                    getNextToken();
+                }
+                break;
+            default:
+                if ((item.function = parseTopLevelExpr(llvmContext, ksDebugInfo))) {
+                    item.kind = PipelineItem::TopLevel;
+                } else {
+                    getNextToken();
+                }
+                break;
+        }
+
+        item.output = out.str();
+        out.str("");
+        auto done = item.kind == PipelineItem::Eof;
+        queue.push(std::move(item));
+        if (done) {
+            break;
+        }
+    }
+    errorStream = nullptr;
+}
+
+/// pipelinedMainLoop - mainLoop() with parsing moved onto its own thread.
+///
+/// The calling thread takes parsed items off a bounded queue and codegens
+/// them in order, so reading the next definition overlaps with compiling the
+/// previous one. With a concurrent JIT, calls to definitions that have not
+/// been compiled yet are resolved by ORC lookups that compile them on the
+/// pool (see LLVMContext::flushJitErrors for how their errors stay ordered).
+static void pipelinedMainLoop(const std::shared_ptr<LLVMContext> &llvmContext, const std::shared_ptr<ast::DebugInfo> &ksDebugInfo, size_t depth) {
+    BoundedQueue<PipelineItem> queue{depth};
+    std::thread parser{[&] { parserLoop(queue, llvmContext, ksDebugInfo); }};
+
+    while (true) {
+        auto item = queue.pop();
+        std::cout << item.output << std::flush;
+
+        if (item.kind == PipelineItem::Eof) {
+            break;
+        }
+        switch (item.kind) {
+            case PipelineItem::Definition:
+                codegenDefinition(std::move(item.function), llvmContext, ksDebugInfo);
+                break;
+            case PipelineItem::Extern:
+                codegenExtern(std::move(item.proto), llvmContext);
+                break;
+            case PipelineItem::TopLevel:
+                codegenTopLevelExpression(std::move(item.function), llvmContext, ksDebugInfo);
+                break;
+            default:
+                break;
+        }
+    }
+    parser.join();
+}
@@ -0,0 +1,158 @@
+#ifndef KALEIDOSCOPE_PROFILEDATA_H
+#define KALEIDOSCOPE_PROFILEDATA_H
+
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include "llvm/IR/Function.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/ProfileSummary.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+/// ProfileData - counters of an --instrument run, read back for
+/// --profile-use.
+///
+/// The file is the report Instrumentation::writeReport() writes:
+///
+///   {"format": "kaleidoscope-counters", "version": 1,
+///    "functions": [{"name": "fib", "entry": 158540,
+///                   "sites": [{"index": 0, "line": 2, "then": 79321, "else": 79219}]}]}
+///
+/// Sites are the ifs ("then"/"else") and loops ("backedge"/"exit") of a
+/// function, numbered in codegen order; a profile only applies as long as
+/// the function's source keeps the same shape. Readers ignore keys they do
+/// not know, and a format change that old readers would misread bumps the
+/// version.
+class ProfileData {
+public:
+    static constexpr int version = 1;
+
+    struct FunctionProfile {
+        uint64_t entry = 0;
+        std::map<unsigned, std::map<std::string, uint64_t>> sites;
+    };
+
+private:
+    std::map<std::string, FunctionProfile> functions;
+    std::unique_ptr<llvm::ProfileSummary> summary;
+    uint64_t hotThreshold = 0;
+
+public:
+    static llvm::Expected<std::shared_ptr<ProfileData>> load(const std::string &path) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            return llvm::createStringError(buffer.getError(), "could not read %s: %s", path.c_str(),
+                                           buffer.getError().message().c_str());
+        }
+        auto json = llvm::json::parse((*buffer)->getBuffer());
+        if (!json) {
+            return json.takeError();
+        }
+
+        auto *root = json->getAsObject();
+        if (!root || root->getString("format") != llvm::StringRef{"kaleidoscope-counters"}) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s is not a counter report", path.c_str());
+        }
+        auto fileVersion = root->getInteger("version");
+        if (!fileVersion || *fileVersion != version) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s has an unsupported version", path.c_str());
+        }
+
+        auto profile = std::make_shared<ProfileData>();
+        llvm::InstrProfSummaryBuilder builder{llvm::ProfileSummaryBuilder::DefaultCutoffs};
+        if (auto *functions = root->getArray("functions")) {
+            for (const auto &value: *functions) {
+                auto *function = value.getAsObject();
+                auto name = function ? function->getString("name") : llvm::None;
+                if (!name) {
+                    continue;
+                }
+                auto &fp = profile->functions[name->str()];
+                fp.entry = function->getInteger("entry").getValueOr(0);
+                std::vector<uint64_t> counts{fp.entry};
+
+                if (auto *sites = function->getArray("sites")) {
+                    for (const auto &siteValue: *sites) {
+                        auto *site = siteValue.getAsObject();
+                        auto index = site ? site->getInteger("index") : llvm::None;
+                        if (!index) {
+                            continue;
+                        }
+                        auto &siteCounts = fp.sites[*index];
+                        for (const auto &kv: *site) {
+                            if (kv.first != "index" && kv.first != "line") {
+                                if (auto count = kv.second.getAsInteger()) {
+                                    siteCounts[kv.first.str()] = *count;
+                                    counts.push_back(*count);
+                                }
+                            }
+                        }
+                    }
+                }
+                // the summary takes the first count as the function's entry.
+                builder.addRecord(llvm::InstrProfRecord{std::move(counts)});
+            }
+        }
+        profile->summary = builder.getSummary();
+        profile->hotThreshold = llvm::ProfileSummaryBuilder::getHotCountThreshold(profile->summary->getDetailedSummary());
+        return profile;
+    }
+
+    const FunctionProfile* find(const std::string &name) const {
+        auto it = functions.find(name);
+        return it == functions.end() ? nullptr : &it->second;
+    }
+
+    /// annotateModule - the profile summary that lets the inliner and
+    /// codegen tell hot counts from cold ones.
+    void annotateModule(llvm::Module &module) const {
+        module.setProfileSummary(summary->getMD(module.getContext()), llvm::ProfileSummary::PSK_Instr);
+    }
+
+    /// annotateFunction - entry count and hot/cold attribute of `f`. Only
+    /// functions the run never entered are cold: one entered once may still
+    /// hold the hot loop. Functions the profile does not know are left alone.
+    void annotateFunction(llvm::Function &f) const {
+        auto *fp = find(f.getName().str());
+        if (!fp) {
+            return;
+        }
+        f.setEntryCount(fp->entry);
+        if (fp->entry == 0) {
+            f.addFnAttr(llvm::Attribute::Cold);
+        } else if (fp->entry >= hotThreshold) {
+            f.addFnAttr(llvm::Attribute::Hot);
+        }
+    }
+
+    /// branchWeights - !prof weights for a branch on `site` of `function`
+    /// whose successors count `taken` and `notTaken`, or nullptr without
+    /// data. Counts are scaled into 32 bits and offset by one, so that a
+    /// branch never taken in the run is unlikely, not impossible.
+    llvm::MDNode* branchWeights(llvm::LLVMContext &context, const std::string &function, unsigned site,
+                                const char *taken, const char *notTaken) const {
+        auto *fp = find(function);
+        if (!fp) {
+            return nullptr;
+        }
+        auto it = fp->sites.find(site);
+        if (it == fp->sites.end()) {
+            return nullptr;
+        }
+        auto count = [&it](const char *kind) {
+            auto c = it->second.find(kind);
+            return c == it->second.end() ? uint64_t{0} : c->second;
+        };
+        auto t = count(taken), n = count(notTaken);
+        auto scale = std::max(t, n) / std::numeric_limits<uint32_t>::max() + 1;
+        return llvm::MDBuilder{context}.createBranchWeights(uint32_t(t / scale + 1), uint32_t(n / scale + 1));
+    }
+};
+
+#endif // KALEIDOSCOPE_PROFILEDATA_H
@@ -0,0 +1,69 @@
+#ifndef KALEIDOSCOPE_PROFILER_H
+#define KALEIDOSCOPE_PROFILER_H
+
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Profiler - sampling profiler for JIT'd code that needs no perf access.
+///
+/// A SIGPROF interval timer interrupts the program; the handler records the
+/// interrupted pc and walks the frame-pointer chain of the thread that called
+/// start() into a preallocated buffer (nothing else is safe in a signal
+/// handler). The JIT must be registered as a listener and generate functions
+/// with frame pointers (see JitListeners::ProfilerJitListener), so that each
+/// loaded function's address range and line table are known when samples are
+/// symbolized after stop().
+///
+/// Stacks are cut at the outermost JIT'd frame: frames below it belong to the
+/// host and are not built with frame pointers. Native functions called from
+/// JIT'd code (printd, putchard) are named with dladdr.
+class Profiler: public llvm::JITEventListener {
+    struct Function {
+        uint64_t size;
+        std::string name;
+        // (start address, line) rows of the function's line table.
+        std::vector<std::pair<uint64_t, unsigned>> lines;
+    };
+
+    static constexpr size_t maxDepth = 64;
+
+    std::mutex mutex;
+    std::map<uint64_t, Function> functions;
+    unsigned intervalUs = 1000;
+    size_t maxSamples = 0;
+    std::vector<uintptr_t> buffer;
+    uintptr_t stackLow = 0;
+    uintptr_t stackHigh = 0;
+    std::atomic<size_t> nextSample{0};
+    std::atomic<size_t> otherThreadSamples{0};
+
+    Profiler() = default;
+
+    static void onSignal(int sig, siginfo_t *info, void *context);
+    void record(uintptr_t pc, uintptr_t fp);
+    const Function* findFunction(uint64_t address, uint64_t &start) const;
+public:
+    static Profiler& get();
+
+    /// start - sample the calling thread every intervalUs of CPU time, keeping
+    /// at most maxSamples samples.
+    bool start(unsigned intervalUs, size_t maxSamples);
+    void stop();
+
+    /// writeReport - write the samples as folded stacks (one
+    /// "outer;...;leaf count" line per distinct stack) to foldedPath and print
+    /// the self/total table to `table`.
+    bool writeReport(const std::string &foldedPath, llvm::raw_ostream &table);
+
+    void notifyObjectLoaded(ObjectKey key, const llvm::object::ObjectFile &obj,
+                            const llvm::RuntimeDyld::LoadedObjectInfo &info) override;
+};
+
+#endif // KALEIDOSCOPE_PROFILER_H
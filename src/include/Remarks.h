@@ -0,0 +1,194 @@
+#ifndef KALEIDOSCOPE_REMARKS_H
+#define KALEIDOSCOPE_REMARKS_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/Remarks/BitstreamRemarkSerializer.h"
+#include "llvm/Remarks/RemarkFormat.h"
+#include "llvm/Remarks/RemarkSerializer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// BufferedBitstreamSerializer - a bitstream remark file that parses on its
+/// own (SerializerMode::Standalone).
+///
+/// LLVM's standalone bitstream serializer writes the string table in front
+/// of the first remark, when it does not have the strings of the later ones
+/// yet. This one keeps the remarks, their strings in its table, and writes
+/// them all when it is destroyed.
+class BufferedBitstreamSerializer: public llvm::remarks::RemarkSerializer {
+    std::vector<llvm::remarks::Remark> remarks;
+
+public:
+    explicit BufferedBitstreamSerializer(llvm::raw_ostream &os)
+            : RemarkSerializer(llvm::remarks::Format::Bitstream, os, llvm::remarks::SerializerMode::Standalone) {
+        StrTab.emplace();
+    }
+
+    ~BufferedBitstreamSerializer() override {
+        llvm::remarks::BitstreamRemarkSerializer serializer{OS, llvm::remarks::SerializerMode::Standalone,
+                                                            std::move(*StrTab)};
+        for (const auto &remark: remarks) {
+            serializer.emit(remark);
+        }
+    }
+
+    void emit(const llvm::remarks::Remark &remark) override {
+        remarks.push_back(remark.clone());
+        StrTab->internalize(remarks.back());
+    }
+
+    std::unique_ptr<llvm::remarks::MetaSerializer> metaSerializer(llvm::raw_ostream &os,
+                                                                  llvm::Optional<llvm::StringRef> externalFilename) override {
+        return std::make_unique<llvm::remarks::BitstreamMetaSerializer>(
+                os, llvm::remarks::BitstreamRemarkContainerType::Standalone, &*StrTab, externalFilename);
+    }
+};
+
+/// RemarkCollector - optimization remarks of a compile, for --remarks.
+///
+/// LLVM attaches remark streamers to a single context, but the driver
+/// optimizes every file in a context of its own, on several threads. Each
+/// context gets a diagnostic handler (attach()) that forwards its remarks to
+/// one shared streamer under a lock, so they all end up in one file. Remarks
+/// point into the .ks source through the DILocations codegen attaches, so
+/// they carry no location with -g0.
+class RemarkCollector {
+    struct FunctionRemarks {
+        unsigned passed = 0;
+        unsigned missed = 0;
+        unsigned analysis = 0;
+        std::vector<std::string> missedDetails;
+    };
+
+    struct Handler: public llvm::DiagnosticHandler {
+        RemarkCollector &collector;
+
+        explicit Handler(RemarkCollector &collector): collector(collector) {}
+
+        bool handleDiagnostics(const llvm::DiagnosticInfo &di) override {
+            auto *remark = llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&di);
+            if (!remark) {
+                return false;
+            }
+            collector.record(*remark);
+            return true;
+        }
+
+        bool isAnalysisRemarkEnabled(llvm::StringRef) const override {
+            return true;
+        }
+        bool isMissedOptRemarkEnabled(llvm::StringRef) const override {
+            return true;
+        }
+        bool isPassedOptRemarkEnabled(llvm::StringRef) const override {
+            return true;
+        }
+        bool isAnyRemarkEnabled() const override {
+            return true;
+        }
+    };
+
+    std::unique_ptr<llvm::ToolOutputFile> file;
+    std::unique_ptr<llvm::remarks::RemarkStreamer> remarkStreamer;
+    std::unique_ptr<llvm::LLVMRemarkStreamer> llvmStreamer;
+    std::mutex mutex;
+    std::map<std::string, FunctionRemarks> functions;
+    bool withHotness = false;
+
+    void record(const llvm::DiagnosticInfoOptimizationBase &remark) {
+        std::lock_guard<std::mutex> lock{mutex};
+        llvmStreamer->emit(remark);
+
+        auto &fr = functions[remark.getFunction().getName().str()];
+        if (remark.isPassed()) {
+            ++fr.passed;
+        } else if (remark.isMissed()) {
+            ++fr.missed;
+            std::string detail{};
+            llvm::raw_string_ostream out{detail};
+            auto loc = remark.getLocation();
+            if (loc.isValid()) {
+                out << loc.getRelativePath() << ":" << loc.getLine() << ":" << loc.getColumn() << ": ";
+            }
+            out << remark.getPassName() << ": " << remark.getMsg();
+            fr.missedDetails.push_back(out.str());
+        } else {
+            ++fr.analysis;
+        }
+    }
+
+public:
+    /// create - remarks written to `path` in `format` ("yaml" or
+    /// "bitstream").
+    static llvm::Expected<std::shared_ptr<RemarkCollector>> create(const std::string &path, const std::string &format) {
+        auto parsedFormat = llvm::remarks::parseFormat(format);
+        if (!parsedFormat) {
+            return parsedFormat.takeError();
+        }
+
+        std::error_code ec;
+        auto flags = *parsedFormat == llvm::remarks::Format::YAML ? llvm::sys::fs::OF_Text : llvm::sys::fs::OF_None;
+        auto file = std::make_unique<llvm::ToolOutputFile>(path, ec, flags);
+        if (ec) {
+            return llvm::createStringError(ec, "could not open %s: %s", path.c_str(), ec.message().c_str());
+        }
+        // a file of its own: no object file carries its string table.
+        std::unique_ptr<llvm::remarks::RemarkSerializer> serializer{};
+        if (*parsedFormat == llvm::remarks::Format::Bitstream) {
+            serializer = std::make_unique<BufferedBitstreamSerializer>(file->os());
+        } else {
+            auto created = llvm::remarks::createRemarkSerializer(*parsedFormat, llvm::remarks::SerializerMode::Standalone,
+                                                                 file->os());
+            if (!created) {
+                return created.takeError();
+            }
+            serializer = std::move(*created);
+        }
+
+        auto collector = std::make_shared<RemarkCollector>();
+        collector->file = std::move(file);
+        collector->remarkStreamer = std::make_unique<llvm::remarks::RemarkStreamer>(std::move(serializer),
+                                                                                    llvm::StringRef{path});
+        collector->llvmStreamer = std::make_unique<llvm::LLVMRemarkStreamer>(*collector->remarkStreamer);
+        collector->file->keep();
+        return collector;
+    }
+
+    /// setHotness - annotate remarks with profile counts (--profile-use).
+    void setHotness(bool hotness) {
+        withHotness = hotness;
+    }
+
+    /// attach - send the remarks of every pass run in `context` here.
+    void attach(llvm::LLVMContext &context) {
+        context.setDiagnosticHandler(std::make_unique<Handler>(*this));
+        context.setDiagnosticsHotnessRequested(withHotness);
+    }
+
+    /// printSummary - remark counts per function, with the missed
+    /// optimizations spelled out.
+    void printSummary(llvm::raw_ostream &out) {
+        std::lock_guard<std::mutex> lock{mutex};
+        out << "Optimization remarks by function (" << remarkStreamer->getFilename().getValueOr("") << "):\n";
+        for (const auto &function: functions) {
+            const auto &fr = function.second;
+            out << "  " << function.first << ": " << fr.passed << " passed, " << fr.missed << " missed, "
+                << fr.analysis << " analysis\n";
+            for (const auto &detail: fr.missedDetails) {
+                out << "    missed " << detail << "\n";
+            }
+        }
+    }
+};
+
+#endif // KALEIDOSCOPE_REMARKS_H
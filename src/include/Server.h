@@ -0,0 +1,103 @@
+#ifndef KALEIDOSCOPE_SERVER_H
+#define KALEIDOSCOPE_SERVER_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Wire protocol shared by kal_server and kal_loadgen. Every request and
+// response is a single '\n' terminated line over a Unix stream socket:
+//
+//   compile <source>   ->  ok | error
+//   eval <expression>  ->  ok <value> | error
+//   stats              ->  ok count=<n> p50=<us> p90=<us> p99=<us> max=<us>
+//
+// Kaleidoscope does not care about line breaks, so clients fold multi-line
+// sources onto one line before sending them.
+
+namespace kal {
+
+    static const char *defaultSocketPath = "/tmp/kal_server.sock";
+
+    /// LineReader - buffered '\n' splitter over a socket descriptor.
+    class LineReader {
+        int fd;
+        std::string buffer;
+    public:
+        explicit LineReader(int fd): fd(fd) {}
+
+        bool readLine(std::string &line) {
+            while (true) {
+                auto pos = buffer.find('\n');
+                if (pos != std::string::npos) {
+                    line = buffer.substr(0, pos);
+                    buffer.erase(0, pos + 1);
+                    return true;
+                }
+
+                char chunk[4096];
+                auto n = ::read(fd, chunk, sizeof(chunk));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                buffer.append(chunk, n);
+            }
+        }
+    };
+
+    static bool writeLine(int fd, std::string line) {
+        line += '\n';
+        const char *data = line.data();
+        auto left = line.size();
+        while (left) {
+            auto n = ::write(fd, data, left);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            left -= n;
+        }
+        return true;
+    }
+
+    static bool makeSocketAddress(const std::string &path, sockaddr_un &addr) {
+        if (path.size() >= sizeof(addr.sun_path)) {
+            return false;
+        }
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::strcpy(addr.sun_path, path.c_str());
+        return true;
+    }
+
+    /// percentile - nearest-rank percentile of an already sorted sample.
+    static double percentile(const std::vector<double> &sorted, double p) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        auto rank = static_cast<size_t>(p / 100.0 * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    static std::string formatLatencies(std::vector<double> samples) {
+        std::sort(samples.begin(), samples.end());
+        return "count=" + std::to_string(samples.size()) +
+               " p50=" + std::to_string(percentile(samples, 50)) +
+               " p90=" + std::to_string(percentile(samples, 90)) +
+               " p99=" + std::to_string(percentile(samples, 99)) +
+               " max=" + std::to_string(samples.empty() ? 0.0 : samples.back());
+    }
+}
+
+#endif // KALEIDOSCOPE_SERVER_H
@@ -0,0 +1,346 @@
+#ifndef KALEIDOSCOPE_SLABMEMORYMANAGER_H
+#define KALEIDOSCOPE_SLABMEMORYMANAGER_H
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// SlabPool - large mappings the JIT'd objects of a session are carved out
+/// of, for --jit-slabs.
+///
+/// Every object linked with a SectionMemoryManager maps its own small
+/// regions and changes their permissions section by section; after thousands
+/// of definitions the code is spread over as many mappings. A pool instead
+/// maps slabs of a fixed size, each holding either code (which ends up
+/// read-only and executable) or data (which stays writable), and hands out
+/// page aligned spans of them, so all code of a session sits in a few
+/// contiguous slabs. With huge pages
+/// the slabs are 2 MiB aligned and advised for transparent huge pages; a
+/// huge page is only formed once all of it has the same permissions.
+///
+/// Spans are returned when their object is removed from the JIT, and a slab
+/// with nothing left in it is unmapped, except the last one of its kind.
+class SlabPool {
+public:
+    enum Purpose { Code, Data, NumPurposes };
+
+    struct Span {
+        uint8_t *base = nullptr;
+        size_t size = 0;
+        Purpose purpose = Code;
+    };
+
+    static constexpr size_t hugePageSize = 2 << 20;
+
+    explicit SlabPool(size_t slabSize = 16 << 20, bool hugePages = false):
+            pageSize(llvm::sys::Process::getPageSizeEstimate()), hugePages(hugePages) {
+        this->slabSize = llvm::alignTo(slabSize, hugePages ? hugePageSize : pageSize);
+    }
+
+    ~SlabPool() {
+        for (const auto &slab: slabs) {
+            ::munmap(slab.base, slab.size);
+        }
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    /// allocate - a read-write span of at least `bytes`, nullptr base if
+    /// mapping a new slab failed.
+    Span allocate(Purpose purpose, size_t bytes) {
+        bytes = llvm::alignTo(std::max<size_t>(bytes, 1), pageSize);
+        std::lock_guard<std::mutex> lock{mutex};
+        for (auto &slab: slabs) {
+            if (slab.purpose == purpose) {
+                if (auto *base = slab.take(bytes)) {
+                    return used(Span{base, bytes, purpose});
+                }
+            }
+        }
+        auto *slab = mapSlab(purpose, std::max(bytes, slabSize));
+        if (!slab) {
+            return Span{};
+        }
+        return used(Span{slab->take(bytes), bytes, purpose});
+    }
+
+    /// protect - make a code span read-only and executable, in one call for
+    /// all the sections in it.
+    bool protect(const Span &span) {
+        std::lock_guard<std::mutex> lock{mutex};
+        ++stats.protects;
+        return ::mprotect(span.base, span.size, PROT_READ | PROT_EXEC) == 0;
+    }
+
+    /// release - give a span back; `notedBytes` is what noteSectionBytes()
+    /// counted for its sections.
+    void release(const Span &span, size_t notedBytes) {
+        std::lock_guard<std::mutex> lock{mutex};
+        for (auto it = slabs.begin(); it != slabs.end(); ++it) {
+            if (span.base < it->base || span.base >= it->base + it->size) {
+                continue;
+            }
+            if (span.purpose == Code) {
+                ++stats.protects;
+                ::mprotect(span.base, span.size, PROT_READ | PROT_WRITE);
+            }
+            it->give(span.base, span.size);
+            spanBytes[span.purpose] -= span.size;
+            sectionBytes[span.purpose] -= notedBytes;
+            ++stats.releases;
+
+            auto isLast = std::count_if(slabs.begin(), slabs.end(),
+                                        [&](const Slab &s) { return s.purpose == span.purpose; }) == 1;
+            if (it->inUse == 0 && !isLast) {
+                ::munmap(it->base, it->size);
+                slabBytes[span.purpose] -= it->size;
+                ++stats.unmapped;
+                slabs.erase(it);
+            }
+            return;
+        }
+    }
+
+    /// noteSectionBytes - account for what the sections of a span use.
+    void noteSectionBytes(Purpose purpose, size_t bytes) {
+        std::lock_guard<std::mutex> lock{mutex};
+        sectionBytes[purpose] += bytes;
+    }
+
+    /// print - mapped, handed out and used memory per kind.
+    void print(llvm::raw_ostream &out) {
+        static const char *purposeNames[NumPurposes] = {"code", "data"};
+        std::lock_guard<std::mutex> lock{mutex};
+        out << "JIT slab memory" << (hugePages ? " (huge pages)" : "") << ", "
+            << slabSize / 1024 << " KB slabs:\n"
+            << "  kind   slabs  mapped (KB)  spans (KB)  sections (KB)  slab fill  span use\n";
+        auto percent = [](size_t part, size_t whole) {
+            return whole ? 100.0 * part / whole : 0.0;
+        };
+        for (unsigned p = 0; p < NumPurposes; ++p) {
+            auto count = std::count_if(slabs.begin(), slabs.end(), [p](const Slab &s) { return s.purpose == p; });
+            out << llvm::format("  %-5s %6u %12.1f %11.1f %14.1f %9.1f%% %8.1f%%\n", purposeNames[p], unsigned(count),
+                                slabBytes[p] / 1024.0, spanBytes[p] / 1024.0, sectionBytes[p] / 1024.0,
+                                percent(spanBytes[p], slabBytes[p]), percent(sectionBytes[p], spanBytes[p]));
+        }
+        out << "  " << stats.allocations << " spans allocated, " << stats.releases << " released, "
+            << stats.mapped << " slabs mapped, " << stats.unmapped << " unmapped, " << stats.protects
+            << " mprotect calls\n";
+        out.flush();
+    }
+
+private:
+    struct Slab {
+        uint8_t *base;
+        size_t size;
+        Purpose purpose;
+        size_t inUse = 0;
+        // free spans by offset, coalesced.
+        std::map<size_t, size_t> free{};
+
+        uint8_t* take(size_t bytes) {
+            for (auto it = free.begin(); it != free.end(); ++it) {
+                if (it->second < bytes) {
+                    continue;
+                }
+                auto offset = it->first;
+                auto rest = it->second - bytes;
+                free.erase(it);
+                if (rest) {
+                    free[offset + bytes] = rest;
+                }
+                inUse += bytes;
+                return base + offset;
+            }
+            return nullptr;
+        }
+
+        void give(uint8_t *p, size_t bytes) {
+            auto offset = size_t(p - base);
+            inUse -= bytes;
+            auto next = free.find(offset + bytes);
+            if (next != free.end()) {
+                bytes += next->second;
+                free.erase(next);
+            }
+            auto it = free.emplace(offset, bytes).first;
+            if (it != free.begin()) {
+                auto prev = std::prev(it);
+                if (prev->first + prev->second == offset) {
+                    prev->second += it->second;
+                    free.erase(it);
+                }
+            }
+        }
+    };
+
+    struct Stats {
+        uint64_t allocations = 0;
+        uint64_t releases = 0;
+        uint64_t mapped = 0;
+        uint64_t unmapped = 0;
+        uint64_t protects = 0;
+    };
+
+    size_t pageSize;
+    size_t slabSize;
+    bool hugePages;
+    std::mutex mutex;
+    std::vector<Slab> slabs{};
+    size_t slabBytes[NumPurposes]{};
+    size_t spanBytes[NumPurposes]{};
+    size_t sectionBytes[NumPurposes]{};
+    Stats stats{};
+
+    Slab* mapSlab(Purpose purpose, size_t size) {
+        auto alignment = hugePages ? hugePageSize : pageSize;
+        size = llvm::alignTo(size, alignment);
+        // over-map and trim to get an aligned slab.
+        auto mapped = size + alignment - pageSize;
+        auto *p = static_cast<uint8_t*>(::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+        auto *base = reinterpret_cast<uint8_t*>(llvm::alignTo(reinterpret_cast<uintptr_t>(p), alignment));
+        if (base != p) {
+            ::munmap(p, base - p);
+        }
+        if (base + size != p + mapped) {
+            ::munmap(base + size, (p + mapped) - (base + size));
+        }
+#ifdef MADV_HUGEPAGE
+        if (hugePages) {
+            ::madvise(base, size, MADV_HUGEPAGE);
+        }
+#endif
+        slabs.push_back(Slab{base, size, purpose});
+        slabs.back().free[0] = size;
+        slabBytes[purpose] += size;
+        ++stats.mapped;
+        return &slabs.back();
+    }
+
+    Span used(Span span) {
+        spanBytes[span.purpose] += span.size;
+        ++stats.allocations;
+        return span;
+    }
+};
+
+/// SlabMemoryManager - the memory of one JIT'd object, taken from a SlabPool.
+///
+/// RuntimeDyld announces the total size of the object's code, read-only and
+/// read-write sections up front, so the object gets one code span, which
+/// also holds the read-only data (both are immutable once linked), and one
+/// data span; sections are bump allocated from them and finalizing the
+/// object takes a single mprotect instead of one per section. The spans go
+/// back to the pool when the object is removed from the JIT, which destroys
+/// its memory manager.
+class SlabMemoryManager: public llvm::RTDyldMemoryManager {
+    struct Region {
+        SlabPool::Span span{};
+        // bump offset, alignment padding included.
+        size_t used = 0;
+        // section bytes noted with the pool, given back on release.
+        size_t noted = 0;
+    };
+
+    std::shared_ptr<SlabPool> pool;
+    Region regions[SlabPool::NumPurposes]{};
+    // sections that did not fit the reserved spans.
+    std::vector<Region> overflow{};
+
+    uint8_t* allocate(SlabPool::Purpose purpose, uintptr_t size, unsigned alignment) {
+        alignment = std::max(alignment, 16u);
+        auto &region = regions[purpose];
+        auto offset = llvm::alignTo(region.used, alignment);
+        if (region.span.base && offset + size <= region.span.size) {
+            region.used = offset + size;
+            region.noted += size;
+            pool->noteSectionBytes(purpose, size);
+            return region.span.base + offset;
+        }
+        auto span = pool->allocate(purpose, size);
+        if (!span.base) {
+            return nullptr;
+        }
+        overflow.push_back(Region{span, size, size});
+        pool->noteSectionBytes(purpose, size);
+        return span.base;
+    }
+
+    template <typename F>
+    void forEachRegion(F f) {
+        for (auto &region: regions) {
+            if (region.span.base) {
+                f(region);
+            }
+        }
+        for (auto &region: overflow) {
+            f(region);
+        }
+    }
+public:
+    explicit SlabMemoryManager(std::shared_ptr<SlabPool> pool): pool(std::move(pool)) {}
+
+    ~SlabMemoryManager() override {
+        forEachRegion([this](Region &region) {
+            pool->release(region.span, region.noted);
+        });
+    }
+
+    bool needsToReserveAllocationSpace() override {
+        return true;
+    }
+
+    void reserveAllocationSpace(uintptr_t codeSize, uint32_t codeAlign, uintptr_t roDataSize, uint32_t roDataAlign,
+                                uintptr_t rwDataSize, uint32_t rwDataAlign) override {
+        uintptr_t sizes[SlabPool::NumPurposes] = {
+            roDataSize ? llvm::alignTo(codeSize, roDataAlign) + roDataSize : codeSize, rwDataSize};
+        for (unsigned p = 0; p < SlabPool::NumPurposes; ++p) {
+            if (sizes[p]) {
+                regions[p].span = pool->allocate(SlabPool::Purpose(p), sizes[p]);
+            }
+        }
+    }
+
+    uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment, unsigned, llvm::StringRef) override {
+        return allocate(SlabPool::Code, size, alignment);
+    }
+
+    uint8_t* allocateDataSection(uintptr_t size, unsigned alignment, unsigned, llvm::StringRef,
+                                 bool isReadOnly) override {
+        return allocate(isReadOnly ? SlabPool::Code : SlabPool::Data, size, alignment);
+    }
+
+    bool finalizeMemory(std::string *errMsg) override {
+        auto ok = true;
+        forEachRegion([&](Region &region) {
+            if (region.span.purpose != SlabPool::Code) {
+                return;
+            }
+            llvm::sys::Memory::InvalidateInstructionCache(region.span.base, region.used);
+            if (!pool->protect(region.span)) {
+                ok = false;
+            }
+        });
+        if (!ok && errMsg) {
+            *errMsg = "could not change the permissions of JIT memory";
+        }
+        return !ok;
+    }
+};
+
+#endif // KALEIDOSCOPE_SLABMEMORYMANAGER_H
@@ -0,0 +1,235 @@
+#ifndef KALEIDOSCOPE_SNAPSHOT_H
+#define KALEIDOSCOPE_SNAPSHOT_H
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "Parser.h"
+
+/// PreludeSnapshot - a prelude compiled ahead of time (--snapshot), loaded
+/// into JIT sessions with --prelude.
+///
+/// A prelude in source form is lexed, parsed, codegen'd and compiled by every
+/// session before its first evaluation. A snapshot holds the compiled object
+/// and a table of the prototypes the prelude defines or declares: loading it
+/// maps the file, installs the prototypes (and with them the precedence of
+/// the binary operators) and hands the object to the JIT, which links it on
+/// the first lookup of one of its functions.
+///
+/// The file is little endian: a header (magic, version, target triple,
+/// prototype count, object offset and size), the prototype table (flags,
+/// precedence, name and argument names of each) and the object, 16 byte
+/// aligned. The object is compiled for the small code model and as position
+/// independent code, which both RuntimeDyld and JITLink link anywhere.
+///
+/// Prelude functions are linked as one object and can not be redefined by a
+/// session.
+class PreludeSnapshot {
+public:
+    struct Prototype {
+        std::string name;
+        std::vector<std::string> args;
+        bool isOperator;
+        unsigned precedence;
+    };
+
+    static constexpr llvm::StringLiteral magic{"KALSNAP\x01"};
+    static constexpr uint32_t version = 1;
+
+    /// isSnapshot - whether `contents` starts like a snapshot file.
+    static bool isSnapshot(llvm::StringRef contents) {
+        return contents.startswith(magic);
+    }
+
+    /// definedFunctions - the functions `module` defines. Taken before LTO,
+    /// for write().
+    static std::set<std::string> definedFunctions(const llvm::Module &module) {
+        std::set<std::string> defined{};
+        for (const auto &f: module) {
+            if (!f.isDeclaration()) {
+                defined.insert(f.getName().str());
+            }
+        }
+        return defined;
+    }
+
+    /// write - compile `module` into a snapshot at `path`, with the
+    /// prototypes of `symbols` that are not local to the module. `defined`
+    /// are the functions the prelude defined before LTO (definedFunctions());
+    /// the ones it internalized or dropped are left out, the other symbols
+    /// are externs.
+    static llvm::Error write(llvm::Module &module, const SymbolRegistry &symbols, const std::string &path,
+                             const std::set<std::string> &defined) {
+        auto tm = LLVMContext::createTargetMachine("", llvm::Reloc::PIC_, llvm::CodeModel::Small);
+        if (!tm) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "no target machine for the host");
+        }
+        llvm::SmallVector<char, 0> object{};
+        {
+            PhaseTimer timer{TimeReport::Emit};
+            llvm::raw_svector_ostream out{object};
+            if (!LLVMContext::emitObject(module, *tm, out)) {
+                return llvm::createStringError(llvm::inconvertibleErrorCode(), "could not compile the prelude");
+            }
+        }
+
+        llvm::SmallVector<char, 0> table{};
+        llvm::raw_svector_ostream tableOut{table};
+        llvm::support::endian::Writer tableWriter{tableOut, llvm::support::little};
+        uint32_t count = 0;
+        symbols.forEach([&](const std::string &name, const ast::PrototypeAST &proto) {
+            // functions LTO internalized or dropped are not in the object.
+            auto *f = module.getFunction(name);
+            if (defined.count(name) && (!f || f->isDeclaration() || f->hasLocalLinkage())) {
+                return;
+            }
+            auto isOperator = proto.isUnaryOp() || proto.isBinaryOp();
+            tableWriter.write<uint8_t>(isOperator);
+            tableWriter.write<uint32_t>(proto.getBinaryPrecedence());
+            writeString(tableWriter, name);
+            tableWriter.write<uint16_t>(proto.getNumArgs());
+            for (const auto &arg: proto.getArgs()) {
+                writeString(tableWriter, arg);
+            }
+            ++count;
+        });
+
+        std::error_code ec;
+        llvm::raw_fd_ostream file{path, ec, llvm::sys::fs::OF_None};
+        if (ec) {
+            return llvm::createStringError(ec, "could not open %s: %s", path.c_str(), ec.message().c_str());
+        }
+        auto triple = module.getTargetTriple();
+        auto headerSize = magic.size() + 4 + 4 + 2 + triple.size() + 8 + 8;
+        auto objectOffset = llvm::alignTo(headerSize + table.size(), 16);
+
+        llvm::support::endian::Writer writer{file, llvm::support::little};
+        file << magic;
+        writer.write<uint32_t>(version);
+        writer.write<uint32_t>(count);
+        writeString(writer, triple);
+        writer.write<uint64_t>(objectOffset);
+        writer.write<uint64_t>(object.size());
+        file.write(table.data(), table.size());
+        file.write_zeros(objectOffset - headerSize - table.size());
+        file.write(object.data(), object.size());
+        file.close();
+        if (file.has_error()) {
+            return llvm::createStringError(file.error(), "could not write %s: %s", path.c_str(),
+                                           file.error().message().c_str());
+        }
+        return llvm::Error::success();
+    }
+
+    /// load - map the snapshot at `path`. Snapshots are only loaded on the
+    /// architecture and OS they were written for.
+    static llvm::Expected<std::shared_ptr<const PreludeSnapshot>> load(const std::string &path) {
+        auto buffer = llvm::MemoryBuffer::getFile(path, false, false);
+        if (!buffer) {
+            return llvm::createStringError(buffer.getError(), "could not read %s: %s", path.c_str(),
+                                           buffer.getError().message().c_str());
+        }
+        auto snapshot = std::make_shared<PreludeSnapshot>();
+        snapshot->file = std::move(*buffer);
+        if (auto err = snapshot->parse()) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "%s: %s", path.c_str(),
+                                           llvm::toString(std::move(err)).c_str());
+        }
+        return snapshot;
+    }
+
+    const std::vector<Prototype>& getPrototypes() const {
+        return prototypes;
+    }
+
+    llvm::MemoryBufferRef getObject() const {
+        return object;
+    }
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> file;
+    std::vector<Prototype> prototypes;
+    llvm::MemoryBufferRef object;
+
+    static void writeString(llvm::support::endian::Writer &writer, llvm::StringRef s) {
+        writer.write<uint16_t>(s.size());
+        writer.OS << s;
+    }
+
+    llvm::Error parse() {
+        auto contents = file->getBuffer();
+        if (!isSnapshot(contents)) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "not a prelude snapshot");
+        }
+        llvm::DataExtractor data{contents, true, 8};
+        llvm::DataExtractor::Cursor cursor{magic.size()};
+        auto readString = [&] {
+            auto size = data.getU16(cursor);
+            return data.getBytes(cursor, size).str();
+        };
+
+        auto fileVersion = data.getU32(cursor);
+        auto count = data.getU32(cursor);
+        llvm::Triple triple{readString()};
+        auto objectOffset = data.getU64(cursor);
+        auto objectSize = data.getU64(cursor);
+        for (uint32_t i = 0; cursor && i < count; ++i) {
+            Prototype proto{};
+            proto.isOperator = data.getU8(cursor) != 0;
+            proto.precedence = data.getU32(cursor);
+            proto.name = readString();
+            auto numArgs = data.getU16(cursor);
+            for (unsigned a = 0; cursor && a < numArgs; ++a) {
+                proto.args.push_back(readString());
+            }
+            prototypes.push_back(std::move(proto));
+        }
+        if (!cursor) {
+            return cursor.takeError();
+        }
+        if (fileVersion != version) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "snapshot version %u, expected %u",
+                                           fileVersion, version);
+        }
+        llvm::Triple host{llvm::sys::getProcessTriple()};
+        if (triple.getArch() != host.getArch() || triple.getOS() != host.getOS()) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "snapshot for %s, not for %s",
+                                           triple.str().c_str(), host.str().c_str());
+        }
+        if (objectOffset > contents.size() || objectSize > contents.size() - objectOffset) {
+            return llvm::createStringError(llvm::inconvertibleErrorCode(), "truncated snapshot");
+        }
+        object = llvm::MemoryBufferRef{contents.substr(objectOffset, objectSize), file->getBufferIdentifier()};
+        return llvm::Error::success();
+    }
+};
+
+/// installPrelude - declare the prototypes of `snapshot` in `llvmContext`,
+/// register its binary operators and add its object to the context's JIT.
+inline llvm::Error installPrelude(const std::shared_ptr<const PreludeSnapshot> &snapshot,
+                                  const std::shared_ptr<LLVMContext> &llvmContext) {
+    for (const auto &p: snapshot->getPrototypes()) {
+        auto proto = std::make_shared<ast::PrototypeAST>(SourceLocation{0, 0}, p.name, p.args, llvmContext,
+                                                         p.isOperator, p.precedence);
+        if (proto->isBinaryOp()) {
+            llvmContext->addToBinOpPrecedence(std::make_pair(proto->getOperatorName(), proto->getBinaryPrecedence()));
+        }
+        llvmContext->getSymbols().exchange(p.name, std::move(proto));
+    }
+    return llvmContext->addPreludeObject(snapshot->getObject(), snapshot);
+}
+
+#endif // KALEIDOSCOPE_SNAPSHOT_H
@@ -0,0 +1,62 @@
+#ifndef KALEIDOSCOPE_SYMBOLREGISTRY_H
+#define KALEIDOSCOPE_SYMBOLREGISTRY_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+
+namespace ast {
+    class PrototypeAST;
+}
+
+/// SymbolRegistry - the prototype of every function known to a compilation.
+/// Contexts compiling separate modules share one registry, so a call can be
+/// resolved against a definition in another file; lookups and updates may
+/// come from the threads compiling those modules.
+class SymbolRegistry {
+    mutable std::shared_mutex mutex;
+    std::map<std::string, std::shared_ptr<ast::PrototypeAST>> protos;
+public:
+    std::shared_ptr<ast::PrototypeAST> find(const std::string &name) const {
+        std::shared_lock<std::shared_mutex> lock{mutex};
+        auto it = protos.find(name);
+        return it == protos.end() ? nullptr : it->second;
+    }
+
+    /// exchange - install `proto` for `name` and return the prototype it
+    /// replaces. Installing nullptr removes the entry.
+    std::shared_ptr<ast::PrototypeAST> exchange(const std::string &name, std::shared_ptr<ast::PrototypeAST> proto) {
+        std::unique_lock<std::shared_mutex> lock{mutex};
+        auto &slot = protos[name];
+        auto previous = std::move(slot);
+        slot = std::move(proto);
+        if (!slot) {
+            protos.erase(name);
+        }
+        return previous;
+    }
+
+    /// forEach - call `f(name, prototype)` for every entry, in name order.
+    /// `f` must not modify the registry.
+    template <typename F>
+    void forEach(F f) const {
+        std::shared_lock<std::shared_mutex> lock{mutex};
+        for (const auto &entry: protos) {
+            f(entry.first, *entry.second);
+        }
+    }
+
+    void clear() {
+        // prototypes may own the last reference to a context; release them
+        // outside the lock.
+        std::map<std::string, std::shared_ptr<ast::PrototypeAST>> dropped{};
+        {
+            std::unique_lock<std::shared_mutex> lock{mutex};
+            dropped.swap(protos);
+        }
+    }
+};
+
+#endif // KALEIDOSCOPE_SYMBOLREGISTRY_H
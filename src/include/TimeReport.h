@@ -0,0 +1,145 @@
+#ifndef KALEIDOSCOPE_TIMEREPORT_H
+#define KALEIDOSCOPE_TIMEREPORT_H
+
+#include <time.h>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// TimeReport - where compile time goes, for --time-report.
+///
+/// Compilation is split into phases. A PhaseTimer charges the time its scope
+/// runs to its phase, minus the time of phases nested in it: the tokens the
+/// parser pulls count as lex, not parse. Phases and counters are process
+/// wide and summed over threads; CPU time is per thread, so with several
+/// threads it may exceed wall time. Lex wall time includes waiting for input
+/// when reading from a terminal.
+///
+/// The report also carries LLVM's own timings: the legacy pass manager's
+/// (code generation) through -time-passes, the new one's (optimization)
+/// through a TimePassesHandler. Those timers are not thread safe, so a timed
+/// compile must run its LLVM pipelines on one thread at a time.
+///
+/// Nothing is measured unless enable() or trackPhases() was called.
+class TimeReport {
+public:
+    enum Phase { Lex, Parse, Codegen, Verify, Optimize, Emit, NumPhases };
+    enum Counter { Tokens, AstNodes, Functions, IrInstructions, NumCounters };
+
+    static TimeReport& get() {
+        static TimeReport report{};
+        return report;
+    }
+
+    /// enable - measure phases and counters and time LLVM's passes.
+    void enable();
+
+    /// trackPhases - measure phases and counters only; for reports that
+    /// charge other costs to the current phase (MemReport).
+    void trackPhases() {
+        tracking.store(true, std::memory_order_relaxed);
+    }
+
+    bool isTracking() const {
+        return tracking.load(std::memory_order_relaxed);
+    }
+
+    static const char* phaseName(Phase phase);
+
+    uint64_t getCount(Counter counter) const {
+        return counters[counter].load(std::memory_order_relaxed);
+    }
+
+    void count(Counter counter, uint64_t n = 1) {
+        if (isTracking()) {
+            counters[counter].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    void charge(Phase phase, uint64_t wallNs, uint64_t cpuNs) {
+        wall[phase].fetch_add(wallNs, std::memory_order_relaxed);
+        cpu[phase].fetch_add(cpuNs, std::memory_order_relaxed);
+    }
+
+    /// registerPassCallbacks - time the passes of a new pass manager pipeline.
+    void registerPassCallbacks(llvm::PassInstrumentationCallbacks &pic);
+
+    /// print - phase table and counters, then LLVM's pass timings. Resets
+    /// the pass timings, so write the JSON first.
+    void print(llvm::raw_ostream &out);
+
+    bool writeJson(const std::string &path);
+
+private:
+    std::atomic<bool> tracking{false};
+    std::atomic<uint64_t> wall[NumPhases]{};
+    std::atomic<uint64_t> cpu[NumPhases]{};
+    std::atomic<uint64_t> counters[NumCounters]{};
+    std::unique_ptr<llvm::TimePassesHandler> passTimes;
+
+    TimeReport() = default;
+};
+
+/// PhaseTimer - charges the lifetime of the scope to a phase of the
+/// TimeReport, pausing the phase it is nested in.
+class PhaseTimer {
+    static inline thread_local PhaseTimer *current = nullptr;
+
+    TimeReport::Phase phase;
+    bool active;
+    PhaseTimer *outer = nullptr;
+    uint64_t wallStart = 0;
+    uint64_t cpuStart = 0;
+
+    static uint64_t now(clockid_t clock) {
+        timespec ts{};
+        clock_gettime(clock, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    void stop(uint64_t wallNow, uint64_t cpuNow) {
+        TimeReport::get().charge(phase, wallNow - wallStart, cpuNow - cpuStart);
+    }
+public:
+    explicit PhaseTimer(TimeReport::Phase phase): phase(phase), active(TimeReport::get().isTracking()) {
+        if (!active) {
+            return;
+        }
+        wallStart = now(CLOCK_MONOTONIC);
+        cpuStart = now(CLOCK_THREAD_CPUTIME_ID);
+        outer = current;
+        if (outer) {
+            outer->stop(wallStart, cpuStart);
+        }
+        current = this;
+    }
+
+    ~PhaseTimer() {
+        if (!active) {
+            return;
+        }
+        auto wallNow = now(CLOCK_MONOTONIC);
+        auto cpuNow = now(CLOCK_THREAD_CPUTIME_ID);
+        stop(wallNow, cpuNow);
+        current = outer;
+        if (outer) {
+            outer->wallStart = wallNow;
+            outer->cpuStart = cpuNow;
+        }
+    }
+
+    /// currentPhase - the innermost phase running on this thread, NumPhases
+    /// outside of any.
+    static TimeReport::Phase currentPhase() {
+        return current ? current->phase : TimeReport::NumPhases;
+    }
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+};
+
+#endif // KALEIDOSCOPE_TIMEREPORT_H
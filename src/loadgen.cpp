@@ -0,0 +1,104 @@
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "llvm/Support/CommandLine.h"
+#include "Server.h"
+
+static llvm::cl::opt<std::string> socketPath("socket", llvm::cl::desc("Unix domain socket of kal_server"),
+                                             llvm::cl::init(kal::defaultSocketPath));
+static llvm::cl::opt<unsigned> numConnections("connections", llvm::cl::desc("Concurrent client connections"),
+                                              llvm::cl::init(8));
+static llvm::cl::opt<unsigned> numRequests("requests", llvm::cl::desc("Evaluations sent per connection"),
+                                           llvm::cl::init(1000));
+static llvm::cl::list<std::string> definitions("define", llvm::cl::desc("Source compiled once before the run"),
+                                               llvm::cl::value_desc("source"));
+static llvm::cl::opt<std::string> expression("expr", llvm::cl::desc("Expression every request evaluates"),
+                                             llvm::cl::init("1 + 2 * 3"));
+
+static int connectToServer() {
+    sockaddr_un addr{};
+    if (!kal::makeSocketAddress(socketPath, addr)) {
+        return -1;
+    }
+    auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool request(int fd, kal::LineReader &reader, const std::string &line, std::string &reply) {
+    return kal::writeLine(fd, line) && reader.readLine(reply);
+}
+
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Load generator for kal_server\n");
+
+    auto control = connectToServer();
+    if (control < 0) {
+        std::cerr << "Could not connect to " << socketPath << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    kal::LineReader controlReader{control};
+    std::string reply;
+
+    for (const auto &def: definitions) {
+        if (!request(control, controlReader, "compile " + def, reply) || reply != "ok") {
+            std::cerr << "compile failed: " << def << std::endl;
+            return 1;
+        }
+    }
+
+    std::mutex samplesMutex;
+    std::vector<double> samples;
+    size_t failures = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (unsigned c = 0; c < numConnections; ++c) {
+        clients.emplace_back([&] {
+            std::vector<double> local;
+            size_t localFailures = 0;
+
+            auto fd = connectToServer();
+            if (fd < 0) {
+                std::lock_guard<std::mutex> lock{samplesMutex};
+                failures += numRequests;
+                return;
+            }
+            kal::LineReader reader{fd};
+            std::string line;
+            for (unsigned i = 0; i < numRequests; ++i) {
+                auto sent = std::chrono::steady_clock::now();
+                if (!request(fd, reader, "eval " + expression, line)) {
+                    localFailures += numRequests - i;
+                    break;
+                }
+                local.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+                if (line.compare(0, 2, "ok") != 0) {
+                    ++localFailures;
+                }
+            }
+            ::close(fd);
+
+            std::lock_guard<std::mutex> lock{samplesMutex};
+            samples.insert(samples.end(), local.begin(), local.end());
+            failures += localFailures;
+        });
+    }
+    for (auto &client: clients) {
+        client.join();
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "requests: " << samples.size() << " failures: " << failures
+              << " throughput: " << samples.size() / seconds << " req/s" << std::endl;
+    std::cout << "client latency (us): " << kal::formatLatencies(samples) << std::endl;
+    if (request(control, controlReader, "stats", reply)) {
+        std::cout << "server: " << reply << std::endl;
+    }
+    ::close(control);
+    return failures ? 1 : 0;
+}
@@ -1,41 +1,219 @@
 #include <iostream>
-#include "Parser.h"
+#include "llvm/Support/CommandLine.h"
+#include "Driver.h"
+#include "JitListenerOptions.h"
+#include "Pipeline.h"
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
-#else
-#define DLLEXPORT
-#endif
+static llvm::cl::opt<bool> useJit("jit", llvm::cl::desc("Evaluate top-level expressions with the JIT instead of writing an object file"));
+static llvm::cl::opt<bool> pipelined("pipeline", llvm::cl::desc("Parse on a separate thread while the previous input is compiled"));
+static llvm::cl::opt<unsigned> pipelineDepth("pipeline-depth", llvm::cl::desc("Parsed inputs that may wait for codegen"),
+                                             llvm::cl::init(64));
+static llvm::cl::opt<unsigned> compileThreads("compile-threads", llvm::cl::desc("Threads the JIT compiles modules on (0 compiles on the looking-up thread)"),
+                                              llvm::cl::init(0));
+static llvm::cl::list<std::string> inputFiles(llvm::cl::Positional, llvm::cl::desc("<input .ks files>"));
+static llvm::cl::opt<std::string> outputFile("o", llvm::cl::desc("Link the input files into one object file"),
+                                             llvm::cl::value_desc("filename"));
+static llvm::cl::opt<unsigned> numJobs("jobs", llvm::cl::desc("Files compiled in parallel (0 uses every core)"),
+                                          llvm::cl::init(0));
+static llvm::cl::opt<std::string> targetTriple("target", llvm::cl::desc("Target triple to compile the input files for (default: the host)"),
+                                               llvm::cl::value_desc("triple"));
+static llvm::cl::opt<bool> astCache("ast-cache", llvm::cl::desc("Load unchanged input files from the AST cached beside them (foo.ks -> foo.kast) instead of parsing them"));
+static llvm::cl::opt<bool> useLto("lto", llvm::cl::desc("Internalize, inline and strip the linked program as a whole (needs -o)"));
+static llvm::cl::list<std::string> exportedNames("export", llvm::cl::desc("Functions that stay external with --lto"),
+                                                 llvm::cl::value_desc("name"), llvm::cl::CommaSeparated);
+static llvm::cl::opt<ast::DebugLevel> debugLevel(llvm::cl::desc("Debug info:"), llvm::cl::init(ast::DebugLevel::Full),
+                                                 llvm::cl::values(clEnumValN(ast::DebugLevel::None, "g0", "No debug info"),
+                                                                  clEnumValN(ast::DebugLevel::LineTablesOnly, "gline-tables-only", "Line locations only"),
+                                                                  clEnumValN(ast::DebugLevel::Full, "g", "Full debug info (default)")));
+static llvm::cl::opt<bool> profile("profile", llvm::cl::desc("Sample the JIT'd program and report where its time goes (needs --jit)"));
+static llvm::cl::opt<std::string> profileOutput("profile-output", llvm::cl::desc("Folded stacks written by --profile"),
+                                                llvm::cl::value_desc("file"), llvm::cl::init("kal_profile.folded"));
+static llvm::cl::opt<unsigned> profileInterval("profile-interval", llvm::cl::desc("Microseconds of CPU time between --profile samples"),
+                                               llvm::cl::init(1000));
+static llvm::cl::opt<bool> instrument("instrument", llvm::cl::desc("Count function entries, branches and loop iterations of the JIT'd program (needs --jit)"));
+static llvm::cl::opt<std::string> instrumentOutput("instrument-output", llvm::cl::desc("Counter report written by --instrument"),
+                                                   llvm::cl::value_desc("file"), llvm::cl::init("kal_counters.json"));
+static llvm::cl::opt<bool> timeReport("time-report", llvm::cl::desc("Report the time each compiler phase and LLVM pass took (compiles on one thread)"));
+static llvm::cl::opt<std::string> timeReportJson("time-report-json", llvm::cl::desc("Also write the --time-report as JSON"),
+                                                 llvm::cl::value_desc("file"));
+static llvm::cl::opt<bool> memReport("mem-report", llvm::cl::desc("Report allocations per compiler phase, AST and IR size and peak memory"));
+static llvm::cl::opt<std::string> remarksFile("remarks", llvm::cl::desc("Write the optimization remarks of compiling files (the optimizer only runs with --lto)"),
+                                              llvm::cl::value_desc("file"));
+static llvm::cl::opt<std::string> remarksFormat("remarks-format", llvm::cl::desc("Format of --remarks: yaml or bitstream"),
+                                                llvm::cl::init("yaml"));
+static llvm::cl::opt<bool> jitSlabs("jit-slabs", llvm::cl::desc("Carve JIT'd code and data out of pooled slabs (utilization shown by --mem-report)"));
+static llvm::cl::opt<unsigned> jitSlabSize("jit-slab-size", llvm::cl::desc("Size of a --jit-slabs slab in MiB"),
+                                           llvm::cl::init(16));
+static llvm::cl::opt<bool> jitHugePages("jit-huge-pages", llvm::cl::desc("Back the --jit-slabs slabs with transparent huge pages"));
+static llvm::cl::opt<bool> jitLink("jitlink", llvm::cl::desc("Link JIT'd objects with JITLink instead of RuntimeDyld"));
+static llvm::cl::opt<bool> writeSnapshot("snapshot", llvm::cl::desc("Write the input files as a prelude snapshot for --prelude (needs -o)"));
+static llvm::cl::opt<std::string> preludeSnapshot("prelude", llvm::cl::desc("Prelude snapshot to load into the --jit session before reading input"),
+                                                  llvm::cl::value_desc("file"));
+static llvm::cl::opt<std::string> profileUse("profile-use", llvm::cl::desc("Optimize for the counts an --instrument run wrote"),
+                                             llvm::cl::value_desc("file"));
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char)X, stderr);
-    return 0;
+/// printReports - the --time-report (and its JSON) and the --mem-report.
+static void printReports() {
+    if (!timeReportJson.empty()) {
+        TimeReport::get().writeJson(timeReportJson);
+    }
+    if (timeReport) {
+        TimeReport::get().print(llvm::errs());
+    }
+    if (memReport) {
+        MemReport::get().print(llvm::errs());
+    }
 }
 
-extern "C" DLLEXPORT double printd(double X) {
-    fprintf(stderr, "%f\n", X);
-    return 0;
-}
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
+
+    if (timeReport || !timeReportJson.empty()) {
+        // LLVM's pass timers must not run on two threads at once.
+        TimeReport::get().enable();
+        numJobs = 1;
+        compileThreads = std::min(1u, unsigned(compileThreads));
+    }
 
-int main() {
-/*    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmPrinter();
-    llvm::InitializeNativeTargetAsmParser();*/
+    if (memReport) {
+        MemReport::get().enable();
+    }
 
-    std::cout << "ready> ";
-    getNextToken();
+    std::shared_ptr<const ProfileData> profileData{};
+    if (!profileUse.empty()) {
+        auto loaded = ProfileData::load(profileUse);
+        if (!loaded) {
+            llvm::errs() << llvm::toString(loaded.takeError()) << "\n";
+            return 1;
+        }
+        profileData = std::move(*loaded);
+    }
+
+    if (!inputFiles.empty()) {
+        if (useJit || pipelined) {
+            llvm::errs() << "--jit and --pipeline read from stdin, not from input files\n";
+            return 1;
+        }
+        if (useLto && outputFile.empty()) {
+            llvm::errs() << "--lto needs an output file (-o)\n";
+            return 1;
+        }
+        if (writeSnapshot && outputFile.empty()) {
+            llvm::errs() << "--snapshot needs an output file (-o)\n";
+            return 1;
+        }
+        if (writeSnapshot && !targetTriple.empty()) {
+            llvm::errs() << "--snapshot is always for the host, not for --target\n";
+            return 1;
+        }
+        DriverOptions options{outputFile, numJobs, useLto, {exportedNames.begin(), exportedNames.end()}, debugLevel, profileData};
+        options.snapshot = writeSnapshot;
+        options.triple = targetTriple;
+        options.astCache = astCache;
+        if (!remarksFile.empty()) {
+            auto remarks = RemarkCollector::create(remarksFile, remarksFormat);
+            if (!remarks) {
+                llvm::errs() << llvm::toString(remarks.takeError()) << "\n";
+                return 1;
+            }
+            options.remarks = std::move(*remarks);
+            options.remarks->setHotness(profileData != nullptr);
+        }
+        auto ok = compileFiles(inputFiles, options);
+        if (options.remarks) {
+            options.remarks->printSummary(llvm::outs());
+        }
+        printReports();
+        return ok ? 0 : 1;
+    }
+
+    if (profile && !useJit) {
+        llvm::errs() << "--profile needs --jit\n";
+        return 1;
+    }
+    if (!remarksFile.empty()) {
+        llvm::errs() << "--remarks needs input files\n";
+        return 1;
+    }
+    if (instrument && !useJit) {
+        llvm::errs() << "--instrument needs --jit\n";
+        return 1;
+    }
+    if (!targetTriple.empty()) {
+        llvm::errs() << "--target needs input files\n";
+        return 1;
+    }
+    if (astCache) {
+        llvm::errs() << "--ast-cache needs input files\n";
+        return 1;
+    }
+    if (!preludeSnapshot.empty() && !useJit) {
+        llvm::errs() << "--prelude needs --jit\n";
+        return 1;
+    }
+
+    if (jitLink && (jitSlabs || jitHugePages)) {
+        llvm::errs() << "--jit-slabs needs RuntimeDyld, not --jitlink\n";
+        return 1;
+    }
 
     auto llvmContext = std::make_shared<LLVMContext>();
+    if (jitLink) {
+        llvmContext->useJitLink();
+    }
+    if (jitSlabs || jitHugePages) {
+        llvmContext->useSlabMemory(size_t(jitSlabSize) << 20, jitHugePages);
+    }
+    if (useJit) {
+        llvmContext->initializeJit(compileThreads, selectedJitListeners() | (profile ? ProfilerJitListener : NoJitListeners));
+    }
+    if (!preludeSnapshot.empty()) {
+        auto snapshot = PreludeSnapshot::load(preludeSnapshot);
+        if (!snapshot) {
+            llvm::errs() << llvm::toString(snapshot.takeError()) << "\n";
+            return 1;
+        }
+        if (auto err = installPrelude(*snapshot, llvmContext)) {
+            llvm::errs() << llvm::toString(std::move(err)) << "\n";
+            return 1;
+        }
+    }
+    if (instrument) {
+        llvmContext->enableInstrumentation();
+    }
+    llvmContext->setProfile(profileData);
+    if (profile && !Profiler::get().start(profileInterval, 1 << 16)) {
+        llvm::errs() << "Could not start the profiler\n";
+        return 1;
+    }
     auto ksDebugInfo = std::make_shared<ast::DebugInfo>(llvmContext);
 
-    ksDebugInfo->theCU = llvmContext->getDBuilder()->createCompileUnit(llvm::dwarf::DW_LANG_C, llvmContext->getDBuilder()->createFile("fib.ks", "/home/sbcd90/Documents/programs/kaleidoscope-llvm/src"),
-                                                     "Kaleidoscope Compiler", false, "", 0);
+    ksDebugInfo->initializeCompileUnit("fib.ks", "/home/sbcd90/Documents/programs/kaleidoscope-llvm/src", debugLevel);
+
+    if (pipelined) {
+        pipelinedMainLoop(llvmContext, ksDebugInfo, pipelineDepth);
+    } else {
+        std::cout << "ready> ";
+        getNextToken();
+        mainLoop(llvmContext, ksDebugInfo);
+    }
 
-    mainLoop(llvmContext, ksDebugInfo);
+    if (profile) {
+        Profiler::get().stop();
+        Profiler::get().writeReport(profileOutput, llvm::errs());
+    }
+    if (instrument && Instrumentation::get().writeReport(instrumentOutput)) {
+        llvm::errs() << "Wrote " << instrumentOutput << "\n";
+    }
 
+    if (!useJit) {
 //    llvmContext->getModule()->print(llvm::errs(), nullptr);
-    llvmContext->initializeTargetRegistry();
-    llvmContext->getDBuilder()->finalize();
+        llvmContext->initializeTargetRegistry();
+        llvmContext->getDBuilder()->finalize();
+    }
+    printReports();
+    if (memReport && llvmContext->getSlabPool()) {
+        llvmContext->getSlabPool()->print(llvm::errs());
+    }
     return 0;
 }
@@ -0,0 +1,341 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "llvm/Support/CommandLine.h"
+#include "Engine.h"
+#include "JitListenerOptions.h"
+#include "Server.h"
+
+static llvm::cl::opt<std::string> socketPath("socket", llvm::cl::desc("Unix domain socket to listen on"),
+                                             llvm::cl::init(kal::defaultSocketPath));
+static llvm::cl::opt<unsigned> numWorkers("workers", llvm::cl::desc("Number of warm JIT sessions"),
+                                          llvm::cl::init(std::max(1u, std::thread::hardware_concurrency())));
+static llvm::cl::opt<unsigned> maxBatch("batch", llvm::cl::desc("Most queued evaluations compiled into one module"),
+                                        llvm::cl::init(32));
+static llvm::cl::opt<std::string> preludeFile("prelude", llvm::cl::desc("Source compiled into every session at startup, or a snapshot of it (kal_llvm --snapshot)"),
+                                              llvm::cl::value_desc("file"));
+
+/// Pending - the reply to one client request. A compile is broadcast to every
+/// worker, so the reply is sent by whichever finishes last.
+struct Pending {
+    std::promise<std::string> response;
+    std::atomic<unsigned> remaining;
+    std::atomic<bool> failed{false};
+
+    explicit Pending(unsigned remaining): remaining(remaining) {}
+
+    void complete(bool ok, const std::string &reply) {
+        if (!ok) {
+            failed = true;
+        }
+        if (--remaining == 0) {
+            response.set_value(failed ? "error" : reply);
+        }
+    }
+};
+
+struct Job {
+    bool isCompile;
+    std::string source;
+    std::shared_ptr<Pending> pending;
+};
+
+/// Prelude - what every session starts with: source to compile or a snapshot.
+struct Prelude {
+    std::string source;
+    std::shared_ptr<const PreludeSnapshot> snapshot;
+};
+
+static std::mutex statsMutex;
+static std::vector<double> latencies;
+static size_t batches = 0;
+static size_t batchedEvals = 0;
+
+class Worker {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::thread thread;
+
+    static std::string formatValue(double value) {
+        std::ostringstream out;
+        out.precision(17);
+        out << "ok " << value;
+        return out.str();
+    }
+
+    void runEvals(kal::Engine &engine, std::vector<Job> &evals) {
+        std::vector<std::string> exprs{};
+        for (const auto &job: evals) {
+            exprs.push_back(job.source);
+        }
+
+        auto results = engine.evaluate(exprs);
+        for (size_t i = 0, e = evals.size(); i != e; ++i) {
+            evals[i].pending->complete(results[i].has_value(), results[i] ? formatValue(*results[i]) : "");
+        }
+
+        std::lock_guard<std::mutex> lock{statsMutex};
+        ++batches;
+        batchedEvals += evals.size();
+    }
+
+    void run(const Prelude &prelude) {
+        kal::Engine engine{selectedJitListeners()};
+        if (prelude.snapshot) {
+            if (!engine.loadPrelude(prelude.snapshot)) {
+                std::cerr << "warning: prelude snapshot failed to load" << std::endl;
+            }
+        } else if (!prelude.source.empty() && !engine.compile(prelude.source)) {
+            std::cerr << "warning: prelude failed to compile" << std::endl;
+        }
+
+        while (true) {
+            std::vector<Job> evals{};
+            Job compile{};
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    // stopping, and everything queued before has been answered.
+                    return;
+                }
+
+                if (jobs.front().isCompile) {
+                    compile = std::move(jobs.front());
+                    jobs.pop_front();
+                } else {
+                    // evaluations that piled up while we were busy share one module.
+                    while (!jobs.empty() && !jobs.front().isCompile && evals.size() < maxBatch) {
+                        evals.push_back(std::move(jobs.front()));
+                        jobs.pop_front();
+                    }
+                }
+            }
+
+            if (compile.pending) {
+                compile.pending->complete(engine.compile(compile.source), "ok");
+            } else {
+                runEvals(engine, evals);
+            }
+        }
+    }
+public:
+    explicit Worker(const Prelude &prelude): thread([this, prelude] { run(prelude); }) {}
+
+    ~Worker() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+
+    void push(Job job) {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            jobs.push_back(std::move(job));
+        }
+        ready.notify_one();
+    }
+};
+
+class Server {
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex broadcastMutex;
+    std::atomic<size_t> nextWorker{0};
+
+    // connection threads by socket; one that has finished moves to finished
+    // until someone joins it.
+    std::mutex connectionsMutex;
+    std::condition_variable closed;
+    std::map<int, std::thread> connections;
+    std::vector<std::thread> finished;
+
+    std::future<std::string> submit(bool isCompile, std::string source) {
+        if (!isCompile) {
+            auto pending = std::make_shared<Pending>(1);
+            auto reply = pending->response.get_future();
+            workers[nextWorker++ % workers.size()]->push(Job{false, std::move(source), pending});
+            return reply;
+        }
+
+        // every session sees definitions in the same order.
+        auto pending = std::make_shared<Pending>(workers.size());
+        auto reply = pending->response.get_future();
+        std::lock_guard<std::mutex> lock{broadcastMutex};
+        for (auto &worker: workers) {
+            worker->push(Job{true, source, pending});
+        }
+        return reply;
+    }
+
+    std::string handle(const std::string &line) {
+        auto space = line.find(' ');
+        auto op = line.substr(0, space);
+        auto arg = space == std::string::npos ? std::string{} : line.substr(space + 1);
+
+        if (op == "compile" || op == "eval") {
+            return submit(op == "compile", std::move(arg)).get();
+        }
+        if (op == "stats") {
+            std::lock_guard<std::mutex> lock{statsMutex};
+            return "ok " + kal::formatLatencies(latencies) +
+                   " avg_batch=" + std::to_string(batches ? double(batchedEvals) / batches : 0.0);
+        }
+        return "error";
+    }
+public:
+    Server(unsigned count, const Prelude &prelude) {
+        for (unsigned i = 0; i < count; ++i) {
+            workers.push_back(std::make_unique<Worker>(prelude));
+        }
+    }
+
+    /// accept - serves a new connection on its own thread.
+    void accept(int fd) {
+        std::vector<std::thread> done{};
+        {
+            // held until the thread is registered, so serve() finds it when it ends.
+            std::lock_guard<std::mutex> lock{connectionsMutex};
+            done.swap(finished);
+            connections.emplace(fd, std::thread{[this, fd] { serve(fd); }});
+        }
+        for (auto &thread: done) {
+            thread.join();
+        }
+    }
+
+    /// stop - ends every connection after its current request is answered, and
+    /// waits for them. Nothing may be accepted meanwhile.
+    void stop() {
+        std::vector<std::thread> done{};
+        {
+            std::unique_lock<std::mutex> lock{connectionsMutex};
+            for (const auto &connection: connections) {
+                // the next read sees end of file, replies can still be written.
+                ::shutdown(connection.first, SHUT_RD);
+            }
+            closed.wait(lock, [this] { return connections.empty(); });
+            done.swap(finished);
+        }
+        for (auto &thread: done) {
+            thread.join();
+        }
+    }
+
+    void serve(int fd) {
+        kal::LineReader reader{fd};
+        std::string line;
+        while (reader.readLine(line)) {
+            auto start = std::chrono::steady_clock::now();
+            auto reply = handle(line);
+            auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+            if (line.compare(0, 5, "stats") != 0) {
+                std::lock_guard<std::mutex> lock{statsMutex};
+                latencies.push_back(elapsed);
+            }
+            if (!kal::writeLine(fd, reply)) {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock{connectionsMutex};
+        auto connection = connections.find(fd);
+        finished.push_back(std::move(connection->second));
+        connections.erase(connection);
+        // closed under the lock, so stop() never shuts down a reused descriptor.
+        ::close(fd);
+        closed.notify_all();
+    }
+};
+
+int main(int argc, char **argv) {
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compile server\n");
+
+    Prelude prelude{};
+    if (!preludeFile.empty()) {
+        std::ifstream in{preludeFile};
+        if (!in) {
+            std::cerr << "Could not open prelude: " << preludeFile << std::endl;
+            return 1;
+        }
+        prelude.source.assign(std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{});
+        if (kal::Engine::isSnapshot(prelude.source)) {
+            // mapped once, every worker links the same object.
+            prelude.source.clear();
+            prelude.snapshot = kal::Engine::loadSnapshot(preludeFile);
+            if (!prelude.snapshot) {
+                return 1;
+            }
+        }
+    }
+
+    // handle shutdown signals on the main thread only.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    sockaddr_un addr{};
+    if (!kal::makeSocketAddress(socketPath, addr)) {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return 1;
+    }
+    ::unlink(socketPath.c_str());
+
+    auto listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        ::listen(listenFd, SOMAXCONN) < 0) {
+        std::cerr << "Could not listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    Server server{numWorkers, prelude};
+    std::atomic<bool> accepting{true};
+    std::thread acceptor{[&server, &accepting, listenFd] {
+        while (true) {
+            auto fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (!accepting) {
+                    return;
+                }
+                continue;
+            }
+            server.accept(fd);
+        }
+    }};
+
+    std::cerr << "listening on " << socketPath << " with " << numWorkers << " workers" << std::endl;
+
+    int sig;
+    sigwait(&signals, &sig);
+
+    // stop accepting (shutdown() wakes the blocked accept), then let the open
+    // connections finish; the workers are joined when server goes out of scope.
+    accepting = false;
+    ::shutdown(listenFd, SHUT_RDWR);
+    acceptor.join();
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+    server.stop();
+
+    {
+        std::lock_guard<std::mutex> lock{statsMutex};
+        std::cerr << "request latency (us): " << kal::formatLatencies(latencies) << std::endl;
+    }
+    return 0;
+}